@@ -5,52 +5,344 @@
 #ifndef ALIEN_CONSOLE_H
 #define ALIEN_CONSOLE_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
+
+#include <ncurses.h>
 
 /*
  * UTILITES
  */
 #define nelem(x) (sizeof(x) / sizeof(x[0]))
-int count_lines(char *);
 
 /*
  * CONFIGURATION
  */
 #define SYSTEM_CONFIG "/etc/alien-console/alien-console.conf"
 #define DEFAULT_CONFIG "/usr/share/alien-console/alien-console.conf"
+#define DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+#define SPLASH_DURATION 7.0 /* seconds */
+#define SPLASH_FPS 30 /* progress bar updates, when showing real progress */
+struct line_table {
+	int width; /* of the content box the text was wrapped to */
+	int lines;
+	const size_t *offsets; /* lines + 1 of them, see struct content */
+};
+
 struct pt_entry {
 	char *folder;
 	char *title;
-	FILE *content;
+	char *content_file; /* relative to pt_params.dirfd */
+	bool follow; /* watch for appended text */
+
+	/* only for entries packed in a bundle, see bundle.c */
+	const char *text; /* or NULL, when content_file is loaded instead */
+	size_t size;
+	uint64_t checksum; /* of the text */
+	const struct line_table *tables; /* precomputed line indices */
+	int num_tables;
 };
 
 struct splash_params {
-	FILE *file;
+	FILE *file; /* or NULL, when the art is packed in a bundle */
+	const char *art;
+	size_t art_size;
 	char *tagline;
 	char *copyright;
-	char *audio_player;
+	char *audio_player; /* empty for no startup sound */
+	double duration; /* seconds the progress bar takes */
+	double min_time; /* seconds, when the bar shows real progress, or < 0 */
 };
 
 struct pt_params {
 	struct splash_params splash;
-	struct pt_entry entries[4];
+	struct pt_entry *entries;
 	int num_entries;
+	int dirfd; /* directory containing the config file */
+	long long cache_size; /* bytes of loaded content to keep around */
+	bool share_line_index; /* with other processes, see share.c */
+	struct bundle *bundle; /* when loaded from a bundle, otherwise NULL */
+	const char *filename; /* parsed from, or NULL */
 };
 
 int parse_config(const char *filename, struct pt_params *params);
+int reparse_config(const char *filename, struct pt_params *params);
 void cleanup_config(struct pt_params *params);
 
+/*
+ * BUNDLES (see bundle.c)
+ */
+#define BUNDLE_MAGIC "ACBUNDLE"
+#define BUNDLE_VERSION 1
+struct bundle;
+int bundle_load(const char *filename, int dirfd, struct pt_params *params);
+void bundle_cleanup(struct pt_params *params);
+int bundle_write(const struct pt_params *params, const int *widths,
+                 int num_widths, const char *filename);
+
+/*
+ * CONTENT FILES
+ */
+struct content {
+	const char *text; /* read-only mapping, NOT nul terminated */
+	size_t size;
+	size_t *line_offsets; /* start of each line, then wrap_pos */
+	size_t line_alloc; /* from line 0 on */
+	size_t head_alloc; /* before line 0, see content_wrap_back() */
+	size_t wrap_pos; /* the text before here has been wrapped */
+	int first_line; /* 0, or less once wrapped back from a resync */
+	int lines; /* so far, see content_wrapped() */
+	int width; /* width the line index was wrapped to */
+	int fd; /* kept open only when following, otherwise -1 */
+	bool packed; /* the text belongs to a bundle, and isn't mapped here */
+	bool failed; /* the text says why the file couldn't be loaded */
+	const struct line_table *tables; /* precomputed, from a bundle */
+	int num_tables;
+
+	/* the file, for sharing line indices with other processes (see share.c) */
+	uint64_t dev, ino;
+	int64_t mtime; /* nanoseconds */
+	const struct shared_index *shared; /* mapped as the line index, or NULL */
+};
+
+int content_guard(void);
+int content_load(int dirfd, const char *filename, bool follow,
+                 struct content *c);
+int content_load_entry(int dirfd, const struct pt_entry *entry,
+                       struct content *c);
+int content_fail(const char *filename, struct content *c);
+int content_wrap(struct content *c, int width);
+int content_wrap_to(struct content *c, int lines);
+int content_wrap_offset(struct content *c, size_t offset);
+void content_resync(struct content *c, size_t offset);
+int content_restart(struct content *c, size_t offset);
+int content_wrap_back(struct content *c, int line);
+int content_find_line(const struct content *c, size_t offset);
+bool content_wrapped(const struct content *c);
+int content_update(struct content *c);
+const char *content_line(const struct content *c, int i, int *len);
+size_t content_cost(const struct content *c);
+void content_free(struct content *c);
+
+/*
+ * SHARED LINE INDICES (see share.c)
+ */
+struct shared_index;
+void share_enable(void);
+bool share_find(struct content *c, int width);
+void share_release(struct content *c);
+void share_publish(const struct content *c);
+
+/*
+ * SEARCH (see search.c)
+ */
+const char *search_find(const char *text, size_t size, const char *pattern,
+                        size_t len);
+const char *search_find_last(const char *text, size_t size,
+                             const char *pattern, size_t len);
+
+/*
+ * GLOBAL SEARCH INDEX (see index.c)
+ */
+#define INDEX_QUERY_WORDS 8
+struct index;
+struct index_hit {
+	int entry;
+	size_t offset; /* of the first occurrence of the first word */
+	unsigned int count; /* occurrences of the first word */
+};
+
+struct index *index_start(const struct pt_params *params);
+int index_fd(struct index *index);
+int index_count(struct index *index);
+bool index_finished(struct index *index);
+int index_progress(struct index *index);
+int index_query(struct index *index, const char *query,
+                struct index_hit *hits, int max);
+void index_stop(struct index *index, bool wait);
+
+/*
+ * BACKGROUND LOADING (see loader.c)
+ */
+struct loader;
+struct loader *loader_start(const struct pt_params *params);
+struct index *loader_index(struct loader *loader);
+double loader_progress(struct loader *loader);
+int loader_take(struct loader *loader, int i, struct content *c);
+struct reload;
+void loader_reload(struct loader *loader, struct reload *reload,
+                   struct index *index);
+void loader_stop(struct loader *loader);
+
+/*
+ * SHARED CONTENT (see store.c)
+ */
+struct store;
+struct store *store_new(struct loader *loader);
+struct content *store_get(struct store *store, int dirfd,
+                          const struct pt_entry *entry, int slot, int width);
+struct content *store_rewrap(struct store *store, int dirfd,
+                             const struct pt_entry *entry, struct content *c,
+                             int width);
+int store_own(struct store *store, int dirfd, const struct pt_entry *entry,
+              struct content **c);
+void store_put(struct store *store, struct content *c);
+void store_forget(struct store *store, const char *content_file);
+void store_free(struct store *store);
+
+/*
+ * HOT RELOADING (see reload.c)
+ */
+struct reload {
+	struct pt_params params;
+	bool *changed; /* for each entry, whether its content file changed */
+};
+struct reloader;
+struct reloader *reload_start(const struct pt_params *params);
+int reload_fd(struct reloader *reloader);
+struct reload *reload_take(struct reloader *reloader);
+void reload_free(struct reload *reload);
+void reload_stop(struct reloader *reloader);
+
+/*
+ * SPLASH ART (see art.c)
+ */
+struct art_run {
+	int y, x, len;
+};
+struct art_diff {
+	struct art_run *runs; /* cells changed from the previous frame */
+	int num_runs;
+};
+struct splash_art {
+	int frames, lines, width;
+	chtype *cells; /* for each frame, lines rows of width cells */
+	double *times; /* seconds into the animation each frame is shown */
+	struct art_diff *diffs;
+};
+
+int art_load(FILE *file, struct splash_art *art);
+int art_load_text(const char *text, size_t size, struct splash_art *art);
+void art_draw(const struct splash_art *art, int frame, int top, int left);
+void art_draw_diff(const struct splash_art *art, int frame, int top, int left);
+int art_frame_at(const struct splash_art *art, double seconds);
+void art_free(struct splash_art *art);
+
 /*
  * SPLASH SCREEN
  */
 
 
-int splash(const struct splash_params *params);
+int splash(const struct splash_params *params, struct loader *loader);
+void splash_report(FILE *f);
 
 /*
  * PERSONAL TERMINAL
  */
-int personal_terminal(struct pt_params *params);
+struct personal_terminal;
+struct personal_terminal *pt_open(struct pt_params *params,
+                                  struct store *store, struct index *index);
+int pt_input(struct personal_terminal *pt);
+int pt_follow_fd(struct personal_terminal *pt);
+int pt_follow(struct personal_terminal *pt);
+void pt_indexed(struct personal_terminal *pt, int indexed);
+bool pt_searching(struct personal_terminal *pt);
+int pt_search_step(struct personal_terminal *pt);
+int pt_reload(struct personal_terminal *pt, struct pt_params *params,
+              const bool *changed, struct index *index);
+void pt_close(struct personal_terminal *pt);
+int pt_content_width(int columns);
+
+/*
+ * EVENT LOOP (see loop.c)
+ */
+struct loop;
+
+struct loop_source {
+	int fd; /* or -1, while it watches nothing */
+	int (*handle)(struct loop *loop, struct loop_source *source);
+	void *data;
+	bool timer; /* see loop_timer() */
+};
+
+struct loop_task {
+	int (*run)(struct loop *loop, struct loop_task *task);
+	void *data;
+	bool queued;
+	struct loop_task *next;
+};
+
+int loop_block_signals(void);
+struct loop *loop_new(void);
+int loop_watch(struct loop *loop, struct loop_source *source, int fd);
+void loop_close(struct loop *loop, struct loop_source *source);
+int loop_timer(struct loop *loop, struct loop_source *source);
+int loop_timer_at(struct loop_source *source, const struct timespec *when);
+void loop_signal(struct loop *loop, int signo, struct loop_source *source);
+void loop_defer(struct loop *loop, struct loop_task *task);
+int loop_run(struct loop *loop);
+void loop_stop(struct loop *loop);
+void loop_free(struct loop *loop);
+bool loop_term_resized(int fd);
+
+/*
+ * STARTUP SOUND (see sound.c)
+ */
+void sound_play(const char *audio_player);
+int sound_watch(struct loop *loop);
+void sound_unwatch(struct loop *loop);
+void sound_stop(void);
+
+/*
+ * SEATS (see server.c)
+ */
+int personal_terminal(struct pt_params *params, struct loader *loader);
+int server(struct pt_params *params, struct loader *loader,
+           char *const ttys[], int num_ttys);
+
+/*
+ * OUTPUT ACCOUNTING (see stats.c)
+ */
+void stats_init(void);
+bool stats_enabled(void);
+void stats_doupdate(void);
+void stats_begin_event(void);
+void stats_end_event(void);
+unsigned long stats_frame_count(void);
+unsigned long stats_event_count(void);
+void stats_totals(unsigned long long *bytes, unsigned long long *writes);
+void stats_toggle_overlay(void);
+const char *stats_overlay(void);
+void stats_report(FILE *f);
+
+/*
+ * STARTUP TRACING (see trace.c)
+ */
+#ifdef TRACE
+struct trace_span {
+	const char *name;
+	uint64_t start;
+};
+
+void trace_init(void);
+void trace_begin(struct trace_span *span, const char *name);
+void trace_end(const struct trace_span *span, const char *detail);
+void trace_finish(void);
+
+#define TRACE_INIT() trace_init()
+#define TRACE_BEGIN(span, name) struct trace_span span; trace_begin(&span, name)
+#define TRACE_END(span) trace_end(&span, NULL)
+#define TRACE_END_DETAIL(span, detail) trace_end(&span, detail)
+#define TRACE_FINISH() trace_finish()
+#else
+#define TRACE_INIT()
+#define TRACE_BEGIN(span, name)
+#define TRACE_END(span)
+#define TRACE_END_DETAIL(span, detail)
+#define TRACE_FINISH()
+#endif
 
 /*
  * ERROR HANDLING (see error.c for an overview)
@@ -61,14 +353,15 @@ enum error {
 	NO_ERROR     = 0,
 	ENARROW      = 1,
 	ESHORT       = 2,
-	EBIGFILE     = 3,
-	EBIGTEXT     = 4,
-	ECONFREAD    = 5,
-	ECONFPARSE   = 6,
-	ECONFSET     = 7,
-	EMEM         = 8,
-	E2MANY       = 9,
-	EBADFILE     = 10,
+	EBIGTEXT     = 3,
+	ECONFREAD    = 4,
+	ECONFPARSE   = 5,
+	ECONFSET     = 6,
+	EMEM         = 7,
+	ENOFOLDERS   = 8,
+	EBADFILE     = 9,
+	EBADBUNDLE   = 10,
+	ETERM        = 11,
 };
 
 const char *error_string(void);
@@ -83,4 +376,19 @@ void _mark_error(const char *file, const char *func, int line);
 void _set_error(int error, const char *file, const char *func, int line);
 #define set_error(error) _set_error(error, __FILE__, __func__, __LINE__)
 
+#define ERROR_STACK_MAX 32
+struct error_frame {
+	const char *file;
+	const char *func;
+	int line;
+};
+struct error_record {
+	int error;
+	int depth;
+	bool overflow;
+	struct error_frame stack[ERROR_STACK_MAX];
+};
+void save_error(struct error_record *record);
+void restore_error(const struct error_record *record);
+
 #endif /* ALIEN_CONSOLE_H */
@@ -0,0 +1,482 @@
+/**
+ * alien-console: splash art
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * The splash art is a text file of any size, which may be colored with ANSI
+ * escape sequences (SGR, like "\033[1;32m"). It's mapped rather than read, and
+ * parsed once into a buffer of cells: a rectangle of chtypes, each holding a
+ * character with its attributes and color pair. So, laying out the splash
+ * screen only needs the dimensions, and drawing a line of it is a single
+ * mvaddchnstr().
+ *
+ * The art may be animated: a form feed character separates frames, and may be
+ * followed by the milliseconds since the previous frame (100 by default), with
+ * the rest of its line ignored. For each frame after the first, the runs of
+ * cells which changed are worked out when loading, so that playing the
+ * animation only draws those (see art_draw_diff()). All frames have the size of
+ * the largest.
+ *
+ * Tabs are expanded to every 8 columns. Other control characters, escape
+ * sequences other than SGR, and bytes outside of ASCII are not drawn, since
+ * there's no telling how wide they are on the terminal.
+ *
+ * Colors are mapped to the 8 colors curses knows. Color pairs are allocated as
+ * combinations of foreground and background turn up, and once the terminal has
+ * no more, the art carries on with just the attributes.
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ncurses.h>
+
+#include "alien-console.h"
+
+#define ART_TAB 8
+#define ART_SGR_MAX 16 /* parameters of one SGR sequence */
+#define ART_FRAME_DELAY 100 /* milliseconds, when a separator gives none */
+#define ART_DELAY_MAX 3600000
+#define ART_RUN_GAP 4 /* unchanged cells a run of changes may span */
+
+/* the current attributes while parsing */
+struct sgr {
+	attr_t attrs;
+	short fg, bg; /* curses colors, or -1 for the default */
+};
+
+/* color pairs for (fg + 1, bg + 1), allocated by art_pair() */
+static short art_pairs[9][9];
+static short art_next_pair = 1;
+
+/**
+ * Return the attribute for the color pair of fg and bg, allocating the pair if
+ * needed, or 0 when the terminal can't display it.
+ */
+static attr_t art_pair(short fg, short bg)
+{
+	short *pair = &art_pairs[fg + 1][bg + 1];
+
+	if (fg < 0 && bg < 0)
+		return 0;
+	if (*pair == 0) {
+		if (!has_colors())
+			return 0;
+		/* COLOR_PAIRS is only known once colors are started */
+		if (art_next_pair == 1) {
+			start_color();
+			use_default_colors();
+		}
+		if (art_next_pair >= COLOR_PAIRS)
+			return 0;
+		if (init_pair(art_next_pair, fg, bg) == ERR)
+			return 0;
+		*pair = art_next_pair++;
+	}
+	return COLOR_PAIR(*pair);
+}
+
+/**
+ * Map a color of the 256 color palette to the nearest of the 8 curses colors,
+ * which have red, green and blue as their bits. Bright colors are shown bold.
+ */
+static short palette_color(int n, attr_t *attrs)
+{
+	int r, g, b;
+
+	if (n < 8)
+		return n;
+	if (n < 16) {
+		*attrs |= A_BOLD;
+		return n - 8;
+	}
+	if (n >= 232) /* grayscale ramp */
+		return n < 244 ? COLOR_BLACK : COLOR_WHITE;
+	n -= 16; /* 6x6x6 cube */
+	r = n / 36;
+	g = n / 6 % 6;
+	b = n % 6;
+	return (r > 2 ? 1 : 0) | (g > 2 ? 2 : 0) | (b > 2 ? 4 : 0);
+}
+
+static short rgb_color(int r, int g, int b)
+{
+	return (r > 127 ? 1 : 0) | (g > 127 ? 2 : 0) | (b > 127 ? 4 : 0);
+}
+
+/**
+ * Apply the parameters of an SGR sequence.
+ */
+static void apply_sgr(struct sgr *sgr, const int *p, int n)
+{
+	int i;
+	short *color;
+	attr_t bold = 0;
+
+	if (n == 0) {
+		sgr->attrs = 0;
+		sgr->fg = sgr->bg = -1;
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		switch (p[i]) {
+		case 0:
+			sgr->attrs = 0;
+			sgr->fg = sgr->bg = -1;
+			break;
+		case 1: sgr->attrs |= A_BOLD; break;
+		case 2: sgr->attrs |= A_DIM; break;
+		case 4: sgr->attrs |= A_UNDERLINE; break;
+		case 5: sgr->attrs |= A_BLINK; break;
+		case 7: sgr->attrs |= A_REVERSE; break;
+		case 22: sgr->attrs &= ~(A_BOLD | A_DIM); break;
+		case 24: sgr->attrs &= ~A_UNDERLINE; break;
+		case 25: sgr->attrs &= ~A_BLINK; break;
+		case 27: sgr->attrs &= ~A_REVERSE; break;
+		case 39: sgr->fg = -1; break;
+		case 49: sgr->bg = -1; break;
+		case 38:
+		case 48:
+			color = p[i] == 38 ? &sgr->fg : &sgr->bg;
+			if (i + 2 < n && p[i + 1] == 5) {
+				*color = palette_color(p[i + 2] & 255, &bold);
+				i += 2;
+			} else if (i + 4 < n && p[i + 1] == 2) {
+				*color = rgb_color(p[i + 2], p[i + 3],
+				                   p[i + 4]);
+				i += 4;
+			} else {
+				i = n; /* can't tell what follows */
+			}
+			if (color == &sgr->fg)
+				sgr->attrs |= bold;
+			break;
+		default:
+			if (p[i] >= 30 && p[i] <= 37) {
+				sgr->fg = p[i] - 30;
+			} else if (p[i] >= 40 && p[i] <= 47) {
+				sgr->bg = p[i] - 40;
+			} else if (p[i] >= 90 && p[i] <= 97) {
+				sgr->fg = p[i] - 90;
+				sgr->attrs |= A_BOLD;
+			} else if (p[i] >= 100 && p[i] <= 107) {
+				sgr->bg = p[i] - 100;
+			}
+		}
+	}
+}
+
+/**
+ * Skip an escape sequence starting at text[pos] (the ESC), applying it if it's
+ * an SGR sequence. Returns the position just past it.
+ */
+static size_t parse_escape(const char *text, size_t pos, size_t size,
+                           struct sgr *sgr)
+{
+	int params[ART_SGR_MAX], n = 0, value = 0;
+	bool digits = false;
+
+	pos++;
+	if (pos >= size)
+		return pos;
+	if (text[pos] != '[')
+		return pos + 1; /* a two character sequence */
+	for (pos++; pos < size; pos++) {
+		if (text[pos] >= '0' && text[pos] <= '9') {
+			value = value * 10 + (text[pos] - '0');
+			if (value > 255 * 255)
+				value = 255 * 255;
+			digits = true;
+		} else if (text[pos] == ';' || text[pos] == ':') {
+			if (n < ART_SGR_MAX)
+				params[n++] = value;
+			value = 0;
+			digits = false;
+		} else if (text[pos] >= 0x40 && text[pos] <= 0x7e) {
+			break; /* the final byte */
+		}
+	}
+	if (pos >= size)
+		return pos;
+	if (text[pos] == 'm') {
+		if ((digits || n > 0) && n < ART_SGR_MAX)
+			params[n++] = value;
+		apply_sgr(sgr, params, n);
+	}
+	return pos + 1;
+}
+
+static inline chtype *art_row(const struct splash_art *art, int frame, int y)
+{
+	return art->cells + ((size_t)frame * art->lines + y) * art->width;
+}
+
+/**
+ * Parse the delay at the start of a frame separator: the milliseconds since the
+ * previous frame, just after the form feed. The rest of the line is skipped.
+ */
+static size_t parse_separator(const char *text, size_t pos, size_t size,
+                              int *delay)
+{
+	bool digits = false;
+
+	*delay = 0;
+	for (; pos < size && text[pos] >= '0' && text[pos] <= '9'; pos++) {
+		if (*delay < ART_DELAY_MAX)
+			*delay = *delay * 10 + (text[pos] - '0');
+		digits = true;
+	}
+	if (!digits)
+		*delay = ART_FRAME_DELAY;
+	while (pos < size && text[pos] != '\n')
+		pos++;
+	return pos < size ? pos + 1 : pos;
+}
+
+/**
+ * Go through the text, measuring it into art (the number of frames, and the
+ * largest lines and width of any), or when art->cells is set, filling in the
+ * cells and frame times too.
+ */
+static void parse_art(const char *text, size_t size, struct splash_art *art)
+{
+	struct sgr sgr = { 0, -1, -1 };
+	chtype *row = art->cells;
+	int x = 0, y = 0, width = 0, lines = 0, frame = 0, next, delay;
+	size_t pos = 0;
+	unsigned char c;
+
+	while (pos < size) {
+		c = text[pos];
+		if (c == '\033') {
+			pos = parse_escape(text, pos, size, &sgr);
+			continue;
+		}
+		pos++;
+		if (c == '\n' || c == '\f') {
+			if (x > width)
+				width = x;
+			if (c == '\n' || x > 0)
+				y++;
+			x = 0;
+		}
+		if (c == '\f') {
+			if (y > lines)
+				lines = y;
+			y = 0;
+			frame++;
+			pos = parse_separator(text, pos, size, &delay);
+			if (art->cells)
+				art->times[frame] = art->times[frame - 1] +
+				                    delay / 1000.0;
+			sgr.attrs = 0;
+			sgr.fg = sgr.bg = -1;
+		}
+		if (c == '\n' || c == '\f') {
+			if (art->cells)
+				row = art_row(art, frame, y);
+			continue;
+		}
+		if (c == '\t') {
+			next = (x / ART_TAB + 1) * ART_TAB;
+			for (; x < next; x++) {
+				if (art->cells)
+					row[x] = ' ' | sgr.attrs |
+					         art_pair(sgr.fg, sgr.bg);
+			}
+			continue;
+		}
+		if (c < ' ' || c > '~')
+			continue;
+		if (art->cells)
+			row[x] = c | sgr.attrs | art_pair(sgr.fg, sgr.bg);
+		x++;
+	}
+	/* a last line with no newline still counts */
+	if (x > width)
+		width = x;
+	if (x > 0)
+		y++;
+	if (y > lines)
+		lines = y;
+	art->frames = frame + 1;
+	art->lines = lines;
+	art->width = width;
+}
+
+/**
+ * Work out the runs of cells which change from the previous frame to this one.
+ * Runs separated by only a few unchanged cells are joined, since moving the
+ * cursor over them would cost about as much as drawing them again.
+ */
+static int diff_frame(struct splash_art *art, int frame)
+{
+	struct art_diff *diff = &art->diffs[frame];
+	struct art_run *runs = NULL, *more;
+	size_t alloc = 0;
+	chtype *prev, *cur;
+	int y, x, i, end, gap;
+
+	diff->runs = NULL;
+	diff->num_runs = 0;
+	for (y = 0; y < art->lines; y++) {
+		prev = art_row(art, frame - 1, y);
+		cur = art_row(art, frame, y);
+		for (x = 0; x < art->width; x = end) {
+			if (prev[x] == cur[x]) {
+				end = x + 1;
+				continue;
+			}
+			/* extend the run over small gaps of unchanged cells */
+			end = x + 1;
+			gap = 0;
+			for (i = end; i < art->width && gap <= ART_RUN_GAP; i++) {
+				if (prev[i] != cur[i]) {
+					end = i + 1;
+					gap = 0;
+				} else {
+					gap++;
+				}
+			}
+			if ((size_t)diff->num_runs == alloc) {
+				alloc = alloc ? alloc * 2 : 16;
+				more = realloc(runs, alloc * sizeof(*runs));
+				if (!more) {
+					free(runs);
+					set_error(EMEM);
+					return -1;
+				}
+				runs = more;
+			}
+			runs[diff->num_runs].y = y;
+			runs[diff->num_runs].x = x;
+			runs[diff->num_runs].len = end - x;
+			diff->num_runs++;
+		}
+	}
+	diff->runs = runs;
+	return 0;
+}
+
+/**
+ * Load the splash art from text in memory, which may be empty. This must be
+ * done once curses is running, since color pairs are allocated as the art is
+ * parsed.
+ */
+int art_load_text(const char *text, size_t size, struct splash_art *art)
+{
+	size_t i, cells;
+	int frame;
+
+	memset(art, 0, sizeof(*art));
+	art->frames = 1;
+	if (size > 0)
+		parse_art(text, size, art);
+
+	cells = (size_t)art->frames * art->lines * art->width;
+	art->cells = malloc((cells ? cells : 1) * sizeof(chtype));
+	art->times = calloc(art->frames, sizeof(double));
+	art->diffs = calloc(art->frames, sizeof(struct art_diff));
+	if (!art->cells || !art->times || !art->diffs) {
+		set_error(EMEM);
+		goto cleanup;
+	}
+	for (i = 0; i < cells; i++)
+		art->cells[i] = ' ';
+	if (size > 0)
+		parse_art(text, size, art);
+
+	for (frame = 1; frame < art->frames; frame++) {
+		if (diff_frame(art, frame) < 0) {
+			mark_error();
+			goto cleanup;
+		}
+	}
+	return 0;
+
+cleanup:
+	art_free(art);
+	return -1;
+}
+
+/**
+ * Load the splash art from a file, see art_load_text().
+ */
+int art_load(FILE *file, struct splash_art *art)
+{
+	struct stat st;
+	const char *text = NULL;
+	int rv;
+
+	if (fstat(fileno(file), &st) < 0) {
+		set_error(ESYS);
+		return -1;
+	}
+	if (st.st_size > 0) {
+		text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		            fileno(file), 0);
+		if (text == MAP_FAILED) {
+			set_error(ESYS);
+			return -1;
+		}
+	}
+	rv = art_load_text(text, st.st_size, art);
+	if (rv < 0)
+		mark_error();
+	if (text)
+		munmap((void *)text, st.st_size);
+	return rv;
+}
+
+/**
+ * Draw a whole frame of the art, with its top left corner at (top, left).
+ */
+void art_draw(const struct splash_art *art, int frame, int top, int left)
+{
+	int y;
+	for (y = 0; y < art->lines; y++)
+		mvaddchnstr(top + y, left, art_row(art, frame, y), art->width);
+}
+
+/**
+ * Draw what changed from the previous frame to this one.
+ */
+void art_draw_diff(const struct splash_art *art, int frame, int top, int left)
+{
+	const struct art_diff *diff = &art->diffs[frame];
+	const struct art_run *run;
+	int i;
+
+	for (i = 0; i < diff->num_runs; i++) {
+		run = &diff->runs[i];
+		mvaddchnstr(top + run->y, left + run->x,
+		            art_row(art, frame, run->y) + run->x, run->len);
+	}
+}
+
+/**
+ * Return the last frame which is due by the given seconds into the animation.
+ */
+int art_frame_at(const struct splash_art *art, double seconds)
+{
+	int frame = 0;
+	while (frame + 1 < art->frames && art->times[frame + 1] <= seconds)
+		frame++;
+	return frame;
+}
+
+void art_free(struct splash_art *art)
+{
+	int frame;
+	if (art->diffs) {
+		for (frame = 0; frame < art->frames; frame++)
+			free(art->diffs[frame].runs);
+	}
+	free(art->diffs);
+	free(art->times);
+	free(art->cells);
+	art->diffs = NULL;
+	art->times = NULL;
+	art->cells = NULL;
+}
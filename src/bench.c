@@ -0,0 +1,595 @@
+/**
+ * alien-console: headless benchmark
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * This runs splash() and personal_terminal() against a pseudo-terminal with a
+ * fixed size, feeding them a script of key presses. For each size of synthetic
+ * content it reports startup time, how long each key press took, peak memory
+ * use and how much was output to the terminal. Every content size runs in its
+ * own child process, so that its peak RSS stands alone.
+ *
+ * The interface runs on the main thread of the child, as usual. A second thread
+ * plays the script: it writes a key to the terminal and waits until the
+ * interface has handled it, which is when the input event is counted (see
+ * stats_event_count()). Meanwhile it reads and discards the terminal output, so
+ * that the interface never blocks writing it.
+ *
+ * Usage: alien-console-bench [SIZE...], where a SIZE is bytes, or a number
+ * followed by K, M or G.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ncurses.h>
+
+#include "alien-console.h"
+
+#define BENCH_TERM "xterm"
+#define BENCH_ROWS 24
+#define BENCH_COLS 80
+#define BENCH_FOLDERS 8
+#define BENCH_BLOCK (1024 * 1024) /* synthetic content is written in blocks */
+
+/*
+ * The script is a list of phases, reported separately. Each phase repeats its
+ * steps, and each step presses a key (named by its terminfo capability) some
+ * number of times.
+ */
+struct step {
+	const char *cap;
+	int times;
+};
+
+struct phase {
+	const char *name;
+	int repeat;
+	struct step steps[2];
+};
+
+static const struct phase script[] = {
+	{ "select", 10, { { "kcud1", BENCH_FOLDERS - 1 },
+	                  { "kcuu1", BENCH_FOLDERS - 1 } } },
+	{ "scroll", 1, { { "kcuf1", 10000 } } },
+	{ "scroll back", 1, { { "kcub1", 10000 } } },
+	{ "page", 1, { { "knp", 1000 }, { "kpp", 1000 } } },
+	{ "home, end", 5, { { "kend", 1 }, { "khome", 1 } } },
+};
+
+static const char *default_sizes[] = { "1K", "1M", "100M", "1G" };
+
+static const char *splash_art =
+	"    _    _     ___ _____ _   _\n"
+	"   / \\  | |   |_ _| ____| \\ | |\n"
+	"  / _ \\ | |    | ||  _| |  \\| |\n"
+	" / ___ \\| |___ | || |___| |\\  |\n"
+	"/_/   \\_\\_____|___|_____|_| \\_|\n";
+
+static const char *words[] = {
+	"the", "crew", "of", "commercial", "towing", "vehicle", "nostromo",
+	"is", "returning", "to", "earth", "with", "twenty", "million", "tons",
+	"mineral", "ore", "special", "order", "937", "science", "officer",
+	"eyes", "only", "priority", "one", "insure", "return", "organism",
+	"for", "analysis", "all", "other", "considerations", "secondary",
+	"expendable",
+};
+
+struct phase_result {
+	int keys;
+	double p50, p90, p99, max; /* milliseconds */
+	unsigned long long bytes;
+};
+
+struct run_result {
+	bool ok;
+	double splash_ms; /* start until splash() returns */
+	double paint_ms; /* splash() returning until the first frame after */
+	unsigned long long startup_bytes;
+	struct phase_result phases[nelem(script)];
+};
+
+/* shared by the interface and script threads of a child */
+static struct {
+	int master;
+	bool done; /* the interface has returned */
+	unsigned long splash_frames; /* frames output by the splash screen */
+	struct timespec start, splash_end;
+	const char *keys[nelem(script)][2];
+	struct run_result result;
+} bench;
+
+static double elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1e3 +
+	       (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Read and discard whatever the interface has output so far.
+ */
+static void drain_output(void)
+{
+	char buf[4096];
+	while (read(bench.master, buf, sizeof(buf)) > 0)
+		;
+}
+
+static bool interface_done(void)
+{
+	return __atomic_load_n(&bench.done, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Press a key and wait until the interface has handled it. Returns the time
+ * taken in milliseconds, or a negative number if the interface returned first.
+ */
+static double press_key(const char *key)
+{
+	struct timespec t0, t1;
+	unsigned long events = stats_event_count();
+	size_t len = strlen(key);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (write(bench.master, key, len) != (ssize_t)len)
+		return -1;
+	while (stats_event_count() == events) {
+		if (interface_done())
+			return -1;
+		drain_output();
+		sched_yield();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return elapsed_ms(&t0, &t1);
+}
+
+/**
+ * Play one phase of the script, summarizing the time taken by its keys.
+ */
+static bool play_phase(int p, struct phase_result *r)
+{
+	const struct phase *phase = &script[p];
+	unsigned long long bytes0, bytes1, writes;
+	double *latency, ms;
+	int i, j, k, n = 0;
+
+	for (j = 0; j < (int)nelem(phase->steps); j++)
+		n += phase->repeat * phase->steps[j].times;
+	latency = calloc(n, sizeof(double));
+	if (!latency)
+		return false;
+
+	stats_totals(&bytes0, &writes);
+	for (n = 0, i = 0; i < phase->repeat; i++) {
+		for (j = 0; j < (int)nelem(phase->steps); j++) {
+			for (k = 0; k < phase->steps[j].times; k++) {
+				ms = press_key(bench.keys[p][j]);
+				if (ms < 0) {
+					free(latency);
+					return false;
+				}
+				latency[n++] = ms;
+			}
+		}
+	}
+	stats_totals(&bytes1, &writes);
+
+	qsort(latency, n, sizeof(double), compare_double);
+	r->keys = n;
+	r->p50 = latency[n / 2];
+	r->p90 = latency[(int)(n * 0.9)];
+	r->p99 = latency[(int)(n * 0.99)];
+	r->max = latency[n - 1];
+	r->bytes = bytes1 - bytes0;
+	free(latency);
+	return true;
+}
+
+/**
+ * Thread which plays the script once the personal terminal is first drawn.
+ */
+static void *play_script(void *arg)
+{
+	struct timespec paint;
+	unsigned long frames;
+	unsigned long long writes;
+	int p;
+
+	(void)arg;
+	/* splash_frames is ULONG_MAX until the splash screen is done */
+	for (;;) {
+		frames = __atomic_load_n(&bench.splash_frames,
+		                         __ATOMIC_ACQUIRE);
+		if (frames != ULONG_MAX && stats_frame_count() > frames)
+			break;
+		if (interface_done())
+			goto exit;
+		drain_output();
+		sched_yield();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &paint);
+	bench.result.paint_ms = elapsed_ms(&bench.splash_end, &paint);
+	stats_totals(&bench.result.startup_bytes, &writes);
+
+	for (p = 0; p < (int)nelem(script); p++) {
+		if (!play_phase(p, &bench.result.phases[p]))
+			goto exit;
+	}
+	bench.result.ok = true;
+
+exit:
+	if (write(bench.master, "q", 1) != 1)
+		perror("alien-console-bench: write");
+	while (!interface_done()) {
+		drain_output();
+		sched_yield();
+	}
+	return NULL;
+}
+
+/**
+ * Look up the key presses of the script for the current terminal.
+ */
+static int lookup_keys(void)
+{
+	int p, j;
+	char *key;
+	for (p = 0; p < (int)nelem(script); p++) {
+		for (j = 0; j < (int)nelem(script[p].steps); j++) {
+			if (!script[p].steps[j].cap)
+				continue;
+			key = tigetstr(script[p].steps[j].cap);
+			if (!key || key == (char *)-1) {
+				fprintf(stderr, "alien-console-bench: %s has "
+				        "no %s key\n", BENCH_TERM,
+				        script[p].steps[j].cap);
+				return -1;
+			}
+			bench.keys[p][j] = key;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Build the configuration: a few folders, all showing the same content.
+ */
+static int bench_params(const char *dir, struct pt_params *params)
+{
+	int i;
+	char title[32];
+
+	memset(params, 0, sizeof(*params));
+	params->dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (params->dirfd < 0) {
+		set_error(ESYS);
+		return -1;
+	}
+	params->cache_size = DEFAULT_CACHE_SIZE;
+	params->splash.duration = 0;
+	params->splash.min_time = -1;
+	params->splash.tagline = strdup("AN SMB-LINK PRODUCT");
+	params->splash.copyright = strdup("(C) SM-LINK DATA SYSTEMS");
+	params->splash.audio_player = strdup("");
+	params->splash.file = fopen("splash.txt", "r");
+	params->num_entries = BENCH_FOLDERS;
+	params->entries = calloc(BENCH_FOLDERS, sizeof(struct pt_entry));
+	if (!params->splash.file) {
+		set_error(ESYS);
+		return -1;
+	}
+	if (!params->splash.tagline || !params->splash.copyright ||
+	    !params->splash.audio_player || !params->entries) {
+		set_error(EMEM);
+		return -1;
+	}
+	for (i = 0; i < BENCH_FOLDERS; i++) {
+		snprintf(title, sizeof(title), "Benchmark %d", i);
+		params->entries[i].folder = strdup("BENCH");
+		params->entries[i].title = strdup(title);
+		params->entries[i].content_file = strdup("content.txt");
+		if (!params->entries[i].folder || !params->entries[i].title ||
+		    !params->entries[i].content_file) {
+			set_error(EMEM);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Open a pseudo-terminal of the benchmark size, with the slave side as standard
+ * input and output.
+ */
+static int open_terminal(void)
+{
+	struct winsize ws = { .ws_row = BENCH_ROWS, .ws_col = BENCH_COLS };
+	int slave;
+
+	bench.master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (bench.master < 0 || grantpt(bench.master) < 0 ||
+	    unlockpt(bench.master) < 0) {
+		set_error(ESYS);
+		return -1;
+	}
+	slave = open(ptsname(bench.master), O_RDWR | O_NOCTTY);
+	if (slave < 0 || ioctl(bench.master, TIOCSWINSZ, &ws) < 0 ||
+	    fcntl(bench.master, F_SETFL, O_NONBLOCK) < 0 ||
+	    dup2(slave, STDIN_FILENO) < 0 || dup2(slave, STDOUT_FILENO) < 0) {
+		set_error(ESYS);
+		return -1;
+	}
+	close(slave);
+	return 0;
+}
+
+/**
+ * Run the interface with the current content, in a child process. The result
+ * is written to result_fd.
+ */
+static int run_child(const char *dir, int result_fd)
+{
+	int rv = -1;
+	pthread_t thread;
+	struct pt_params params;
+	struct loader *loader;
+	SCREEN *screen;
+
+	bench.splash_frames = ULONG_MAX;
+	if (bench_params(dir, &params) < 0) {
+		/* the child is about to exit, so don't bother cleaning up */
+		mark_error();
+		report_error(stderr);
+		return -1;
+	}
+	if (open_terminal() < 0) {
+		mark_error();
+		goto exit;
+	}
+
+	setenv("ALIEN_CONSOLE_STATS", "1", 1);
+	stats_init();
+	screen = newterm(BENCH_TERM, stdout, stdin);
+	if (!screen) {
+		fprintf(stderr, "alien-console-bench: can't use %s\n",
+		        BENCH_TERM);
+		goto exit;
+	}
+	cbreak();
+	noecho();
+	keypad(stdscr, TRUE);
+	timeout(-1);
+	curs_set(0);
+	if (lookup_keys() < 0 || loop_block_signals() < 0)
+		goto cleanup;
+	if (pthread_create(&thread, NULL, play_script, NULL) != 0) {
+		fprintf(stderr, "alien-console-bench: can't start thread\n");
+		goto cleanup;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &bench.start);
+	loader = loader_start(&params);
+	if (loader)
+		rv = splash(&params.splash, loader);
+	clock_gettime(CLOCK_MONOTONIC, &bench.splash_end);
+	bench.result.splash_ms = elapsed_ms(&bench.start, &bench.splash_end);
+	__atomic_store_n(&bench.splash_frames, stats_frame_count(),
+	                 __ATOMIC_RELEASE);
+	if (rv < 0)
+		mark_error();
+	else if (rv == 0 && (rv = personal_terminal(&params, loader)) < 0)
+		mark_error();
+
+	__atomic_store_n(&bench.done, true, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	if (loader)
+		loader_stop(loader);
+cleanup:
+	wclear(stdscr);
+	endwin();
+	delscreen(screen);
+exit:
+	cleanup_config(&params);
+	if (rv < 0)
+		report_error(stderr);
+	if (write(result_fd, &bench.result, sizeof(bench.result)) < 0)
+		perror("alien-console-bench: write");
+	return rv;
+}
+
+/**
+ * Parse a size like "100M".
+ */
+static bool parse_size(const char *str, unsigned long long *size)
+{
+	char *end;
+	*size = strtoull(str, &end, 10);
+	switch (*end) {
+	case 'G': *size *= 1024;
+	/* fall through */
+	case 'M': *size *= 1024;
+	/* fall through */
+	case 'K': *size *= 1024;
+		end++;
+	}
+	return end != str && *end == '\0' && *size > 0;
+}
+
+/**
+ * Write size bytes of text to the content file: lines of words, in paragraphs.
+ * A block of it is generated and written as many times as needed.
+ */
+static int write_content(unsigned long long size)
+{
+	char *block;
+	size_t len = 0, line = 0, chunk;
+	const char *word;
+	size_t word_len;
+	int fd, rv = -1;
+
+	block = malloc(BENCH_BLOCK);
+	if (!block) {
+		perror("alien-console-bench: malloc");
+		return -1;
+	}
+	srand(937);
+	while (len < BENCH_BLOCK) {
+		word = words[rand() % nelem(words)];
+		word_len = strlen(word);
+		if (line + word_len > 72 || len + word_len + 1 >= BENCH_BLOCK) {
+			block[len++] = '\n';
+			if (rand() % 8 == 0 && len < BENCH_BLOCK)
+				block[len++] = '\n';
+			line = 0;
+			continue;
+		}
+		memcpy(block + len, word, word_len);
+		len += word_len;
+		block[len++] = ' ';
+		line += word_len + 1;
+	}
+
+	fd = open("content.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("alien-console-bench: content.txt");
+		goto exit;
+	}
+	for (; size > 0; size -= chunk) {
+		chunk = size < BENCH_BLOCK ? size : BENCH_BLOCK;
+		if (write(fd, block, chunk) != (ssize_t)chunk) {
+			perror("alien-console-bench: write");
+			goto exit;
+		}
+	}
+	rv = 0;
+exit:
+	if (fd >= 0)
+		close(fd);
+	free(block);
+	return rv;
+}
+
+static void report(const char *size, const struct run_result *r,
+                   const struct rusage *usage)
+{
+	int p;
+	printf("content %s\n", size);
+	printf("  startup: splash %.1f ms, first paint %.2f ms later, "
+	       "%llu bytes output\n", r->splash_ms, r->paint_ms,
+	       r->startup_bytes);
+	printf("  peak RSS: %.1f MiB\n", usage->ru_maxrss / 1024.0);
+	printf("  %-12s %6s %8s %8s %8s %8s %10s\n", "phase", "keys",
+	       "p50 ms", "p90 ms", "p99 ms", "max ms", "bytes/key");
+	for (p = 0; p < (int)nelem(script); p++) {
+		printf("  %-12s %6d %8.3f %8.3f %8.3f %8.3f %10.1f\n",
+		       script[p].name, r->phases[p].keys, r->phases[p].p50,
+		       r->phases[p].p90, r->phases[p].p99, r->phases[p].max,
+		       (double)r->phases[p].bytes / r->phases[p].keys);
+	}
+}
+
+/**
+ * Benchmark one content size. Returns 0 on success.
+ */
+static int bench_size(const char *dir, const char *str)
+{
+	unsigned long long size;
+	struct run_result result;
+	struct rusage usage;
+	int fds[2], status;
+	pid_t pid;
+
+	if (!parse_size(str, &size)) {
+		fprintf(stderr, "alien-console-bench: bad size \"%s\"\n", str);
+		return -1;
+	}
+	if (write_content(size) < 0)
+		return -1;
+	if (pipe(fds) < 0) {
+		perror("alien-console-bench: pipe");
+		return -1;
+	}
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("alien-console-bench: fork");
+		return -1;
+	} else if (pid == 0) {
+		close(fds[0]);
+		exit(run_child(dir, fds[1]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	close(fds[1]);
+	memset(&result, 0, sizeof(result));
+	if (read(fds[0], &result, sizeof(result)) != sizeof(result))
+		result.ok = false;
+	close(fds[0]);
+	if (wait4(pid, &status, 0, &usage) < 0) {
+		perror("alien-console-bench: wait4");
+		return -1;
+	}
+	if (!result.ok || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "alien-console-bench: content %s failed\n",
+		        str);
+		return -1;
+	}
+	report(str, &result, &usage);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/alien-console-bench.XXXXXX";
+	const char **sizes = default_sizes;
+	int i, num_sizes = nelem(default_sizes), rv = EXIT_FAILURE;
+	FILE *f;
+
+	if (argc > 1) {
+		sizes = (const char **)argv + 1;
+		num_sizes = argc - 1;
+	}
+
+	if (!mkdtemp(dir) || chdir(dir) < 0) {
+		perror("alien-console-bench: temporary directory");
+		return EXIT_FAILURE;
+	}
+	f = fopen("splash.txt", "w");
+	if (!f || fputs(splash_art, f) < 0 || fclose(f) != 0) {
+		perror("alien-console-bench: splash.txt");
+		goto exit;
+	}
+
+	printf("alien-console-bench: %dx%d %s, %d folders\n", BENCH_COLS,
+	       BENCH_ROWS, BENCH_TERM, BENCH_FOLDERS);
+	for (i = 0; i < num_sizes; i++) {
+		if (bench_size(dir, sizes[i]) < 0)
+			goto exit;
+	}
+	rv = EXIT_SUCCESS;
+exit:
+	unlink("content.txt");
+	unlink("splash.txt");
+	unlink("alien-console.index");
+	rmdir(dir);
+	return rv;
+}
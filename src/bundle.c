@@ -0,0 +1,562 @@
+/**
+ * alien-console: content bundles
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * A bundle is a configuration compiled together with its content, by
+ * alien-console-pack, into a single file. It's given to alien-console in place
+ * of the configuration file. Rather than parsing the configuration and opening
+ * each content file, the whole bundle is mapped read-only, and the parameters
+ * point straight into it. Nothing is copied, and only the bundle is open.
+ *
+ * The bundle also holds line indices of each entry, wrapped for the terminal
+ * widths given to alien-console-pack, so content shown at one of those widths
+ * is never wrapped at all (see content_wrap()).
+ *
+ * Followed entries are not packed, since they're expected to change. The
+ * bundle only names their content file, which is opened relative to the
+ * directory containing the bundle, as usual.
+ *
+ * Bundle format (native byte order, and only read on the same architecture):
+ *
+ *   struct bundle_header
+ *   for each entry: its text (page aligned, so it's mapped like a file would
+ *                   be), then for each width the offsets of its lines
+ *   for each entry: struct bundle_table for each width
+ *   the strings, NUL terminated, and the splash art
+ *   struct bundle_entry for each entry
+ *
+ * All offsets are from the start of the bundle, and the header and tables are
+ * aligned to 8 bytes.
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alien-console.h"
+
+#define BUNDLE_PAGE 4096
+#define BUNDLE_ALIGN 8
+#define BUNDLE_WIDTHS_MAX 16
+
+struct bundle_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t offset_size; /* sizeof(size_t) of the line indices */
+	uint64_t size; /* of the whole bundle */
+	uint32_t num_entries;
+	uint32_t reserved;
+	int64_t cache_size;
+	double min_time;
+	uint64_t tagline, copyright, audio_player; /* strings */
+	uint64_t art, art_size;
+	uint64_t entries; /* the entry table */
+};
+
+struct bundle_entry {
+	uint64_t folder, title, content_file; /* strings */
+	uint64_t text, size; /* 0 and 0 when followed */
+	uint64_t checksum; /* FNV-1a of the text */
+	uint64_t tables; /* num_tables struct bundle_table */
+	uint32_t num_tables;
+	uint32_t follow;
+};
+
+struct bundle_table {
+	uint32_t width, lines;
+	uint64_t offsets; /* lines + 1 of them */
+};
+
+struct bundle {
+	const char *map;
+	size_t size;
+	struct line_table *tables; /* for all the entries */
+};
+
+/*
+ * LOADING
+ */
+
+/**
+ * Return true when size bytes at offset are within the bundle, and aligned.
+ */
+static bool in_bundle(const struct bundle *b, uint64_t offset, uint64_t size,
+                      uint64_t align)
+{
+	return offset <= b->size && size <= b->size - offset &&
+	       offset % align == 0;
+}
+
+/**
+ * Return the NUL terminated string at offset, or NULL when it isn't one.
+ */
+static char *bundle_string(const struct bundle *b, uint64_t offset)
+{
+	if (offset >= b->size || !memchr(b->map + offset, '\0', b->size - offset))
+		return NULL;
+	return (char *)b->map + offset;
+}
+
+/**
+ * Point an entry's parameters into the bundle, checking that everything it
+ * refers to is inside. The line indices are only checked at either end, since
+ * reading all of them is what the bundle avoids.
+ */
+static int bundle_entry(struct bundle *b, const struct bundle_entry *be,
+                        struct pt_entry *entry, struct line_table *tables)
+{
+	const struct bundle_table *bt;
+	const size_t *offsets;
+	uint32_t i;
+
+	entry->folder = bundle_string(b, be->folder);
+	entry->title = bundle_string(b, be->title);
+	entry->content_file = bundle_string(b, be->content_file);
+	entry->follow = be->follow;
+	if (!entry->folder || !entry->title || !entry->content_file)
+		goto bad;
+	if (be->follow)
+		return 0;
+
+	if (!in_bundle(b, be->text, be->size, BUNDLE_PAGE) ||
+	    !in_bundle(b, be->tables, (uint64_t)be->num_tables *
+	                              sizeof(struct bundle_table), BUNDLE_ALIGN))
+		goto bad;
+	entry->text = b->map + be->text;
+	entry->size = be->size;
+	entry->checksum = be->checksum;
+	entry->tables = tables;
+	entry->num_tables = be->num_tables;
+
+	bt = (const struct bundle_table *)(b->map + be->tables);
+	for (i = 0; i < be->num_tables; i++) {
+		if (bt[i].lines >= INT_MAX ||
+		    !in_bundle(b, bt[i].offsets, ((uint64_t)bt[i].lines + 1) *
+		                                 sizeof(size_t), BUNDLE_ALIGN))
+			goto bad;
+		offsets = (const size_t *)(b->map + bt[i].offsets);
+		if (offsets[0] != 0 || offsets[bt[i].lines] != be->size)
+			goto bad;
+		tables[i].width = bt[i].width;
+		tables[i].lines = bt[i].lines;
+		tables[i].offsets = offsets;
+	}
+	return 0;
+bad:
+	set_error(EBADBUNDLE);
+	return -1;
+}
+
+/**
+ * Check the header, and point the parameters into the bundle.
+ */
+static int bundle_params(struct bundle *b, struct pt_params *params)
+{
+	const struct bundle_header *h = (const struct bundle_header *)b->map;
+	const struct bundle_entry *be;
+	size_t num_tables = 0;
+	uint32_t i;
+
+	if (h->num_entries == 0) {
+		set_error(ENOFOLDERS);
+		return -1;
+	}
+	if (!in_bundle(b, h->entries, (uint64_t)h->num_entries *
+	                              sizeof(struct bundle_entry), BUNDLE_ALIGN) ||
+	    !in_bundle(b, h->art, h->art_size, 1)) {
+		set_error(EBADBUNDLE);
+		return -1;
+	}
+	be = (const struct bundle_entry *)(b->map + h->entries);
+	for (i = 0; i < h->num_entries; i++) {
+		if (be[i].num_tables > BUNDLE_WIDTHS_MAX) {
+			set_error(EBADBUNDLE);
+			return -1;
+		}
+		num_tables += be[i].num_tables;
+	}
+
+	params->splash.file = NULL;
+	params->splash.art = b->map + h->art;
+	params->splash.art_size = h->art_size;
+	params->splash.tagline = bundle_string(b, h->tagline);
+	params->splash.copyright = bundle_string(b, h->copyright);
+	params->splash.audio_player = bundle_string(b, h->audio_player);
+	params->splash.duration = SPLASH_DURATION;
+	params->splash.min_time = h->min_time < 0 ? -1 : h->min_time;
+	params->cache_size = h->cache_size;
+	params->share_line_index = false; /* packed entries have theirs */
+	if (!params->splash.tagline || !params->splash.copyright ||
+	    !params->splash.audio_player) {
+		set_error(EBADBUNDLE);
+		return -1;
+	}
+
+	params->num_entries = h->num_entries;
+	params->entries = calloc(h->num_entries, sizeof(struct pt_entry));
+	b->tables = calloc(num_tables ? num_tables : 1,
+	                   sizeof(struct line_table));
+	if (!params->entries || !b->tables) {
+		set_error(EMEM);
+		return -1;
+	}
+	num_tables = 0;
+	for (i = 0; i < h->num_entries; i++) {
+		if (bundle_entry(b, &be[i], &params->entries[i],
+		                 &b->tables[num_tables]) < 0) {
+			mark_error();
+			return -1;
+		}
+		num_tables += be[i].num_tables;
+	}
+	return 0;
+}
+
+/**
+ * Load the parameters from a bundle, if filename is one. Returns 1 when it's
+ * not a bundle (or can't be read, which parse_config() reports), 0 once it's
+ * loaded, and -1 on error. The dirfd is used for followed entries, and kept in
+ * the parameters like parse_config() does.
+ */
+int bundle_load(const char *filename, int dirfd, struct pt_params *params)
+{
+	struct bundle_header header;
+	struct bundle *b;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    memcmp(header.magic, BUNDLE_MAGIC, sizeof(header.magic)) != 0) {
+		close(fd);
+		return 1;
+	}
+	if (header.version != BUNDLE_VERSION ||
+	    header.offset_size != sizeof(size_t)) {
+		set_error(EBADBUNDLE);
+		close(fd);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		set_error(ESYS);
+		close(fd);
+		return -1;
+	}
+	if ((uint64_t)st.st_size != header.size) {
+		set_error(EBADBUNDLE);
+		close(fd);
+		return -1;
+	}
+
+	b = calloc(1, sizeof(struct bundle));
+	if (!b) {
+		set_error(EMEM);
+		close(fd);
+		return -1;
+	}
+	b->size = st.st_size;
+	b->map = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); /* the mapping is all we need */
+	if (b->map == MAP_FAILED) {
+		set_error(ESYS);
+		free(b);
+		return -1;
+	}
+
+	memset(params, 0, sizeof(*params));
+	params->bundle = b;
+	params->dirfd = dirfd;
+	if (bundle_params(b, params) < 0) {
+		mark_error();
+		free(params->entries);
+		params->bundle = NULL;
+		goto cleanup;
+	}
+	return 0;
+
+cleanup:
+	munmap((void *)b->map, b->size);
+	free(b->tables);
+	free(b);
+	return -1;
+}
+
+/**
+ * Unmap the bundle the parameters were loaded from, see cleanup_config().
+ */
+void bundle_cleanup(struct pt_params *params)
+{
+	struct bundle *b = params->bundle;
+
+	close(params->dirfd);
+	free(params->entries);
+	munmap((void *)b->map, b->size);
+	free(b->tables);
+	free(b);
+	params->bundle = NULL;
+}
+
+/*
+ * PACKING
+ */
+
+struct writer {
+	int fd;
+	uint64_t pos;
+};
+
+static int emit(struct writer *w, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(w->fd, p, len);
+		if (n < 0) {
+			set_error(ESYS);
+			return -1;
+		}
+		p += n;
+		len -= n;
+		w->pos += n;
+	}
+	return 0;
+}
+
+/**
+ * Write zeros up to the next multiple of align.
+ */
+static int pad(struct writer *w, size_t align)
+{
+	static const char zeros[BUNDLE_PAGE];
+	size_t len = (align - w->pos % align) % align;
+	return emit(w, zeros, len);
+}
+
+static int emit_string(struct writer *w, const char *s, uint64_t *offset)
+{
+	*offset = w->pos;
+	return emit(w, s, strlen(s) + 1);
+}
+
+static uint64_t checksum(const char *text, size_t size)
+{
+	uint64_t hash = 14695981039346656037u;
+	size_t i;
+	for (i = 0; i < size; i++) {
+		hash ^= (unsigned char)text[i];
+		hash *= 1099511628211u;
+	}
+	return hash;
+}
+
+/**
+ * Write the text of an entry and its line indices, filling in be and its
+ * tables (one for each width) with where they went.
+ */
+static int pack_entry(struct writer *w, const struct pt_params *params, int i,
+                      const int *widths, int num_widths,
+                      struct bundle_entry *be, struct bundle_table *tables)
+{
+	const struct pt_entry *entry = &params->entries[i];
+	struct content c;
+	int j, rv = -1;
+
+	be->follow = entry->follow;
+	if (entry->follow)
+		return 0;
+
+	if (content_load_entry(params->dirfd, entry, &c) < 0) {
+		mark_error();
+		return -1;
+	}
+	if (pad(w, BUNDLE_PAGE) < 0)
+		goto cleanup;
+	be->text = w->pos;
+	be->size = c.size;
+	be->checksum = checksum(c.text, c.size);
+	if (emit(w, c.text, c.size) < 0 || pad(w, BUNDLE_ALIGN) < 0)
+		goto cleanup;
+
+	for (j = 0; j < num_widths; j++) {
+		if (content_wrap(&c, widths[j]) < 0 ||
+		    content_wrap_to(&c, INT_MAX) < 0)
+			goto cleanup;
+		tables[j].width = widths[j];
+		tables[j].lines = c.lines;
+		tables[j].offsets = w->pos;
+		if (emit(w, c.line_offsets, (c.lines + 1) * sizeof(size_t)) < 0)
+			goto cleanup;
+	}
+	be->num_tables = num_widths;
+	rv = 0;
+cleanup:
+	if (rv < 0)
+		mark_error();
+	content_free(&c);
+	return rv;
+}
+
+/**
+ * Write the rest of the bundle after the entries: their tables, the strings,
+ * the splash art and the entry table. Fills in the header.
+ */
+static int pack_rest(struct writer *w, const struct pt_params *params,
+                     struct bundle_entry *entries, struct bundle_table *tables,
+                     int num_widths, struct bundle_header *h)
+{
+	const struct pt_entry *entry;
+	const char *art = params->splash.art;
+	struct stat st;
+	size_t art_size = params->splash.art_size;
+	int i, rv = -1;
+
+	if (pad(w, BUNDLE_ALIGN) < 0)
+		goto exit;
+	for (i = 0; i < params->num_entries; i++) {
+		entries[i].tables = w->pos;
+		if (emit(w, &tables[i * num_widths],
+		         entries[i].num_tables * sizeof(struct bundle_table)) < 0)
+			goto exit;
+	}
+
+	for (i = 0; i < params->num_entries; i++) {
+		entry = &params->entries[i];
+		if (emit_string(w, entry->folder, &entries[i].folder) < 0 ||
+		    emit_string(w, entry->title, &entries[i].title) < 0 ||
+		    emit_string(w, entry->content_file,
+		                &entries[i].content_file) < 0)
+			goto exit;
+	}
+	if (emit_string(w, params->splash.tagline, &h->tagline) < 0 ||
+	    emit_string(w, params->splash.copyright, &h->copyright) < 0 ||
+	    emit_string(w, params->splash.audio_player, &h->audio_player) < 0)
+		goto exit;
+
+	if (params->splash.file) {
+		if (fstat(fileno(params->splash.file), &st) < 0) {
+			set_error(ESYS);
+			goto exit;
+		}
+		art_size = st.st_size;
+		art = NULL;
+		if (art_size > 0) {
+			art = mmap(NULL, art_size, PROT_READ, MAP_PRIVATE,
+			           fileno(params->splash.file), 0);
+			if (art == MAP_FAILED) {
+				set_error(ESYS);
+				goto exit;
+			}
+		}
+	}
+	h->art = w->pos;
+	h->art_size = art_size;
+	if (art_size > 0 && emit(w, art, art_size) < 0)
+		goto unmap;
+
+	if (pad(w, BUNDLE_ALIGN) < 0)
+		goto unmap;
+	h->entries = w->pos;
+	if (emit(w, entries, params->num_entries *
+	                     sizeof(struct bundle_entry)) < 0)
+		goto unmap;
+	rv = 0;
+unmap:
+	if (params->splash.file && art)
+		munmap((void *)art, art_size);
+exit:
+	return rv;
+}
+
+/**
+ * Pack the parameters and their content into a bundle, with line indices for
+ * each of the content box widths given. The bundle is written to a temporary
+ * file, which replaces filename once it's complete.
+ */
+int bundle_write(const struct pt_params *params, const int *widths,
+                 int num_widths, const char *filename)
+{
+	struct bundle_header header;
+	struct bundle_entry *entries;
+	struct bundle_table *tables;
+	struct writer w = { -1, 0 };
+	char tmp[PATH_MAX];
+	int i, rv = -1;
+
+	if (num_widths > BUNDLE_WIDTHS_MAX) {
+		set_error(EBADBUNDLE);
+		return -1;
+	}
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", filename) >= (int)sizeof(tmp)) {
+		set_error(EBADFILE);
+		return -1;
+	}
+	entries = calloc(params->num_entries, sizeof(struct bundle_entry));
+	tables = calloc((size_t)params->num_entries * num_widths + 1,
+	                sizeof(struct bundle_table));
+	if (!entries || !tables) {
+		set_error(EMEM);
+		goto exit;
+	}
+
+	w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (w.fd < 0) {
+		set_error(ESYS);
+		goto exit;
+	}
+	/* the header is filled in once everything else is written */
+	memset(&header, 0, sizeof(header));
+	if (emit(&w, &header, sizeof(header)) < 0)
+		goto cleanup;
+	for (i = 0; i < params->num_entries; i++) {
+		if (pack_entry(&w, params, i, widths, num_widths, &entries[i],
+		               &tables[i * num_widths]) < 0) {
+			mark_error();
+			goto cleanup;
+		}
+	}
+
+	if (pack_rest(&w, params, entries, tables, num_widths, &header) < 0) {
+		mark_error();
+		goto cleanup;
+	}
+	memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+	header.version = BUNDLE_VERSION;
+	header.offset_size = sizeof(size_t);
+	header.size = w.pos;
+	header.num_entries = params->num_entries;
+	header.cache_size = params->cache_size;
+	header.min_time = params->splash.min_time;
+	if (pwrite(w.fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    fsync(w.fd) < 0) {
+		set_error(ESYS);
+		goto cleanup;
+	}
+	if (close(w.fd) < 0) {
+		w.fd = -1;
+		set_error(ESYS);
+		goto cleanup;
+	}
+	w.fd = -1;
+	if (rename(tmp, filename) < 0) {
+		set_error(ESYS);
+		goto cleanup;
+	}
+	rv = 0;
+	goto exit;
+
+cleanup:
+	if (w.fd >= 0)
+		close(w.fd);
+	unlink(tmp);
+exit:
+	free(entries);
+	free(tables);
+	return rv;
+}
@@ -49,20 +49,21 @@ static int get_parent_fd(const char *filename)
 static FILE *open_rel(const char *filename, int dirfd)
 {
 	int fd;
-	FILE *f;
+	FILE *f = NULL;
+	TRACE_BEGIN(span, "open_rel");
 	fd = openat(dirfd, filename, O_RDONLY);
 	if (fd < 0) {
 		set_error(ESYS);
-		return NULL;
+		goto exit;
 	}
 
 	f = fdopen(fd, "r");
 	if (!f) {
 		set_error(ESYS);
 		close(fd);
-		return NULL;
 	}
-
+exit:
+	TRACE_END_DETAIL(span, filename);
 	return f;
 }
 
@@ -73,7 +74,7 @@ static void cleanup_pt_entry(struct pt_entry *entry)
 {
 	free(entry->folder);
 	free(entry->title);
-	fclose(entry->content);
+	free(entry->content_file);
 }
 
 /**
@@ -83,12 +84,12 @@ static int parse_pt_entry(config_setting_t *setting, struct pt_entry *entry,
                           int dirfd)
 {
 	const char *folder, *title, *content_file;
-	int rv = -1;
+	int follow, rv = -1;
 
 	/* so free won't fail */
 	entry->folder = NULL;
 	entry->title = NULL;
-	entry->content = NULL;
+	entry->content_file = NULL;
 
 	if (!config_setting_lookup_string(setting, "folder", &folder)) {
 		set_error(ECONFSET);
@@ -105,31 +106,37 @@ static int parse_pt_entry(config_setting_t *setting, struct pt_entry *entry,
 		goto exit;
 	}
 
+	if (!config_setting_lookup_bool(setting, "follow", &follow))
+		follow = 0; /* optional */
+	entry->follow = follow;
+
+	/* content is loaded lazily, but at least make sure that will work */
+	if (faccessat(dirfd, content_file, R_OK, 0) < 0) {
+		set_error(ESYS);
+		goto exit;
+	}
+
 	entry->folder = strdup(folder);
 	entry->title = strdup(title);
+	entry->content_file = strdup(content_file);
 
-	if (!entry->folder || !entry->title) {
+	if (!entry->folder || !entry->title || !entry->content_file) {
 		set_error(EMEM);
 		goto cleanup;
 	}
 
-	entry->content = open_rel(content_file, dirfd);
-	if (!entry->content) {
-		mark_error();
-		goto cleanup;
-	}
-
 	rv = 0;
 	goto exit;
 cleanup:
 	free(entry->folder);
 	free(entry->title);
+	free(entry->content_file);
 exit:
 	return rv;
 }
 
 /**
- * Parse a full PT config object, containing multiple (up to 4) entries.
+ * Parse a full PT config object, containing any number of entries.
  */
 static int parse_pt_object(config_setting_t *setting, struct pt_params *params,
                            int dirfd)
@@ -137,11 +144,15 @@ static int parse_pt_object(config_setting_t *setting, struct pt_params *params,
 	int i, len, rv=-1;
 	config_setting_t *entry_list, *entry;
 	const char *filename, *tagline, *copyright, *audio_player;
+	long long min_time;
+	int share;
 
 	/* so free() won't fail */
 	params->splash.file = NULL;
 	params->splash.tagline = NULL;
 	params->splash.copyright = NULL;
+	params->splash.art = NULL; /* not packed */
+	params->splash.art_size = 0;
 
 	if (!config_setting_lookup_string(setting, "filename", &filename)) {
 		set_error(ECONFSET);
@@ -161,6 +172,24 @@ static int parse_pt_object(config_setting_t *setting, struct pt_params *params,
 		set_error(ECONFSET);
 		return -1;
 	}
+	if (!config_setting_lookup_int64(setting, "cache_size",
+	                                 &params->cache_size)) {
+		params->cache_size = DEFAULT_CACHE_SIZE; /* optional */
+	}
+	if (!config_setting_lookup_bool(setting, "share_line_index", &share))
+		share = 0; /* optional */
+	params->share_line_index = share;
+
+	params->splash.duration = SPLASH_DURATION;
+	if (config_setting_lookup_int64(setting, "splash_min_time",
+	                                &min_time)) {
+		params->splash.min_time = min_time; /* whole seconds */
+	} else if (!config_setting_lookup_float(setting, "splash_min_time",
+	                                        &params->splash.min_time)) {
+		params->splash.min_time = -1; /* optional */
+	}
+	if (params->splash.min_time < 0)
+		params->splash.min_time = -1;
 	params->splash.tagline = strdup(tagline);
 	params->splash.copyright = strdup(copyright);
 	params->splash.audio_player = strdup(audio_player);
@@ -183,11 +212,16 @@ static int parse_pt_object(config_setting_t *setting, struct pt_params *params,
 	}
 
 	len = config_setting_length(entry_list);
-	if (len > (int) nelem(params->entries)) {
-		set_error(E2MANY);
+	if (len == 0) {
+		set_error(ENOFOLDERS);
 		goto cleanup_file;
 	}
 	params->num_entries = len;
+	params->entries = calloc(len, sizeof(struct pt_entry));
+	if (!params->entries) {
+		set_error(EMEM);
+		goto cleanup_file;
+	}
 
 	for (i = 0; i < len; i++) {
 		entry = config_setting_get_elem(entry_list, i);
@@ -207,6 +241,7 @@ cleanup_entries:
 	while (--i >= 0) {
 		cleanup_pt_entry(&params->entries[i]);
 	}
+	free(params->entries);
 cleanup_file:
 	fclose(params->splash.file);
 cleanup_strings:
@@ -219,9 +254,12 @@ exit:
 
 /**
  * Parse a config file. Right now that's just a personal_terminal key going to
- * a pt_object group. But it could change.
+ * a pt_object group. But it could change. The file may also be a bundle made by
+ * alien-console-pack, which is loaded instead (see bundle.c). Where a parse
+ * error is, is only printed when verbose.
  */
-int parse_config(const char *filename, struct pt_params *params)
+static int load_config(const char *filename, struct pt_params *params,
+                       bool verbose)
 {
 	int rv = -1, dirfd;
 	config_t conf;
@@ -233,15 +271,31 @@ int parse_config(const char *filename, struct pt_params *params)
 		goto exit;
 	}
 
+	rv = bundle_load(filename, dirfd, params);
+	if (rv <= 0) {
+		if (rv < 0) {
+			mark_error();
+			close(dirfd);
+		}
+		if (rv == 0)
+			params->filename = filename;
+		goto exit;
+	}
+	rv = -1;
+	params->bundle = NULL;
+	params->filename = filename;
+
 	config_init(&conf);
 	if (!config_read_file(&conf, filename)) {
 		if (config_error_type(&conf) == CONFIG_ERR_PARSE) {
-			fprintf(stderr, "in line %d: %s\n",
-			        config_error_line(&conf),
-			        config_error_text(&conf));
+			if (verbose)
+				fprintf(stderr, "in line %d: %s\n",
+				        config_error_line(&conf),
+				        config_error_text(&conf));
 			set_error(ECONFPARSE);
 		} else {
-			fprintf(stderr, "I/O error for %s\n", filename);
+			if (verbose)
+				fprintf(stderr, "I/O error for %s\n", filename);
 			set_error(ECONFREAD);
 		}
 		goto cleanup;
@@ -257,21 +311,46 @@ int parse_config(const char *filename, struct pt_params *params)
 		mark_error();
 		goto cleanup;
 	}
+	params->dirfd = dirfd; /* kept to load content files later */
 	rv = 0; /* success */
 
 cleanup:
-	close(dirfd);
+	if (rv < 0)
+		close(dirfd);
 	config_destroy(&conf);
 exit:
 	return rv;
 }
 
+int parse_config(const char *filename, struct pt_params *params)
+{
+	int rv;
+	TRACE_BEGIN(span, "parse_config");
+	rv = load_config(filename, params, true);
+	TRACE_END_DETAIL(span, filename);
+	return rv;
+}
+
+/**
+ * Parse a config file again while curses is running, so without printing
+ * anything (see reload.c).
+ */
+int reparse_config(const char *filename, struct pt_params *params)
+{
+	return load_config(filename, params, false);
+}
+
 /**
  * Cleanup a config object.
  */
 void cleanup_config(struct pt_params *params)
 {
 	int i;
+	if (params->bundle) {
+		bundle_cleanup(params);
+		return;
+	}
+	close(params->dirfd);
 	fclose(params->splash.file);
 	free(params->splash.tagline);
 	free(params->splash.copyright);
@@ -279,4 +358,5 @@ void cleanup_config(struct pt_params *params)
 	for (i = 0; i < params->num_entries; i++) {
 		cleanup_pt_entry(&params->entries[i]);
 	}
+	free(params->entries);
 }
@@ -0,0 +1,613 @@
+/**
+ * alien-console: content files
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * Content files are mapped read-only instead of being read into a buffer, so
+ * the text is never copied and stays in the page cache. Since the mapping can't
+ * be written, word wrapping is recorded out-of-band: the line index holds the
+ * offset where each displayed line starts, and the text is left untouched.
+ *
+ * The line index is built lazily. Only lines up to the bottom of the viewport
+ * need to be wrapped in order to draw it, so the rest of the text is left alone
+ * until something scrolls there.
+ *
+ * Wrapping only ever starts over after a hard newline, so the index needn't
+ * begin at the top of the text. When the width changes while the view is deep
+ * into a long text, the index is started at the last newline before the view
+ * instead (see content_resync()), and whatever comes before is wrapped backward
+ * a paragraph at a time if something scrolls up there (content_wrap_back()).
+ * Those lines get negative numbers, so that the lines already wrapped keep
+ * theirs, and anyone scrolled somewhere stays put. Jumping to the end of a long
+ * text likewise starts the index over at its last paragraph, instead of
+ * wrapping everything before it (see content_restart()).
+ *
+ * Content packed in a bundle (see bundle.c) is already mapped along with the
+ * rest of the bundle, and comes with line indices for the widths the bundle was
+ * packed for. Those are used as they are, until the text is wrapped to some
+ * other width. Likewise, a line index published by another process (see
+ * share.c) is used as it is, and only copied if more of the text needs to be
+ * wrapped than it covers.
+ *
+ * A mapped file may be truncated underneath us, by `> file`, an editor writing
+ * in place, or log rotation with copytruncate. Touching the mapping past the
+ * new end of the file raises SIGBUS, so content_guard() catches that and maps
+ * a page of zeros in place of the one which faulted. The text just reads as
+ * NULs until the change is picked up, which content_update() does for followed
+ * files, and reloading (see reload.c) does for the rest.
+ *
+ * A file may also be deleted, renamed or made unreadable after startup. Such an
+ * entry isn't worth ending the console over, so content_fail() stands in for it
+ * with a message saying what went wrong, which is shown like any other text.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alien-console.h"
+
+#define LINE_INDEX_INITIAL 64
+
+static uintptr_t page_size;
+
+/**
+ * Replace the page of a mapped file which faulted, because it's now past the
+ * end of the file, with a page of zeros. Anything else which raises SIGBUS
+ * gets the default action once it faults again.
+ */
+static void content_sigbus(int signo, siginfo_t *info, void *context)
+{
+	void *page = (void *)((uintptr_t)info->si_addr & ~(page_size - 1));
+
+	(void)context;
+	if (info->si_code != BUS_ADRERR ||
+	    mmap(page, page_size, PROT_READ,
+	         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+		signal(signo, SIG_DFL);
+}
+
+/**
+ * Survive content files being truncated while they're mapped (see above).
+ * Called once, before anything is loaded.
+ */
+int content_guard(void)
+{
+	struct sigaction sa = {
+		.sa_sigaction = content_sigbus,
+		.sa_flags = SA_SIGINFO,
+	};
+
+	page_size = sysconf(_SC_PAGESIZE);
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGBUS, &sa, NULL) < 0) {
+		set_error(ESYS);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Replace the mapping with one covering the first size bytes of fd.
+ */
+static int content_map(struct content *c, int fd, size_t size)
+{
+	void *map = NULL;
+
+	/* mmap() refuses zero length mappings, and there's nothing to map */
+	if (size > 0) {
+		map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			set_error(ESYS);
+			return -1;
+		}
+	}
+	if (c->text)
+		munmap((void *)c->text, c->size);
+	c->text = map;
+	c->size = size;
+	return 0;
+}
+
+/**
+ * Map a file (relative to dirfd) into memory. Unless the content is followed,
+ * the file descriptor is only held while mapping. The mapping itself remains
+ * valid until content_free().
+ */
+int content_load(int dirfd, const char *filename, bool follow,
+                 struct content *c)
+{
+	struct stat st;
+	int fd;
+
+	c->text = NULL;
+	c->size = 0;
+	c->line_offsets = NULL;
+	c->line_alloc = c->head_alloc = 0;
+	c->first_line = c->lines = 0;
+	c->wrap_pos = 0;
+	c->width = 0;
+	c->fd = -1;
+	c->packed = c->failed = false;
+	c->tables = NULL;
+	c->num_tables = 0;
+	c->shared = NULL;
+
+	fd = openat(dirfd, filename, O_RDONLY);
+	if (fd < 0) {
+		set_error(ESYS);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		set_error(ESYS);
+		close(fd);
+		return -1;
+	}
+	c->dev = st.st_dev;
+	c->ino = st.st_ino;
+	c->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+	if (content_map(c, fd, st.st_size) < 0) {
+		mark_error();
+		close(fd);
+		return -1;
+	}
+
+	if (follow)
+		c->fd = fd;
+	else
+		close(fd);
+	return 0;
+}
+
+/**
+ * Load the content of an entry, which is either packed in a bundle, or in its
+ * content file.
+ */
+int content_load_entry(int dirfd, const struct pt_entry *entry,
+                       struct content *c)
+{
+	int rv;
+
+	if (!entry->text) {
+		TRACE_BEGIN(span, "content_load");
+		rv = content_load(dirfd, entry->content_file, entry->follow, c);
+		TRACE_END_DETAIL(span, entry->content_file);
+		return rv;
+	}
+
+	c->text = entry->text;
+	c->size = entry->size;
+	c->line_offsets = NULL;
+	c->line_alloc = c->head_alloc = 0;
+	c->first_line = c->lines = 0;
+	c->wrap_pos = 0;
+	c->width = 0;
+	c->fd = -1;
+	c->packed = true;
+	c->failed = false;
+	c->tables = entry->tables;
+	c->num_tables = entry->num_tables;
+	c->dev = c->ino = 0;
+	c->mtime = 0;
+	c->shared = NULL;
+	return 0;
+}
+
+/**
+ * Fill in content for a file which couldn't be loaded, whose text explains why,
+ * from the current error. The error is cleared, since it's now been handled.
+ */
+int content_fail(const char *filename, struct content *c)
+{
+	char *text;
+	int len;
+
+	len = asprintf(&text, "CONTENT UNAVAILABLE\n\n%s: %s\n", filename,
+	               error_string());
+	if (len < 0) {
+		set_error(EMEM);
+		return -1;
+	}
+	clear_error();
+
+	c->text = text;
+	c->size = len;
+	c->line_offsets = NULL;
+	c->line_alloc = c->head_alloc = 0;
+	c->first_line = c->lines = 0;
+	c->wrap_pos = 0;
+	c->width = 0;
+	c->fd = -1;
+	c->packed = false;
+	c->failed = true;
+	c->tables = NULL;
+	c->num_tables = 0;
+	c->dev = c->ino = 0;
+	c->mtime = 0;
+	c->shared = NULL;
+	return 0;
+}
+
+/**
+ * Return the offset where the line beginning at pos ends, and the next one
+ * begins. Lines break after a newline, or at the last space which fits in
+ * width. Words too long to fit are simply broken at the edge.
+ */
+static size_t next_line(const char *text, size_t pos, size_t size, int width)
+{
+	size_t span = size - pos, i;
+	const char *nl;
+
+	if (span > (size_t)width)
+		span = width + 1; /* a space just past the edge may still break */
+
+	nl = memchr(text + pos, '\n', span);
+	if (nl)
+		return nl - text + 1;
+	if (size - pos <= (size_t)width)
+		return size;
+
+	for (i = pos + width; i > pos; i--) {
+		if (text[i] == ' ')
+			return i + 1;
+	}
+	return pos + width;
+}
+
+/**
+ * Free the line index, if it's ours.
+ */
+static void free_index(struct content *c)
+{
+	if (c->line_alloc)
+		free(c->line_offsets - c->head_alloc);
+	c->line_alloc = c->head_alloc = 0;
+}
+
+/**
+ * Replace a shared line index with a copy of our own, which can be appended to.
+ * Only our own indices are wrapped back, so this one begins at line 0.
+ */
+static int own_index(struct content *c)
+{
+	size_t alloc = LINE_INDEX_INITIAL, *offsets;
+
+	while (alloc <= (size_t)c->lines + 1)
+		alloc *= 2;
+	offsets = malloc(alloc * sizeof(size_t));
+	if (!offsets) {
+		set_error(EMEM);
+		return -1;
+	}
+	memcpy(offsets, c->line_offsets, (c->lines + 1) * sizeof(size_t));
+	share_release(c);
+	c->line_offsets = offsets;
+	c->line_alloc = alloc;
+	return 0;
+}
+
+/**
+ * Wrap more of the text, appending lines to the index until it holds at least
+ * the given number of lines, or until the index covers everything. Each line
+ * occupies the offsets from its start up to the start of the next line, and the
+ * final element is a sentinel equal to wrap_pos. A precomputed index covers
+ * everything already, so it's never written to, but a shared one may not, and
+ * is copied first. An index which becomes complete is published right away.
+ */
+int content_wrap_to(struct content *c, int lines)
+{
+	bool wrapping = c->lines < lines && c->wrap_pos < c->size;
+	size_t *newoffsets;
+
+	if (wrapping && !c->line_alloc && own_index(c) < 0) {
+		mark_error();
+		return -1;
+	}
+	while (c->lines < lines && c->wrap_pos < c->size) {
+		if ((size_t)c->lines + 1 >= c->line_alloc) {
+			newoffsets = realloc(c->line_offsets - c->head_alloc,
+			                     (c->head_alloc + 2 * c->line_alloc) *
+			                     sizeof(size_t));
+			if (!newoffsets) {
+				set_error(EMEM);
+				return -1;
+			}
+			c->line_offsets = newoffsets + c->head_alloc;
+			c->line_alloc *= 2;
+		}
+		c->line_offsets[c->lines++] = c->wrap_pos;
+		c->wrap_pos = next_line(c->text, c->wrap_pos, c->size,
+		                        c->width);
+		c->line_offsets[c->lines] = c->wrap_pos;
+	}
+	if (wrapping && content_wrapped(c))
+		share_publish(c);
+	return 0;
+}
+
+/**
+ * Wrap until the index covers the given offset into the text.
+ */
+int content_wrap_offset(struct content *c, size_t offset)
+{
+	while (c->wrap_pos <= offset && c->wrap_pos < c->size) {
+		/* wrap in batches, doubling the goal each time */
+		if (content_wrap_to(c, c->lines * 2 + LINE_INDEX_INITIAL) < 0) {
+			mark_error();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Start the fresh line index of the content at the last hard newline before
+ * offset, rather than at the top of the text, so that wrapping up to the offset
+ * is quick. Line 0 is then the line after the newline. An index which has any
+ * lines (which someone may be showing already) is left as it is.
+ */
+void content_resync(struct content *c, size_t offset)
+{
+	const char *nl;
+
+	if (!c->line_alloc || c->lines > 0 || c->first_line < 0 ||
+	    offset == 0 || offset > c->size)
+		return;
+	nl = memrchr(c->text, '\n', offset);
+	if (nl)
+		c->line_offsets[0] = c->wrap_pos = nl - c->text + 1;
+}
+
+/**
+ * Start the line index over at the last hard newline before offset, as
+ * content_resync() does for a fresh one, dropping the lines wrapped so far, so
+ * that a view far from them needn't wrap everything in between. The index is
+ * published first, as when rewrapping. Only for an index nobody else is
+ * showing, since their lines would be renumbered (see store_own()).
+ */
+int content_restart(struct content *c, size_t offset)
+{
+	size_t *offsets;
+
+	if (!c->line_alloc && content_wrapped(c))
+		return 0; /* a complete index from a bundle or another process */
+	if (!c->line_alloc) {
+		offsets = malloc(LINE_INDEX_INITIAL * sizeof(size_t));
+		if (!offsets) {
+			set_error(EMEM);
+			return -1;
+		}
+		share_release(c);
+		c->line_offsets = offsets;
+		c->line_alloc = LINE_INDEX_INITIAL;
+	} else {
+		share_publish(c);
+	}
+	c->first_line = c->lines = 0;
+	c->line_offsets[0] = c->wrap_pos = 0;
+	content_resync(c, offset);
+	return 0;
+}
+
+/**
+ * Make room for at least count more lines before the first line.
+ */
+static int grow_head(struct content *c, size_t count)
+{
+	size_t used = c->lines - c->first_line + 1, head = c->head_alloc;
+	size_t *alloc;
+
+	if ((size_t)-c->first_line + count <= head)
+		return 0;
+	if (head < LINE_INDEX_INITIAL)
+		head = LINE_INDEX_INITIAL;
+	while (head < (size_t)-c->first_line + count)
+		head *= 2;
+	alloc = malloc((head + c->line_alloc) * sizeof(size_t));
+	if (!alloc) {
+		set_error(EMEM);
+		return -1;
+	}
+	memcpy(alloc + head + c->first_line, c->line_offsets + c->first_line,
+	       used * sizeof(size_t));
+	free(c->line_offsets - c->head_alloc);
+	c->line_offsets = alloc + head;
+	c->head_alloc = head;
+	return 0;
+}
+
+/**
+ * Wrap the text before the first line of a resynced index (see
+ * content_resync()), a paragraph at a time, until there's a line numbered line
+ * or less, or the index reaches back to the top of the text. The new lines are
+ * numbered back from the first line, which is why they may be negative.
+ */
+int content_wrap_back(struct content *c, int line)
+{
+	size_t start, pos, base, count;
+	const char *nl;
+	int i;
+
+	while (c->first_line > line &&
+	       (base = c->line_offsets[c->first_line]) > 0) {
+		/* the paragraph before, which ends with the newline at base - 1 */
+		nl = base > 1 ? memrchr(c->text, '\n', base - 1) : NULL;
+		start = nl ? (size_t)(nl - c->text) + 1 : 0;
+		count = 0;
+		for (pos = start; pos < base; count++)
+			pos = next_line(c->text, pos, c->size, c->width);
+		if (count > (size_t)((long long)c->first_line - INT_MIN)) {
+			set_error(EMEM); /* more lines than we can number */
+			return -1;
+		}
+		if (grow_head(c, count) < 0) {
+			mark_error();
+			return -1;
+		}
+		i = c->first_line - count;
+		for (pos = start; pos < base; i++) {
+			c->line_offsets[i] = pos;
+			pos = next_line(c->text, pos, c->size, c->width);
+		}
+		c->first_line -= count;
+	}
+	return 0;
+}
+
+/**
+ * Return the index of the line containing offset. The index must already cover
+ * the offset (see content_wrap_offset() and content_wrap_back()).
+ */
+int content_find_line(const struct content *c, size_t offset)
+{
+	int lo = c->first_line, hi = c->lines - 1, mid;
+
+	if (c->lines == c->first_line)
+		return c->first_line;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (c->line_offsets[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/**
+ * Start a new line index for the given width. The text is not wrapped yet, that
+ * happens on demand, so that a huge file can be displayed without wrapping all
+ * of it first. The text itself is never modified, so this may be called again
+ * whenever the width changes. If the bundle has an index for the width, that's
+ * used instead, and line_alloc is left 0 since it isn't ours. The same goes for
+ * an index another process published. The index being replaced is published in
+ * turn, for the next process to use.
+ */
+int content_wrap(struct content *c, int width)
+{
+	int i;
+
+	share_publish(c);
+	share_release(c);
+	c->width = width;
+	c->first_line = 0;
+	for (i = 0; i < c->num_tables; i++) {
+		if (c->tables[i].width != width)
+			continue;
+		free_index(c);
+		c->line_offsets = (size_t *)c->tables[i].offsets;
+		c->lines = c->tables[i].lines;
+		c->wrap_pos = c->size;
+		return 0;
+	}
+	if (share_find(c, width))
+		return 0;
+
+	c->lines = 0;
+	c->wrap_pos = 0;
+	if (!c->line_alloc) {
+		c->line_alloc = LINE_INDEX_INITIAL;
+		c->line_offsets = malloc(c->line_alloc * sizeof(size_t));
+		if (!c->line_offsets) {
+			set_error(EMEM);
+			return -1;
+		}
+	}
+	c->line_offsets[0] = 0;
+	return 0;
+}
+
+/**
+ * Check a followed file for new data, and map whatever was appended. If it was
+ * completely wrapped, only its last line needs to be wrapped again, since it
+ * may have been incomplete. The new lines are wrapped on demand like any
+ * others. If the file shrank, it was probably truncated, and it is wrapped all
+ * over again. Until this is called, the text past the new end reads as zeros
+ * (see content_guard()).
+ */
+int content_update(struct content *c)
+{
+	struct stat st;
+	size_t old_size = c->size;
+
+	if (fstat(c->fd, &st) < 0) {
+		set_error(ESYS);
+		return -1;
+	}
+	if ((size_t)st.st_size == old_size)
+		return 0;
+
+	if (content_map(c, c->fd, st.st_size) < 0) {
+		mark_error();
+		return -1;
+	}
+
+	if (c->size < old_size)
+		return content_wrap(c, c->width);
+
+	if (c->wrap_pos == old_size && c->lines > c->first_line &&
+	    c->text[old_size - 1] != '\n') {
+		c->wrap_pos = c->line_offsets[--c->lines];
+	}
+	return 0;
+}
+
+/**
+ * Return true when the whole text has been wrapped.
+ */
+bool content_wrapped(const struct content *c)
+{
+	return c->wrap_pos == c->size;
+}
+
+/**
+ * Return a pointer to line i of the content, storing its length in len. The
+ * space or newline where the line was broken is not included.
+ */
+const char *content_line(const struct content *c, int i, int *len)
+{
+	size_t start = c->line_offsets[i], end = c->line_offsets[i + 1];
+	if (end > start && (c->text[end - 1] == '\n' || c->text[end - 1] == ' '))
+		end--;
+	*len = end - start;
+	return c->text + start;
+}
+
+/**
+ * Return the memory used by the content: the mapping, unless it belongs to a
+ * bundle, and the line index.
+ */
+size_t content_cost(const struct content *c)
+{
+	return (c->packed ? 0 : c->size) +
+	       (c->line_alloc + c->head_alloc) * sizeof(size_t);
+}
+
+/**
+ * Unmap the content (or free the message standing in for it, see
+ * content_fail()) and free its line index, publishing it first.
+ */
+void content_free(struct content *c)
+{
+	share_publish(c);
+	share_release(c);
+	if (c->failed)
+		free((void *)c->text);
+	else if (c->text && !c->packed)
+		munmap((void *)c->text, c->size);
+	if (c->fd >= 0)
+		close(c->fd);
+	free_index(c);
+	c->text = NULL;
+	c->line_offsets = NULL;
+	c->fd = -1;
+}
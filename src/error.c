@@ -2,8 +2,10 @@
  * alien-console: error handling utilities.
  * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
  *
- * The error handling system here is simple and totally thread-unsafe. Hopefully
- * we won't need threading.
+ * The error handling system here is simple, and each thread has an error state
+ * of its own. A thread which works on behalf of another can hand a failure over
+ * with save_error() and restore_error(), so that it's reported with the whole
+ * traceback.
  *
  * If an error is encountered, it's going to be inconvenient to report it on
  * ncurses windows. So, this error handling system makes it so that we can track
@@ -27,30 +29,25 @@
 
 #include "alien-console.h"
 
-struct error_entry {
-	const char *file;
-	const char *func;
-	int line;
-};
-
-/* Max stack depth is 32. Should be fine. */
-static struct error_entry error_stack[32];
-static int current_error = 0;
-static int error_stack_idx = 0;
-static bool overflow = false;
+/* Max stack depth is ERROR_STACK_MAX. Should be fine. */
+static __thread struct error_frame error_stack[ERROR_STACK_MAX];
+static __thread int current_error = 0;
+static __thread int error_stack_idx = 0;
+static __thread bool overflow = false;
 
 static const char *error_values[] = {
 	"No error",
 	"Terminal is not wide enough",
 	"Terminal is not tall enough",
-	"File exceeds statically allocated buffer",
 	"The user-provided text is too big",
 	"Configuration read error",
 	"Configuration parse error",
 	"Configuration setting was not found or wrong type",
 	"Memory allocation error",
-	"Too many elements in the folder entry list",
+	"The folder entry list is empty",
 	"Config filename is incorrect, please include a slash",
+	"The bundle file is damaged, or from another version",
+	"The terminal couldn't be set up, check TERM",
 };
 
 /**
@@ -119,6 +116,31 @@ void _set_error(int error, const char *file, const char *func, int line)
 	_mark_error(file, func, line);
 }
 
+/**
+ * Copy this thread's error state into record.
+ */
+void save_error(struct error_record *record)
+{
+	record->error = current_error;
+	record->depth = error_stack_idx;
+	record->overflow = overflow;
+	memcpy(record->stack, error_stack,
+	       error_stack_idx * sizeof(struct error_frame));
+}
+
+/**
+ * Replace this thread's error state with one saved by save_error(), possibly on
+ * another thread. Frames marked afterward are added on top of the saved ones.
+ */
+void restore_error(const struct error_record *record)
+{
+	current_error = record->error;
+	error_stack_idx = record->depth;
+	overflow = record->overflow;
+	memcpy(error_stack, record->stack,
+	       record->depth * sizeof(struct error_frame));
+}
+
 /**
  * Report error. This prints a traceback to f (presumably stderr, but I'm not
  * here to judge).
@@ -0,0 +1,919 @@
+/**
+ * alien-console: global search index
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * With thousands of entries, searching each one for some text is no good. So,
+ * a background thread builds an inverted index of all the content: for every
+ * word (token), the entries which contain it, with the offset of its first
+ * occurrence and the number of occurrences. A query is then a few hash lookups
+ * and an intersection of sorted posting lists.
+ *
+ * The thread indexes one entry at a time into a table of its own, and then
+ * merges it into the shared table while holding the lock, so queries see the
+ * index grow entry by entry. After each entry, it writes to an eventfd, which
+ * the interface polls. Nothing slow happens under the lock: the saved index is
+ * read into a table of its own too and swapped in, and since only the thread
+ * changes the table, it saves it without taking the lock.
+ *
+ * When it's done, the index is saved next to the configuration file (see
+ * INDEX_FILE). On the next start, it's loaded again, and only the entries whose
+ * file changed name, size or modification time are indexed again. Failing to
+ * save isn't an error, since the directory may well be read-only. Entries
+ * packed in a bundle have no file of their own, so they're stamped with the
+ * checksum of their text instead (see PACKED_STAMP). An index replaced by a
+ * reload is saved in the background, after index_stop() returns, so it keeps
+ * copies of what it needs from the configuration.
+ *
+ * Index file format (native byte order, since it's only a cache):
+ *
+ *   struct index_header
+ *   for each entry: u32 name length, name, s64 mtime seconds, s64 mtime
+ *                   nanoseconds, u64 size
+ *   for each token: u8 length, token, u32 postings, then for each posting
+ *                   struct posting
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alien-console.h"
+
+#define INDEX_FILE "alien-console.index"
+#define INDEX_MAGIC "ACINDEX"
+#define INDEX_VERSION 1
+#define INDEX_NICE 10 /* the interface comes first */
+#define TOKEN_MIN 2
+#define TOKEN_MAX 32
+#define TABLE_INITIAL 1024
+#define INDEX_CHUNK (1024 * 1024) /* bytes between checks for stopping */
+#define LOAD_CHECK 4096 /* saved tokens between checks for stopping */
+/* mtime_nsec of packed entries, whose mtime_sec is the checksum of the text */
+#define PACKED_STAMP -2
+
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_entries;
+	uint32_t num_tokens;
+};
+
+struct posting {
+	uint32_t entry;
+	uint32_t count;
+	uint64_t offset;
+};
+
+struct token {
+	char *text; /* lowercase, NUL terminated, or NULL for an empty slot */
+	uint32_t hash;
+	struct posting *postings; /* sorted by entry */
+	uint32_t num_postings, alloc_postings;
+};
+
+/* open addressing hash table of tokens */
+struct token_table {
+	struct token *slots;
+	size_t size; /* power of two */
+	size_t used;
+};
+
+struct file_stamp {
+	int64_t mtime_sec, mtime_nsec;
+	uint64_t size;
+	bool indexed; /* the index covers the file as stamped */
+};
+
+struct index {
+	/* read-only after index_start() */
+	int dirfd; /* our own copy */
+	int num_entries;
+	const struct pt_entry *entries; /* only while indexing */
+	char **files; /* copy of the content_file of each entry */
+	int event_fd;
+	pthread_t thread;
+
+	pthread_mutex_t lock; /* protects everything below */
+	pthread_cond_t idle; /* signalled when indexing is cleared */
+	/* only changed by the thread (which may read them without the lock) */
+	struct token_table table;
+	struct file_stamp *stamps;
+	int done; /* entries indexed (or found in the saved index) */
+	bool indexing; /* the thread may still use the entries */
+	bool finished; /* the thread is done with the index */
+	bool orphaned; /* index_stop() left it for the thread to free */
+	bool stop;
+};
+
+/* an index replaced by a reload may still be saving when the next one is */
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool word_char[256];
+static unsigned char lower[256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT; /* see init_tables() */
+
+static void init_tables(void)
+{
+	int c;
+	for (c = 0; c < 256; c++) {
+		word_char[c] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		               (c >= '0' && c <= '9') || c == '_';
+		lower[c] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+	}
+}
+
+/**
+ * FNV-1a hash of an already lowercased token.
+ */
+static uint32_t hash_token(const char *text, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)text[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void table_free(struct token_table *table)
+{
+	size_t i;
+	for (i = 0; i < table->size; i++) {
+		free(table->slots[i].text);
+		free(table->slots[i].postings);
+	}
+	free(table->slots);
+	table->slots = NULL;
+	table->size = table->used = 0;
+}
+
+/**
+ * Return the slot where the token is, or where it would go.
+ */
+static struct token *table_slot(struct token_table *table, const char *text,
+                                size_t len, uint32_t hash)
+{
+	size_t i = hash & (table->size - 1);
+	struct token *slot;
+	for (;;) {
+		slot = &table->slots[i];
+		if (!slot->text || (slot->hash == hash &&
+		                    strncmp(slot->text, text, len) == 0 &&
+		                    slot->text[len] == '\0'))
+			return slot;
+		i = (i + 1) & (table->size - 1);
+	}
+}
+
+static int table_grow(struct token_table *table)
+{
+	struct token_table bigger;
+	size_t i;
+
+	bigger.size = table->size ? table->size * 2 : TABLE_INITIAL;
+	bigger.used = table->used;
+	bigger.slots = calloc(bigger.size, sizeof(struct token));
+	if (!bigger.slots)
+		return -1;
+	for (i = 0; i < table->size; i++) {
+		if (table->slots[i].text)
+			*table_slot(&bigger, table->slots[i].text,
+			            strlen(table->slots[i].text),
+			            table->slots[i].hash) = table->slots[i];
+	}
+	free(table->slots);
+	*table = bigger;
+	return 0;
+}
+
+/**
+ * Find a token, adding it if it isn't there. Returns NULL when out of memory.
+ */
+static struct token *table_add(struct token_table *table, const char *text,
+                               size_t len, uint32_t hash)
+{
+	struct token *slot;
+
+	if ((table->used + 1) * 2 > table->size && table_grow(table) < 0)
+		return NULL;
+	slot = table_slot(table, text, len, hash);
+	if (slot->text)
+		return slot;
+	slot->text = strndup(text, len);
+	if (!slot->text)
+		return NULL;
+	slot->hash = hash;
+	table->used++;
+	return slot;
+}
+
+static struct token *table_find(struct token_table *table, const char *text,
+                                size_t len)
+{
+	struct token *slot;
+	if (table->size == 0)
+		return NULL;
+	slot = table_slot(table, text, len, hash_token(text, len));
+	return slot->text ? slot : NULL;
+}
+
+/**
+ * Return where the posting for entry is (or would go) in the token's list.
+ */
+static uint32_t find_posting(const struct token *token, uint32_t entry)
+{
+	uint32_t lo = 0, hi = token->num_postings, mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (token->postings[mid].entry < entry)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * Add (or replace) the posting for an entry, keeping the list sorted.
+ */
+static int add_posting(struct token *token, const struct posting *posting)
+{
+	struct posting *postings;
+	uint32_t i = find_posting(token, posting->entry);
+
+	if (i < token->num_postings &&
+	    token->postings[i].entry == posting->entry) {
+		token->postings[i] = *posting;
+		return 0;
+	}
+	if (token->num_postings == token->alloc_postings) {
+		token->alloc_postings = token->alloc_postings ?
+		                        token->alloc_postings * 2 : 1;
+		postings = realloc(token->postings, token->alloc_postings *
+		                                    sizeof(struct posting));
+		if (!postings)
+			return -1;
+		token->postings = postings;
+	}
+	memmove(&token->postings[i + 1], &token->postings[i],
+	        (token->num_postings - i) * sizeof(struct posting));
+	token->postings[i] = *posting;
+	token->num_postings++;
+	return 0;
+}
+
+/**
+ * Merge the table of one entry (each token has one posting) into the index.
+ */
+static int merge_entry(struct index *index, struct token_table *entry)
+{
+	struct token *token, *from;
+	size_t i;
+	int rv = 0;
+
+	pthread_mutex_lock(&index->lock);
+	for (i = 0; i < entry->size && rv == 0; i++) {
+		from = &entry->slots[i];
+		if (!from->text)
+			continue;
+		token = table_add(&index->table, from->text,
+		                  strlen(from->text), from->hash);
+		if (!token || add_posting(token, &from->postings[0]) < 0)
+			rv = -1;
+	}
+	pthread_mutex_unlock(&index->lock);
+	return rv;
+}
+
+static bool stopping(struct index *index)
+{
+	bool stop;
+	pthread_mutex_lock(&index->lock);
+	stop = index->stop;
+	pthread_mutex_unlock(&index->lock);
+	return stop;
+}
+
+/**
+ * Tokenize the text of entry into table. The text must be mapped at a page
+ * boundary. Returns -1 when out of memory, and 1 when asked to stop.
+ */
+static int tokenize(struct index *index, uint32_t entry, const char *text,
+                    size_t size, struct token_table *table)
+{
+	char token[TOKEN_MAX];
+	size_t pos = 0, start, len, chunk_end, dropped = 0;
+	struct token *t;
+	uint32_t hash;
+
+	while (pos < size) {
+		if (stopping(index))
+			return 1;
+		chunk_end = size - pos > INDEX_CHUNK ? pos + INDEX_CHUNK : size;
+		while (pos < chunk_end) {
+			if (!word_char[(unsigned char)text[pos]]) {
+				pos++;
+				continue;
+			}
+			/* a word may run past the chunk, that's fine */
+			start = pos;
+			hash = 2166136261u;
+			for (len = 0; pos < size &&
+			              word_char[(unsigned char)text[pos]]; pos++) {
+				if (len < TOKEN_MAX) {
+					token[len] = lower[(unsigned char)text[pos]];
+					hash = (hash ^ (unsigned char)token[len]) *
+					       16777619u;
+				}
+				len++;
+			}
+			if (len < TOKEN_MIN || len > TOKEN_MAX)
+				continue;
+			t = table_add(table, token, len, hash);
+			if (!t)
+				return -1;
+			if (t->num_postings == 0) {
+				t->postings = malloc(sizeof(struct posting));
+				if (!t->postings)
+					return -1;
+				t->postings[0].entry = entry;
+				t->postings[0].count = 0;
+				t->postings[0].offset = start;
+				t->num_postings = t->alloc_postings = 1;
+			}
+			t->postings[0].count++;
+		}
+		/* the page cache keeps the text, it needn't count as ours, but
+		 * a bundle's mapping is shared with the interface */
+		chunk_end = pos & ~(size_t)(INDEX_CHUNK - 1);
+		if (!index->entries[entry].text && chunk_end > dropped) {
+			madvise((void *)(text + dropped), chunk_end - dropped,
+			        MADV_DONTNEED);
+			dropped = chunk_end;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Index one entry. Files which can't be read are left out, as if they were
+ * empty. Returns -1 when out of memory, and 1 when asked to stop.
+ */
+static int index_entry(struct index *index, int i)
+{
+	struct token_table table = { NULL, 0, 0 };
+	struct file_stamp stamp = { 0, 0, 0, true };
+	const struct pt_entry *entry = &index->entries[i];
+	const char *text = NULL;
+	struct stat st;
+	int fd, rv = 0;
+
+	if (entry->text) {
+		stamp.mtime_sec = entry->checksum;
+		stamp.mtime_nsec = PACKED_STAMP;
+		stamp.size = entry->size;
+		rv = tokenize(index, i, entry->text, entry->size, &table);
+		goto merge;
+	}
+
+	fd = openat(index->dirfd, index->files[i], O_RDONLY | O_CLOEXEC);
+	if (fd >= 0 && fstat(fd, &st) == 0) {
+		stamp.mtime_sec = st.st_mtim.tv_sec;
+		stamp.mtime_nsec = st.st_mtim.tv_nsec;
+		stamp.size = st.st_size;
+		if (st.st_size > 0) {
+			text = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd,
+			            0);
+			if (text == MAP_FAILED)
+				text = NULL;
+		}
+	} else {
+		stamp.indexed = false; /* try again next time */
+	}
+	if (fd >= 0)
+		close(fd);
+
+	if (text) {
+		madvise((void *)text, stamp.size, MADV_SEQUENTIAL);
+		rv = tokenize(index, i, text, stamp.size, &table);
+		munmap((void *)text, stamp.size);
+	}
+merge:
+	if (rv == 0)
+		rv = merge_entry(index, &table);
+	table_free(&table);
+	if (rv == 0) {
+		pthread_mutex_lock(&index->lock);
+		index->stamps[i] = stamp;
+		pthread_mutex_unlock(&index->lock);
+	}
+	return rv;
+}
+
+/**
+ * Return true when the file of entry i still matches the stamp.
+ */
+static bool stamp_valid(struct index *index, int i,
+                        const struct file_stamp *stamp)
+{
+	struct stat st;
+	const struct pt_entry *entry = &index->entries[i];
+
+	if (entry->text)
+		return stamp->indexed &&
+		       stamp->mtime_sec == (int64_t)entry->checksum &&
+		       stamp->mtime_nsec == PACKED_STAMP &&
+		       stamp->size == entry->size;
+	return stamp->indexed &&
+	       fstatat(index->dirfd, index->files[i], &st, 0) == 0 &&
+	       st.st_mtim.tv_sec == stamp->mtime_sec &&
+	       st.st_mtim.tv_nsec == stamp->mtime_nsec &&
+	       (uint64_t)st.st_size == stamp->size;
+}
+
+static bool read_all(FILE *f, void *buf, size_t len)
+{
+	return fread(buf, 1, len, f) == len;
+}
+
+/**
+ * Load the saved index into table and stamps, which start out empty. Entries
+ * are matched up with the saved ones by file name, and only those which are
+ * unchanged are kept. Returns false if there was nothing usable (or it was
+ * asked to stop), which isn't an error.
+ */
+static bool load_index(struct index *index, struct token_table *table,
+                       struct file_stamp *stamps)
+{
+	struct index_header header;
+	struct posting posting;
+	int32_t *map = NULL; /* saved entry number to entry number, or -1 */
+	char name[PATH_MAX], text[TOKEN_MAX + 1];
+	struct file_stamp stamp;
+	uint32_t i, j, len, postings;
+	struct token *token;
+	unsigned char tlen;
+	bool ok = false;
+	int fd, e;
+	FILE *f;
+
+	fd = openat(index->dirfd, INDEX_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return false;
+	}
+
+	if (!read_all(f, &header, sizeof(header)) ||
+	    memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+	    header.version != INDEX_VERSION)
+		goto exit;
+	map = malloc(header.num_entries * sizeof(int32_t) + 1);
+	if (!map)
+		goto exit;
+
+	for (i = 0; i < header.num_entries; i++) {
+		if (stopping(index) ||
+		    !read_all(f, &len, sizeof(len)) || len >= sizeof(name) ||
+		    !read_all(f, name, len) ||
+		    !read_all(f, &stamp.mtime_sec, sizeof(stamp.mtime_sec)) ||
+		    !read_all(f, &stamp.mtime_nsec, sizeof(stamp.mtime_nsec)) ||
+		    !read_all(f, &stamp.size, sizeof(stamp.size)))
+			goto exit;
+		name[len] = '\0';
+		stamp.indexed = true;
+		/* the first entry with the same file, not already matched */
+		map[i] = -1;
+		for (e = 0; e < index->num_entries; e++) {
+			if (!stamps[e].indexed &&
+			    strcmp(index->files[e], name) == 0) {
+				stamps[e] = stamp;
+				if (stamp_valid(index, e, &stamp))
+					map[i] = e;
+				else
+					stamps[e].indexed = false;
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < header.num_tokens; i++) {
+		if ((i % LOAD_CHECK == 0 && stopping(index)) ||
+		    !read_all(f, &tlen, 1) || tlen > TOKEN_MAX ||
+		    !read_all(f, text, tlen) ||
+		    !read_all(f, &postings, sizeof(postings)))
+			goto exit;
+		token = NULL;
+		for (j = 0; j < postings; j++) {
+			if (!read_all(f, &posting, sizeof(posting)) ||
+			    posting.entry >= header.num_entries)
+				goto exit;
+			if (map[posting.entry] < 0)
+				continue;
+			posting.entry = map[posting.entry];
+			if (!token)
+				token = table_add(table, text, tlen,
+				                  hash_token(text, tlen));
+			if (!token || add_posting(token, &posting) < 0)
+				goto exit;
+		}
+	}
+	ok = true;
+
+exit:
+	if (!ok) {
+		table_free(table);
+		memset(stamps, 0, index->num_entries * sizeof(struct file_stamp));
+	}
+	free(map);
+	fclose(f);
+	return ok;
+}
+
+static bool write_all(FILE *f, const void *buf, size_t len)
+{
+	return fwrite(buf, 1, len, f) == len;
+}
+
+/**
+ * Save the index, replacing the old one all at once. Only the thread calls
+ * this, so it reads the table without the lock.
+ */
+static void save_index(struct index *index)
+{
+	struct index_header header;
+	struct file_stamp stamp;
+	struct token *token;
+	uint32_t len, postings;
+	unsigned char tlen;
+	bool ok = true;
+	size_t i;
+	int fd, e;
+	FILE *f;
+
+	fd = openat(index->dirfd, INDEX_FILE ".tmp",
+	            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	header.version = INDEX_VERSION;
+	header.num_entries = index->num_entries;
+	for (i = 0; i < index->table.size; i++) {
+		if (index->table.slots[i].text &&
+		    index->table.slots[i].num_postings > 0)
+			header.num_tokens++;
+	}
+	ok = write_all(f, &header, sizeof(header));
+
+	for (e = 0; ok && e < index->num_entries; e++) {
+		/* entries which weren't indexed get a stamp which never matches */
+		stamp = index->stamps[e];
+		if (!stamp.indexed)
+			stamp.mtime_nsec = -1;
+		len = strlen(index->files[e]);
+		ok = write_all(f, &len, sizeof(len)) &&
+		     write_all(f, index->files[e], len) &&
+		     write_all(f, &stamp.mtime_sec, sizeof(stamp.mtime_sec)) &&
+		     write_all(f, &stamp.mtime_nsec, sizeof(stamp.mtime_nsec)) &&
+		     write_all(f, &stamp.size, sizeof(stamp.size));
+	}
+
+	for (i = 0; ok && i < index->table.size; i++) {
+		token = &index->table.slots[i];
+		if (!token->text || token->num_postings == 0)
+			continue;
+		tlen = strlen(token->text);
+		postings = token->num_postings;
+		ok = write_all(f, &tlen, 1) &&
+		     write_all(f, token->text, tlen) &&
+		     write_all(f, &postings, sizeof(postings)) &&
+		     write_all(f, token->postings,
+		               postings * sizeof(struct posting));
+	}
+
+	if (fclose(f) != 0)
+		ok = false;
+	if (ok)
+		ok = renameat(index->dirfd, INDEX_FILE ".tmp", index->dirfd,
+		              INDEX_FILE) == 0;
+	if (!ok)
+		unlinkat(index->dirfd, INDEX_FILE ".tmp", 0);
+}
+
+static void notify(struct index *index)
+{
+	uint64_t one = 1;
+	if (write(index->event_fd, &one, sizeof(one)) < 0) {
+		/* the counter can't overflow in practice, nothing to do */
+	}
+}
+
+/**
+ * Free the index, once both the thread and index_stop() are done with it.
+ */
+static void index_free(struct index *index)
+{
+	int i;
+
+	pthread_cond_destroy(&index->idle);
+	pthread_mutex_destroy(&index->lock);
+	close(index->event_fd);
+	close(index->dirfd);
+	table_free(&index->table);
+	for (i = 0; i < index->num_entries; i++)
+		free(index->files[i]);
+	free(index->files);
+	free(index->stamps);
+	free(index);
+}
+
+/**
+ * The indexing thread.
+ */
+static void *index_thread(void *arg)
+{
+	struct index *index = arg;
+	struct token_table table = { NULL, 0, 0 };
+	struct file_stamp *stamps;
+	bool changed = false, last;
+	int i, rv = 0;
+
+	setpriority(PRIO_PROCESS, gettid(), INDEX_NICE);
+
+	TRACE_BEGIN(load, "index_load");
+	stamps = calloc(index->num_entries, sizeof(struct file_stamp));
+	if (!stamps || !load_index(index, &table, stamps))
+		changed = true;
+	pthread_mutex_lock(&index->lock);
+	if (stamps) {
+		/* both are still empty */
+		free(index->stamps);
+		index->stamps = stamps;
+		index->table = table;
+	}
+	for (i = 0; i < index->num_entries; i++) {
+		if (index->stamps[i].indexed)
+			index->done++;
+	}
+	pthread_mutex_unlock(&index->lock);
+	TRACE_END(load);
+	notify(index);
+
+	/* a load cut short mustn't replace the saved index */
+	if (stopping(index))
+		changed = false;
+	for (i = 0; !stopping(index) && i < index->num_entries; i++) {
+		if (index->stamps[i].indexed)
+			continue;
+		TRACE_BEGIN(entry, "index_entry");
+		rv = index_entry(index, i);
+		TRACE_END(entry);
+		if (rv != 0)
+			break;
+		changed = true;
+		pthread_mutex_lock(&index->lock);
+		index->done++;
+		pthread_mutex_unlock(&index->lock);
+		notify(index);
+	}
+
+	pthread_mutex_lock(&index->lock);
+	index->indexing = false;
+	pthread_cond_signal(&index->idle);
+	pthread_mutex_unlock(&index->lock);
+	notify(index); /* it may have given up short of every entry */
+
+	/* when stopped partway, the entries done so far are still saved */
+	if (changed && rv >= 0) {
+		TRACE_BEGIN(save, "index_save");
+		pthread_mutex_lock(&save_lock);
+		save_index(index);
+		pthread_mutex_unlock(&save_lock);
+		TRACE_END(save);
+	}
+
+	pthread_mutex_lock(&index->lock);
+	index->finished = true;
+	last = index->orphaned;
+	pthread_mutex_unlock(&index->lock);
+	if (last)
+		index_free(index);
+	return NULL;
+}
+
+/**
+ * Start building the index for the configured entries in the background.
+ */
+struct index *index_start(const struct pt_params *params)
+{
+	struct index *index;
+	int i;
+
+	pthread_once(&tables_once, init_tables);
+	index = calloc(1, sizeof(struct index));
+	if (!index) {
+		set_error(EMEM);
+		return NULL;
+	}
+	index->dirfd = -1;
+	index->event_fd = -1;
+	index->num_entries = params->num_entries;
+	index->entries = params->entries;
+	index->files = calloc(params->num_entries, sizeof(char *));
+	index->stamps = calloc(params->num_entries, sizeof(struct file_stamp));
+	if (!index->files || !index->stamps) {
+		set_error(EMEM);
+		goto cleanup;
+	}
+	for (i = 0; i < params->num_entries; i++) {
+		index->files[i] = strdup(params->entries[i].content_file);
+		if (!index->files[i]) {
+			set_error(EMEM);
+			goto cleanup;
+		}
+	}
+
+	index->dirfd = fcntl(params->dirfd, F_DUPFD_CLOEXEC, 0);
+	index->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (index->dirfd < 0 || index->event_fd < 0) {
+		set_error(ESYS);
+		goto cleanup;
+	}
+	pthread_mutex_init(&index->lock, NULL);
+	pthread_cond_init(&index->idle, NULL);
+	index->indexing = true;
+	if (pthread_create(&index->thread, NULL, index_thread, index) != 0) {
+		set_error(ESYS);
+		pthread_cond_destroy(&index->idle);
+		pthread_mutex_destroy(&index->lock);
+		goto cleanup;
+	}
+	return index;
+
+cleanup:
+	if (index->dirfd >= 0)
+		close(index->dirfd);
+	if (index->event_fd >= 0)
+		close(index->event_fd);
+	for (i = 0; index->files && i < params->num_entries; i++)
+		free(index->files[i]);
+	free(index->files);
+	free(index->stamps);
+	free(index);
+	return NULL;
+}
+
+/**
+ * Return a file descriptor which becomes readable when more of the index is
+ * done. Read it with index_progress().
+ */
+int index_fd(struct index *index)
+{
+	return index->event_fd;
+}
+
+/**
+ * Return the number of entries indexed so far.
+ */
+int index_count(struct index *index)
+{
+	int done;
+	pthread_mutex_lock(&index->lock);
+	done = index->done;
+	pthread_mutex_unlock(&index->lock);
+	return done;
+}
+
+/**
+ * Return true once the thread is done indexing: every entry is indexed, or it
+ * gave up (running out of memory), so index_count() won't go any higher.
+ */
+bool index_finished(struct index *index)
+{
+	bool finished;
+	pthread_mutex_lock(&index->lock);
+	finished = !index->indexing;
+	pthread_mutex_unlock(&index->lock);
+	return finished;
+}
+
+/**
+ * Return the number of entries indexed so far, and clear the readiness of
+ * index_fd().
+ */
+int index_progress(struct index *index)
+{
+	uint64_t count;
+	if (read(index->event_fd, &count, sizeof(count)) < 0) {
+		/* nothing new, which is fine */
+	}
+	return index_count(index);
+}
+
+/**
+ * Look up the entries which contain every word of the query. Up to max hits
+ * are stored, in order of entry, with the first occurrence and number of
+ * occurrences of the first word. Returns the total number of hits.
+ */
+int index_query(struct index *index, const char *query,
+                struct index_hit *hits, int max)
+{
+	char words[INDEX_QUERY_WORDS][TOKEN_MAX];
+	size_t lens[INDEX_QUERY_WORDS];
+	struct token *tokens[INDEX_QUERY_WORDS];
+	int num_words = 0, total = 0, w;
+	const unsigned char *q = (const unsigned char *)query;
+	uint32_t i, j;
+	size_t len;
+
+	while (*q && num_words < INDEX_QUERY_WORDS) {
+		if (!word_char[*q]) {
+			q++;
+			continue;
+		}
+		for (len = 0; word_char[*q]; q++, len++) {
+			if (len < TOKEN_MAX)
+				words[num_words][len] = lower[*q];
+		}
+		if (len >= TOKEN_MIN && len <= TOKEN_MAX)
+			lens[num_words++] = len;
+	}
+	if (num_words == 0)
+		return 0;
+
+	pthread_mutex_lock(&index->lock);
+	for (w = 0; w < num_words; w++) {
+		tokens[w] = table_find(&index->table, words[w], lens[w]);
+		if (!tokens[w])
+			goto exit;
+	}
+	for (i = 0; i < tokens[0]->num_postings; i++) {
+		for (w = 1; w < num_words; w++) {
+			j = find_posting(tokens[w], tokens[0]->postings[i].entry);
+			if (j >= tokens[w]->num_postings ||
+			    tokens[w]->postings[j].entry !=
+			    tokens[0]->postings[i].entry)
+				break;
+		}
+		if (w < num_words)
+			continue;
+		if (total < max) {
+			hits[total].entry = tokens[0]->postings[i].entry;
+			hits[total].offset = tokens[0]->postings[i].offset;
+			hits[total].count = tokens[0]->postings[i].count;
+		}
+		total++;
+	}
+exit:
+	pthread_mutex_unlock(&index->lock);
+	return total;
+}
+
+/**
+ * Stop building the index, and free it. What's done so far is saved, and with
+ * wait, that's done before this returns. Otherwise it's done in the background,
+ * and this only waits until the thread is done with the configured entries
+ * (which may then be freed). Either way, the index can't be used afterwards.
+ */
+void index_stop(struct index *index, bool wait)
+{
+	pthread_t thread = index->thread; /* the index may be gone by then */
+	bool last = true;
+
+	pthread_mutex_lock(&index->lock);
+	index->stop = true;
+	while (index->indexing)
+		pthread_cond_wait(&index->idle, &index->lock);
+	if (!wait && !index->finished) {
+		index->orphaned = true;
+		last = false;
+	}
+	pthread_mutex_unlock(&index->lock);
+
+	if (wait)
+		pthread_join(thread, NULL);
+	else
+		pthread_detach(thread);
+	if (last)
+		index_free(index);
+}
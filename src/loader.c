@@ -0,0 +1,299 @@
+/**
+ * alien-console: background loading
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * The splash screen takes several seconds, and there's no reason the personal
+ * terminal should only start loading once it's over. So, right after the
+ * configuration is parsed, a few worker threads start mapping content files and
+ * reading in their first pages, and the index (see index.c) starts being built.
+ * The personal terminal then takes the loaded content with loader_take() when
+ * an entry is first selected, rather than loading it itself.
+ *
+ * Entries are loaded in order while their total size fits in the cache budget,
+ * since the personal terminal wouldn't keep more loaded than that anyway.
+ *
+ * Startup is complete once the workers are done and the index is built. Until
+ * then, loader_progress() estimates how far along it is, for the splash screen.
+ *
+ * A worker which fails to load an entry saves its error, and it's restored on
+ * the interface thread when the entry is taken. So, the failure is reported
+ * just as if the interface had loaded the entry itself, when it's selected.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "alien-console.h"
+
+#define LOADER_WORKERS 4
+#define LOADER_NICE 10 /* the splash screen comes first */
+#define LOADER_WARM (1024 * 1024) /* bytes read in at the start of a file */
+
+/* share of the progress bar for each stage of startup, adding up to 1 */
+#define STAGE_CONFIG 0.1 /* parsed before the loader starts */
+#define STAGE_OPEN 0.2 /* files opened and mapped */
+#define STAGE_WARM 0.3 /* bytes read in */
+#define STAGE_INDEX 0.4 /* entries indexed */
+
+enum load_state {
+	LOAD_PENDING,
+	LOAD_BUSY, /* a worker is loading it */
+	LOAD_DONE,
+	LOAD_FAILED,
+	LOAD_TAKEN, /* by loader_take(), or skipped */
+};
+
+struct load_slot {
+	enum load_state state;
+	struct content content;
+	struct error_record error;
+};
+
+struct loader {
+	/* read-only after loader_start() */
+	const struct pt_params *params;
+	struct index *index;
+	pthread_t workers[LOADER_WORKERS];
+	int num_workers;
+
+	pthread_mutex_t lock; /* protects everything below */
+	pthread_cond_t done; /* signalled when a slot stops being busy */
+	struct load_slot *slots;
+	int next; /* the next entry a worker may load */
+	long long loaded; /* bytes loaded so far */
+	int opened; /* entries opened (or failed) by the workers */
+	long long to_warm, warmed; /* bytes to read in, and read in so far */
+	int running; /* workers which haven't finished */
+	bool stop;
+
+	/* only used by the interface thread */
+	struct reload *reload; /* the latest configuration, if reloaded */
+};
+
+static size_t warm_size(const struct content *c)
+{
+	return c->size < LOADER_WARM ? c->size : LOADER_WARM;
+}
+
+/**
+ * Read in the start of the text, which the first screen shows, by touching
+ * a byte of each page.
+ */
+static void warm(const struct content *c)
+{
+	size_t size = warm_size(c);
+	size_t page = sysconf(_SC_PAGESIZE), i;
+	volatile char sink;
+
+	for (i = 0; i < size; i += page)
+		sink = c->text[i];
+	(void)sink;
+}
+
+static void *loader_thread(void *arg)
+{
+	struct loader *loader = arg;
+	const struct pt_entry *entry;
+	struct load_slot *slot;
+	int i, rv;
+
+	setpriority(PRIO_PROCESS, gettid(), LOADER_NICE);
+
+	pthread_mutex_lock(&loader->lock);
+	while (!loader->stop && loader->next < loader->params->num_entries &&
+	       loader->loaded < loader->params->cache_size) {
+		i = loader->next++;
+		slot = &loader->slots[i];
+		if (slot->state != LOAD_PENDING)
+			continue;
+		slot->state = LOAD_BUSY;
+		pthread_mutex_unlock(&loader->lock);
+
+		entry = &loader->params->entries[i];
+		rv = content_load_entry(loader->params->dirfd, entry,
+		                        &slot->content);
+		if (rv < 0) {
+			mark_error();
+			save_error(&slot->error);
+			clear_error();
+		}
+
+		pthread_mutex_lock(&loader->lock);
+		loader->opened++;
+		loader->to_warm += warm_size(&slot->content);
+		pthread_mutex_unlock(&loader->lock);
+		if (rv == 0)
+			warm(&slot->content);
+
+		pthread_mutex_lock(&loader->lock);
+		slot->state = rv < 0 ? LOAD_FAILED : LOAD_DONE;
+		loader->loaded += slot->content.size;
+		loader->warmed += warm_size(&slot->content);
+		pthread_cond_broadcast(&loader->done);
+	}
+	loader->running--;
+	pthread_mutex_unlock(&loader->lock);
+	return NULL;
+}
+
+/**
+ * Start loading content and building the index in the background. The params
+ * must outlive the loader.
+ */
+struct loader *loader_start(const struct pt_params *params)
+{
+	struct loader *loader;
+	int i;
+
+	loader = calloc(1, sizeof(struct loader));
+	if (!loader) {
+		set_error(EMEM);
+		return NULL;
+	}
+	loader->params = params;
+	loader->slots = calloc(params->num_entries, sizeof(struct load_slot));
+	if (!loader->slots) {
+		set_error(EMEM);
+		free(loader);
+		return NULL;
+	}
+	pthread_mutex_init(&loader->lock, NULL);
+	pthread_cond_init(&loader->done, NULL);
+
+	loader->index = index_start(params);
+	if (!loader->index) {
+		mark_error();
+		goto cleanup;
+	}
+
+	for (i = 0; i < LOADER_WORKERS && i < params->num_entries; i++) {
+		pthread_mutex_lock(&loader->lock);
+		loader->running++;
+		pthread_mutex_unlock(&loader->lock);
+		if (pthread_create(&loader->workers[i], NULL, loader_thread,
+		                   loader) != 0) {
+			set_error(ESYS);
+			loader->running--;
+			loader_stop(loader);
+			return NULL;
+		}
+		loader->num_workers++;
+	}
+	return loader;
+
+cleanup:
+	pthread_cond_destroy(&loader->done);
+	pthread_mutex_destroy(&loader->lock);
+	free(loader->slots);
+	free(loader);
+	return NULL;
+}
+
+/**
+ * Return the index being built by the loader.
+ */
+struct index *loader_index(struct loader *loader)
+{
+	return loader->index;
+}
+
+/**
+ * Switch the index over to a reloaded configuration: index was started for it,
+ * and replaces the one the loader has. The loader then owns the reload, until
+ * the next one or loader_stop(). The workers carry on with the entries they
+ * were started with, which are taken by their original number.
+ */
+void loader_reload(struct loader *loader, struct reload *reload,
+                   struct index *index)
+{
+	index_stop(loader->index, false); /* saved in the background */
+	loader->index = index;
+	if (loader->reload)
+		reload_free(loader->reload);
+	loader->reload = reload;
+}
+
+/**
+ * Return how far along startup is, from 0 to 1. Each stage counts for a share
+ * of it, and it's 1 exactly when everything is done.
+ */
+double loader_progress(struct loader *loader)
+{
+	int entries = loader->params->num_entries;
+	double open, warm, index;
+	bool running;
+
+	pthread_mutex_lock(&loader->lock);
+	running = loader->running > 0;
+	/* until the budget is used up, every entry may need opening */
+	open = running ? (double)loader->opened / entries : 1;
+	warm = loader->to_warm > 0 ?
+	       (double)loader->warmed / loader->to_warm : !running;
+	pthread_mutex_unlock(&loader->lock);
+	/* the index may give up early, and then it's as done as it gets */
+	index = index_finished(loader->index) ? 1 :
+	        (double)index_count(loader->index) / entries;
+
+	return STAGE_CONFIG + STAGE_OPEN * open + STAGE_WARM * warm +
+	       STAGE_INDEX * index;
+}
+
+/**
+ * Take the content of entry i, if it was loaded in the background, waiting for
+ * a worker which is busy loading it. Each entry can only be taken once. Returns
+ * 1 when the content was taken, 0 when it wasn't loaded (and the caller should
+ * load it), and -1 when loading it failed.
+ */
+int loader_take(struct loader *loader, int i, struct content *c)
+{
+	struct load_slot *slot = &loader->slots[i];
+	enum load_state state;
+
+	pthread_mutex_lock(&loader->lock);
+	while (slot->state == LOAD_BUSY)
+		pthread_cond_wait(&loader->done, &loader->lock);
+	state = slot->state;
+	slot->state = LOAD_TAKEN;
+	pthread_mutex_unlock(&loader->lock);
+
+	switch (state) {
+	case LOAD_DONE:
+		*c = slot->content;
+		return 1;
+	case LOAD_FAILED:
+		restore_error(&slot->error);
+		return -1;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Stop the workers and the index (waiting for it to be saved), and free
+ * whatever content wasn't taken.
+ */
+void loader_stop(struct loader *loader)
+{
+	int i;
+
+	pthread_mutex_lock(&loader->lock);
+	loader->stop = true;
+	pthread_mutex_unlock(&loader->lock);
+	for (i = 0; i < loader->num_workers; i++)
+		pthread_join(loader->workers[i], NULL);
+	index_stop(loader->index, true);
+	if (loader->reload)
+		reload_free(loader->reload);
+
+	for (i = 0; i < loader->params->num_entries; i++) {
+		if (loader->slots[i].state == LOAD_DONE)
+			content_free(&loader->slots[i].content);
+	}
+	pthread_cond_destroy(&loader->done);
+	pthread_mutex_destroy(&loader->lock);
+	free(loader->slots);
+	free(loader);
+}
@@ -0,0 +1,334 @@
+/**
+ * alien-console: event loop
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * The splash screen and the personal terminal both run on an epoll loop, which
+ * sleeps until something happens: input on a terminal, a timer (a timerfd)
+ * coming due, a signal, or any other file descriptor becoming readable, like
+ * inotify, the loader's eventfds or a child's pidfd. Each of those is a source,
+ * with a handler called from the loop. So the program uses no CPU while idle,
+ * and whatever happens reaches the screen as soon as the loop gets to it.
+ *
+ * Signals are blocked in every thread (see loop_block_signals()) and read from
+ * a signalfd instead, so that they're handled on the loop like anything else,
+ * rather than interrupting it. That covers SIGWINCH, which curses would
+ * otherwise catch itself, SIGCHLD, and SIGTERM, SIGINT and SIGHUP, which ask
+ * the program to quit cleanly, restoring the terminal on the way out.
+ *
+ * Work which should happen once the events at hand are handled is deferred as
+ * a task, like updating a screen once however many events changed it, or a
+ * step of a search. The loop doesn't sleep while tasks are waiting, so a task
+ * which defers itself again runs whenever there's nothing else to do.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "alien-console.h"
+
+#define LOOP_EVENTS 16 /* handled for each epoll_wait() */
+
+static const int loop_signals[] = {
+	SIGWINCH, SIGCHLD, SIGTERM, SIGINT, SIGHUP,
+};
+
+struct loop {
+	int epoll_fd;
+	struct loop_source signals; /* the signalfd */
+	struct loop_source *handlers[NSIG]; /* for each signal, or NULL */
+	struct loop_task *tasks, **tasks_tail;
+	bool stopped;
+};
+
+static void signal_set(sigset_t *set)
+{
+	unsigned int i;
+
+	sigemptyset(set);
+	for (i = 0; i < nelem(loop_signals); i++)
+		sigaddset(set, loop_signals[i]);
+}
+
+/**
+ * Block the signals the loop handles, in this thread and any it starts from now
+ * on. Called first thing, so that they aren't delivered to some other thread
+ * instead of being left for the signalfd. Child processes should unblock them.
+ */
+int loop_block_signals(void)
+{
+	sigset_t set;
+
+	signal_set(&set);
+	if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+		set_error(ESYS);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Read the pending signals, and call their handlers.
+ */
+static int read_signals(struct loop *loop, struct loop_source *source)
+{
+	struct signalfd_siginfo info;
+	struct loop_source *handler;
+
+	while (read(source->fd, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo >= NSIG)
+			continue;
+		handler = loop->handlers[info.ssi_signo];
+		if (handler && handler->handle(loop, handler) < 0) {
+			mark_error();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Create a loop, watching nothing yet but the signals.
+ */
+struct loop *loop_new(void)
+{
+	struct loop *loop;
+	sigset_t set;
+	int fd;
+
+	loop = calloc(1, sizeof(struct loop));
+	if (!loop) {
+		set_error(EMEM);
+		return NULL;
+	}
+	loop->tasks_tail = &loop->tasks;
+	loop->signals.fd = -1;
+	loop->signals.handle = read_signals;
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		set_error(ESYS);
+		free(loop);
+		return NULL;
+	}
+
+	signal_set(&set);
+	fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		set_error(ESYS);
+		goto cleanup;
+	}
+	if (loop_watch(loop, &loop->signals, fd) < 0) {
+		mark_error();
+		close(fd);
+		goto cleanup;
+	}
+	return loop;
+
+cleanup:
+	close(loop->epoll_fd);
+	free(loop);
+	return NULL;
+}
+
+/**
+ * Make fd the file descriptor the source watches, in place of the one it had
+ * (if any). When fd is -1, the source just stops watching. The source must
+ * outlive the loop, or stop watching first.
+ */
+int loop_watch(struct loop *loop, struct loop_source *source, int fd)
+{
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = source };
+
+	if (fd == source->fd)
+		return 0;
+	if (source->fd >= 0)
+		epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+	source->fd = -1;
+	if (fd >= 0 && epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		set_error(ESYS);
+		return -1;
+	}
+	source->fd = fd;
+	return 0;
+}
+
+/**
+ * Stop watching the source, and close its file descriptor, like a timer's.
+ */
+void loop_close(struct loop *loop, struct loop_source *source)
+{
+	int fd = source->fd;
+
+	if (fd < 0)
+		return;
+	loop_watch(loop, source, -1);
+	close(fd);
+}
+
+/**
+ * Make the source a timer, which is handled once it's due (see
+ * loop_timer_at()). It isn't due until then. Close it with loop_close().
+ */
+int loop_timer(struct loop *loop, struct loop_source *source)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0) {
+		set_error(ESYS);
+		return -1;
+	}
+	source->fd = -1;
+	source->timer = true;
+	if (loop_watch(loop, source, fd) < 0) {
+		mark_error();
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Make the timer due at the given time on the monotonic clock, or right away if
+ * that has passed. It's only handled once for each time it's set.
+ */
+int loop_timer_at(struct loop_source *source, const struct timespec *when)
+{
+	struct itimerspec spec = { .it_value = *when };
+
+	if (timerfd_settime(source->fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+		set_error(ESYS);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Handle the signal with the source's handler (the source watches nothing).
+ * One source may handle several signals.
+ */
+void loop_signal(struct loop *loop, int signo, struct loop_source *source)
+{
+	loop->handlers[signo] = source;
+}
+
+/**
+ * Run the task once the events at hand have been handled, unless it's waiting
+ * to run already. Tasks run in the order they were deferred.
+ */
+void loop_defer(struct loop *loop, struct loop_task *task)
+{
+	if (task->queued)
+		return;
+	task->queued = true;
+	task->next = NULL;
+	*loop->tasks_tail = task;
+	loop->tasks_tail = &task->next;
+}
+
+/**
+ * Run the tasks which are waiting. Those deferred meanwhile wait for the next
+ * round, so that a task deferring itself doesn't starve the events.
+ */
+static int run_tasks(struct loop *loop)
+{
+	struct loop_task *task = loop->tasks, *next;
+	int rv = 0;
+
+	loop->tasks = NULL;
+	loop->tasks_tail = &loop->tasks;
+	for (; task; task = next) {
+		next = task->next;
+		task->queued = false;
+		if (rv == 0 && !loop->stopped && task->run(loop, task) < 0) {
+			mark_error();
+			rv = -1;
+		}
+	}
+	return rv;
+}
+
+/**
+ * Call the source's handler, after reading a timer's expiry count (which is
+ * all there is to read from a timerfd).
+ */
+static int dispatch(struct loop *loop, struct loop_source *source)
+{
+	uint64_t expired;
+
+	if (source->fd < 0)
+		return 0; /* stopped watching since the event was collected */
+	if (source->timer &&
+	    read(source->fd, &expired, sizeof(expired)) != sizeof(expired))
+		return 0; /* set again meanwhile, and not due yet */
+	return source->handle(loop, source);
+}
+
+/**
+ * Handle events, and run deferred tasks, until a handler or task calls
+ * loop_stop() (which returns 0) or fails (which returns -1).
+ */
+int loop_run(struct loop *loop)
+{
+	struct epoll_event events[LOOP_EVENTS];
+	int n, i;
+
+	loop->stopped = false;
+	while (!loop->stopped) {
+		n = epoll_wait(loop->epoll_fd, events, nelem(events),
+		               loop->tasks ? 0 : -1);
+		if (n < 0 && errno != EINTR) {
+			set_error(ESYS);
+			return -1;
+		}
+		for (i = 0; i < n && !loop->stopped; i++) {
+			if (dispatch(loop, events[i].data.ptr) < 0) {
+				mark_error();
+				return -1;
+			}
+		}
+		if (run_tasks(loop) < 0) {
+			mark_error();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Make loop_run() return, once the handler or task calling this is done.
+ */
+void loop_stop(struct loop *loop)
+{
+	loop->stopped = true;
+}
+
+/**
+ * Resize the current curses screen if its terminal (fd) changed size, as curses
+ * would on SIGWINCH if it caught the signal itself. Returns true if it did, and
+ * then getch() reports KEY_RESIZE.
+ */
+bool loop_term_resized(int fd)
+{
+	struct winsize ws;
+
+	if (ioctl(fd, TIOCGWINSZ, &ws) < 0 || ws.ws_row == 0 ||
+	    ws.ws_col == 0 || !is_term_resized(ws.ws_row, ws.ws_col))
+		return false;
+	resizeterm(ws.ws_row, ws.ws_col);
+	return true;
+}
+
+/**
+ * Free the loop. Its sources are left as they are, but no longer watched.
+ */
+void loop_free(struct loop *loop)
+{
+	close(loop->signals.fd);
+	close(loop->epoll_fd);
+	free(loop);
+}
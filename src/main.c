@@ -4,16 +4,28 @@
  */
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <ncurses.h>
 
 #include "alien-console.h"
 
+#define MAX_TTYS 256
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: alien-console [-t TTY]... [CONFIG]\n");
+	exit(-1);
+}
+
+/**
+ * Return the configuration file, given the arguments after the options.
+ */
 char *config_file(int argc, char *argv[])
 {
 	struct stat s;
-	if (argc >= 2) {
-		return argv[1];
+	if (argc >= 1) {
+		return argv[0];
 	} else if (stat(SYSTEM_CONFIG, &s) == 0) {
 		return SYSTEM_CONFIG;
 	} else if (stat(DEFAULT_CONFIG, &s) == 0) {
@@ -25,17 +37,59 @@ char *config_file(int argc, char *argv[])
 
 int main(int argc, char *argv[])
 {
-	int rv = 0;
+	int rv = 0, opt, num_ttys = 0;
 	struct pt_params params;
-	char *config;
+	struct loader *loader;
+	char *config, *ttys[MAX_TTYS];
+
+	TRACE_INIT();         /* time startup, if asked to */
+	if (loop_block_signals() < 0 || /* they're read on the event loop */
+	    content_guard() < 0) {      /* survive truncated content files */
+		rv = -1;
+		mark_error();
+		goto exit;
+	}
+	/* with -t, run in server mode, with a seat on each tty */
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		if (opt != 't' || num_ttys == MAX_TTYS)
+			usage();
+		ttys[num_ttys++] = optarg;
+	}
+	if (argc - optind > 1)
+		usage();
 
-	config = config_file(argc, argv);
+	TRACE_BEGIN(find_config, "config_file");
+	config = config_file(argc - optind, argv + optind);
+	TRACE_END_DETAIL(find_config, config);
 	rv = parse_config(config, &params);
 	if (rv < 0) {
 		mark_error();
 		goto exit;
 	}
 
+	if (params.share_line_index)
+		share_enable(); /* with the other consoles on this host */
+
+	/* load content while the splash screen shows */
+	loader = loader_start(&params);
+	if (!loader) {
+		rv = -1;
+		mark_error();
+		cleanup_config(&params);
+		goto exit;
+	}
+
+	stats_init();         /* count terminal output, if asked to */
+	if (num_ttys > 0) {
+		/* no splash screen, the seats come and go */
+		rv = server(&params, loader, ttys, num_ttys);
+		if (rv < 0)
+			mark_error();
+		loader_stop(loader);
+		cleanup_config(&params);
+		goto exit;
+	}
+
 	/* ncurses initialization */
 	initscr();            /* initialize curses */
 	cbreak();             /* pass key presses to program, but not signals */
@@ -45,25 +99,35 @@ int main(int argc, char *argv[])
 	curs_set(0);          /* set the cursor to invisible */
 
 
-	rv = splash(&params.splash); /* display splash screen */
+	rv = splash(&params.splash, loader); /* display splash screen */
 	if (rv < 0) {
 		mark_error();
 		goto cleanup;
+	} else if (rv > 0) {
+		rv = 0; /* asked to quit by a signal */
+		goto cleanup;
 	}
 
-	rv = personal_terminal(&params); /* display pt (main loop) */
+	rv = personal_terminal(&params, loader); /* display pt (main loop) */
 	if (rv < 0) {
 		mark_error();
 		goto cleanup;
 	}
 
 cleanup:
-	cleanup_config(&params);
+	sound_stop();
 
 	// Deinitialize NCurses
 	wclear(stdscr);
 	endwin();
+
+	/* after giving the terminal back, since this saves the index */
+	loader_stop(loader);
+	cleanup_config(&params);
 exit:
+	stats_report(stderr);
+	splash_report(stderr);
+	TRACE_FINISH();
 	if (rv < 0) {
 		report_error(stderr);
 		return rv;
@@ -0,0 +1,79 @@
+/**
+ * alien-console: bundle packer
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * Compiles a configuration file and its content into a bundle, which
+ * alien-console can load in place of the configuration (see bundle.c).
+ *
+ * Usage: alien-console-pack [-w COLUMNS]... CONFIG BUNDLE, where each COLUMNS
+ * is a terminal width the bundle should have line indices for (80 by default).
+ */
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "alien-console.h"
+
+#define PACK_WIDTHS_MAX 16
+#define PACK_COLUMNS 80
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: alien-console-pack [-w COLUMNS]... CONFIG "
+	        "BUNDLE\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Add the content box width for a terminal with the given columns, unless it's
+ * there already.
+ */
+static void add_width(int *widths, int *num_widths, const char *arg)
+{
+	int columns = atoi(arg), width, i;
+
+	if (columns <= 0)
+		usage();
+	width = pt_content_width(columns);
+	for (i = 0; i < *num_widths; i++) {
+		if (widths[i] == width)
+			return;
+	}
+	if (*num_widths == PACK_WIDTHS_MAX) {
+		fprintf(stderr, "alien-console-pack: at most %d widths\n",
+		        PACK_WIDTHS_MAX);
+		exit(EXIT_FAILURE);
+	}
+	widths[(*num_widths)++] = width;
+}
+
+int main(int argc, char *argv[])
+{
+	int widths[PACK_WIDTHS_MAX], num_widths = 0, opt, rv;
+	struct pt_params params;
+
+	while ((opt = getopt(argc, argv, "w:")) != -1) {
+		if (opt != 'w')
+			usage();
+		add_width(widths, &num_widths, optarg);
+	}
+	if (argc - optind != 2)
+		usage();
+	if (num_widths == 0)
+		widths[num_widths++] = pt_content_width(PACK_COLUMNS);
+
+	rv = parse_config(argv[optind], &params);
+	if (rv < 0) {
+		mark_error();
+		goto exit;
+	}
+	rv = bundle_write(&params, widths, num_widths, argv[optind + 1]);
+	if (rv < 0)
+		mark_error();
+	cleanup_config(&params);
+exit:
+	if (rv < 0) {
+		report_error(stderr);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -24,12 +24,19 @@
  * the content title, and the content text all have windows. Each one has a
  * function which will redraw it and refresh it (but not doupdate()). The init
  * function creates all windows, draws all the static stuff, and uses each draw
- * function to draw everything for the first time. Then the loop function simply
- * waits for keypresses and calls corresponding functions. These guys just
- * update the state and then redraw only the things that changed.
+ * function to draw everything for the first time. Then the event loop (see
+ * server.c) simply waits for keypresses and calls corresponding functions.
+ * These guys just update the state and then redraw only the things that
+ * changed.
  */
+#include <ctype.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 
 #include <ncurses.h>
 
@@ -44,12 +51,11 @@
 #define X_FOLDER_BOX 0
 #define H_FOLDER_BOX 4
 #define W_FOLDER_BOX 20
-#define N_FOLDER_BOX 4
 
 #define Y_ELBOW_WINDOW 2
 #define X_ELBOW_WINDOW W_FOLDER_BOX
 #define W_ELBOW_WINDOW 3
-#define H_ELBOW_WINDOW (N_FOLDER_BOX * H_FOLDER_BOX + 3)
+#define H_ELBOW_WINDOW(slots) ((slots) * H_FOLDER_BOX + 3)
 
 #define Y_CONTENT_TITLE 2
 #define X_CONTENT_TITLE (W_FOLDER_BOX + W_ELBOW_WINDOW)
@@ -59,409 +65,1916 @@
 #define X_CONTENT_TEXT X_CONTENT_TITLE
 #define CONTENT_TEXT_MIN_WIDTH 40
 
-#define MIN_HEIGHT (X_FOLDER_BOX + N_FOLDER_BOX * H_FOLDER_BOX + 1)
+#define MIN_HEIGHT (Y_FOLDER_BOX + H_FOLDER_BOX + 1)
 #define MIN_WIDTH (X_CONTENT_TEXT + CONTENT_TEXT_MIN_WIDTH)
-/* bottom text is 59 characters, so we're limited by layout, not text */
+/* bottom text is 61 characters, so we're limited by layout, not text */
+
+#define SEARCH_MAX 64 /* longest search pattern */
+#define SEARCH_SLICE (64 * 1024 * 1024) /* bytes scanned per search step */
+#define WRAP_SLICE 65536 /* lines wrapped per search step */
+
+#define FIND_MAX_HITS 1000 /* hits listed by the global search screen */
+#define Y_FIND_HITS 4
+
+/* the most characters an int takes in decimal, with its sign (since each digit
+ * takes more than 3 bits) */
+#define INT_CHARS (sizeof(int) * CHAR_BIT / 3 + 2)
 
 struct folder_entry {
 	char *folder;
 	char *title;
-	char *text;
-	int lines;
+	const struct pt_entry *source; /* where the content comes from */
+	struct content *content; /* from the store, while loaded */
+	bool follow;
+	int watch; /* inotify watch descriptor when followed and loaded */
+	bool loaded;
+	int slot; /* where the loader may have loaded it, or -1 (see store.c) */
+	size_t cost; /* bytes charged to the cache while loaded */
+	int lru_prev, lru_next; /* neighbours in the cache, -1 at either end */
+};
+
+/*
+ * A search scans the selected entry one slice at a time, checking for input in
+ * between, so that it stays interactive in huge entries. Once a match is found,
+ * the text up to it is wrapped (also a slice at a time) to find its line, and
+ * then the view jumps there. See search_step().
+ */
+enum search_state {
+	SEARCH_IDLE,
+	SEARCH_TYPING, /* the pattern is being typed, after '/' */
+	SEARCH_SCANNING, /* looking for a match, starting from pos */
+	SEARCH_WRAPPING, /* wrapping the text up to the match */
+};
+
+struct search {
+	enum search_state state;
+	char pattern[SEARCH_MAX + 1];
+	int len;
+	bool backward; /* look for a match before pos, rather than after */
+	size_t pos;
+	bool found; /* match is in the selected entry, and highlighted */
+	bool failed; /* the last search found nothing */
+	size_t match;
+};
+
+/*
+ * The global search screen covers the whole terminal while it's open. It asks
+ * the index (see index.c) for the entries containing the query as it's typed,
+ * and again as more entries are indexed.
+ */
+struct finder {
+	WINDOW *win; /* NULL while closed */
+	char query[SEARCH_MAX + 1];
+	int len;
+	struct index_hit hits[FIND_MAX_HITS];
+	int num_hits; /* in hits, there may be more */
+	int total_hits;
+	int selected, top;
+	int indexed; /* entries indexed so far */
+};
+
+/* what the screen shows, see draw_view() */
+struct view {
+	unsigned int selected;
+	int scroll;
+	unsigned int restarts;
+	int folder_top;
+	bool found;
+	size_t match;
 };
 
 struct personal_terminal {
 	int maxy, maxx;
 	WINDOW *content_title;
 	WINDOW *content_text;
+	WINDOW *content_body; /* subwindow inside the content_text box */
 	WINDOW *elbow_box;
-	WINDOW *folder_box[N_FOLDER_BOX];
-	struct folder_entry folder_entries[N_FOLDER_BOX];
+	struct folder_entry *folder_entries;
 	int folder_count;
+
+	/*
+	 * There may be far more folders than fit on the screen, so there are
+	 * only enough folder boxes to fill the column ("slots"), and they show
+	 * the entries starting at folder_top.
+	 */
+	WINDOW **folder_box;
+	int folder_slots;
+	int folder_top;
 	unsigned int selected;
-	unsigned int scroll;
+	int scroll; /* line at the top, which may be negative (see content.c) */
+	unsigned int restarts; /* which renumber lines, see restart_selected() */
+
+	/* loaded entries, most recently used at the head */
+	int dirfd;
+	int lru_head, lru_tail;
+	size_t cache_used, cache_size;
+
+	int inotify_fd; /* only when some entries are followed, otherwise -1 */
+	bool too_small; /* nothing is drawn until the terminal grows again */
+	int goto_line; /* line number being typed, or 0 */
+	struct search search;
+	struct store *store; /* shared with any other terminals, see server.c */
+	struct index *index;
+	struct finder finder;
 };
 
 /**
- * Insert newlines at spaces in the string so that lines are no longer than the
- * width of the box (subtracting 2 to account for the box lines).
+ * Return the number of columns of text which fit in the content box of a
+ * terminal with the given columns (subtracting 2 to account for the box lines).
+ * When the terminal is too small, pretend it's the minimum size.
+ */
+int pt_content_width(int columns)
+{
+	if (columns < MIN_WIDTH)
+		return MIN_WIDTH - X_CONTENT_TEXT - 2;
+	return columns - X_CONTENT_TEXT - 2;
+}
+
+static int content_width(struct personal_terminal *pt)
+{
+	return pt_content_width(pt->maxx);
+}
+
+/**
+ * Return the number of text lines which fit in the content box (subtracting 1
+ * for the bar at the bottom, and 2 for the box lines).
+ */
+static int content_height(struct personal_terminal *pt)
+{
+	if (pt->maxy < MIN_HEIGHT)
+		return MIN_HEIGHT - Y_CONTENT_TEXT - 1 - 2;
+	return pt->maxy - Y_CONTENT_TEXT - 1 - 2;
+}
+
+/**
+ * Start the line index for the entry over, wrapping lines so they are no longer
+ * than the width of the box. Content shared with other terminals is swapped for
+ * the content wrapped to that width instead (see store.c).
  */
 static int wrap_folder_entry(struct personal_terminal *pt,
                              struct folder_entry *entry)
 {
-	int maxy, maxx, width, i;
-	int last_space = -1, line_length = 0;
-	getmaxyx(pt->content_text, maxy, maxx);
-	(void) maxy; /* unused */
-	width = maxx - 2;
-
-	for (i = 0; entry->text[i]; i++) {
-		if (entry->text[i] == ' ') {
-			line_length++;
-			last_space = i;
-		} else if (entry->text[i] == '\n') {
-			line_length = 0;
-			last_space = -1;
-		} else {
-			line_length++;
-		}
-		if (line_length > width) {
-			if (last_space == -1) {
-				set_error(EBIGTEXT);
-				return -1;
-			}
-			entry->text[last_space] = '\n';
-			line_length = i - last_space;
-			last_space = -1;
-		}
+	struct content *c;
+	TRACE_BEGIN(span, "wrap_folder_entry");
+	c = store_rewrap(pt->store, pt->dirfd, entry->source, entry->content,
+	                 content_width(pt));
+	TRACE_END_DETAIL(span, entry->source->content_file);
+	if (!c) {
+		mark_error();
+		return -1;
 	}
-	entry->lines = count_lines(entry->text);
+	entry->content = c;
 	return 0;
 }
 
+/*
+ * Content is loaded the first time an entry is selected, and kept in an LRU
+ * cache afterward. When the cache exceeds its budget, the least recently used
+ * entries are unloaded until it fits again. The entry which was just used is
+ * never unloaded, even if it blows the budget all by itself.
+ */
+
 /**
- * Draws the content box according to the state of the terminal. Hopefully,
- * you've wrapped the text already!
+ * Remove entry i from the LRU list.
  */
-static void draw_content_text(struct personal_terminal *pt)
+static void cache_unlink(struct personal_terminal *pt, int i)
 {
-	int maxy, maxx, nlines, i;
-	unsigned int scroll = pt->scroll;
-	char *str = pt->folder_entries[pt->selected].text;
-	wclear(pt->content_text);
-	box(pt->content_text, 0, 0);
-	getmaxyx(pt->content_text, maxy, maxx);
-	(void) maxx; /* unused */
-	nlines = maxy - 2;
+	struct folder_entry *entry = &pt->folder_entries[i];
+	if (entry->lru_prev >= 0)
+		pt->folder_entries[entry->lru_prev].lru_next = entry->lru_next;
+	else
+		pt->lru_head = entry->lru_next;
+	if (entry->lru_next >= 0)
+		pt->folder_entries[entry->lru_next].lru_prev = entry->lru_prev;
+	else
+		pt->lru_tail = entry->lru_prev;
+	pt->cache_used -= entry->cost;
+}
+
+/**
+ * Insert entry i at the head of the LRU list.
+ */
+static void cache_push(struct personal_terminal *pt, int i)
+{
+	struct folder_entry *entry = &pt->folder_entries[i];
+	entry->cost = content_cost(entry->content);
+	entry->lru_prev = -1;
+	entry->lru_next = pt->lru_head;
+	if (pt->lru_head >= 0)
+		pt->folder_entries[pt->lru_head].lru_prev = i;
+	else
+		pt->lru_tail = i;
+	pt->lru_head = i;
+	pt->cache_used += entry->cost;
+}
 
-	/* move to line */
-	while (scroll > 0 && str) {
-		scroll--;
-		str = strchr(str, '\n') + 1;
+/**
+ * Hand an entry's content back to the store, and stop watching it if it was
+ * followed. This does not remove it from the LRU list.
+ */
+static void unload_entry(struct personal_terminal *pt,
+                         struct folder_entry *entry)
+{
+	if (entry->watch >= 0) {
+		inotify_rm_watch(pt->inotify_fd, entry->watch);
+		entry->watch = -1;
 	}
+	store_put(pt->store, entry->content);
+	entry->content = NULL;
+	entry->loaded = false;
+}
 
-	/* scrolled past content. try not to do this */
-	if (!str) {
-		wnoutrefresh(pt->content_text);
-		return;
+/**
+ * Get an entry's content from the store, wrapped to the box. It's taken from
+ * the loader if it was loaded in the background, or from another terminal if
+ * one has it. Followed entries get an inotify watch, which is placed on the
+ * open file rather than the path.
+ *
+ * When the file can't be loaded, the content says why instead, and when a
+ * followed file can't be watched (there's a limit on watches), it's shown as
+ * it is. Either way the entry is stale, and is loaded again the next time it's
+ * selected.
+ */
+static int load_entry(struct personal_terminal *pt, struct folder_entry *entry)
+{
+	char path[PATH_MAX];
+
+	entry->content = store_get(pt->store, pt->dirfd, entry->source,
+	                           entry->slot, content_width(pt));
+	entry->slot = -1;
+	if (!entry->content) {
+		mark_error();
+		return -1;
 	}
+	entry->loaded = true;
 
-	/* now do the printing */
-	for (i = 0; i < nlines && str; i++) {
-		char *newstr = strchr(str, '\n');
-		if (!newstr) {
-			/* no newline before end of string, but there could be
-			 * more text, so let's print this string and then exit
-			 */
-			mvwaddstr(pt->content_text, 1 + i, 1, str);
-			str = newstr;
-		} else {
-			/* the normal case */
-			mvwaddnstr(pt->content_text, 1 + i, 1, str, newstr - str);
-			str = newstr + 1;
-		}
+	if (entry->follow && !entry->content->failed) {
+		snprintf(path, sizeof(path), "/proc/self/fd/%d",
+		         entry->content->fd);
+		entry->watch = inotify_add_watch(pt->inotify_fd, path,
+		                                 IN_MODIFY);
 	}
-	wnoutrefresh(pt->content_text);
-	return;
+	return 0;
 }
 
 /**
- * Draws the elbow box, which contains the little elbow connector that joins
- * the selected folder with the content title.
+ * Return true if a loaded entry should be loaded again, see load_entry().
  */
-static void draw_elbow_box(struct personal_terminal *pt)
+static bool entry_stale(const struct folder_entry *entry)
 {
-	unsigned int i;
-	wclear(pt->elbow_box);
-	wattron(pt->elbow_box, A_BOLD);
-	mvwaddch(pt->elbow_box, 1, 2, ACS_HLINE);
-	mvwaddch(pt->elbow_box, 1, 1, ACS_ULCORNER);
-	mvwaddch(pt->elbow_box, 2, 1, ACS_VLINE);
-	for (i = 0; i < (unsigned int)pt->folder_count * W_FOLDER_BOX; i++) {
-		if (i == pt->selected * H_FOLDER_BOX + 1) {
-			mvwaddch(pt->elbow_box, 3 + i, 1, ACS_LRCORNER);
-			mvwaddch(pt->elbow_box, 3 + i, 0, ACS_HLINE);
-			wattroff(pt->elbow_box, A_BOLD);
-			wnoutrefresh(pt->elbow_box);
-			return;
-		} else {
-			mvwaddch(pt->elbow_box, 3 + i, 1, ACS_VLINE);
-		}
+	return entry->content->failed || (entry->follow && entry->watch < 0);
+}
+
+/**
+ * Make sure entry i is loaded (again, if it was stale) and wrapped, and mark it
+ * as most recently used. Then unload other entries until the cache is within
+ * budget.
+ */
+static int cache_load(struct personal_terminal *pt, int i)
+{
+	struct folder_entry *entry = &pt->folder_entries[i];
+	int victim;
+
+	if (entry->loaded)
+		cache_unlink(pt, i);
+	if (entry->loaded && entry_stale(entry))
+		unload_entry(pt, entry);
+	if (!entry->loaded && load_entry(pt, entry) < 0) {
+		mark_error();
+		return -1;
 	}
-	wnoutrefresh(pt->elbow_box);
+	cache_push(pt, i);
+
+	while (pt->cache_used > pt->cache_size && pt->lru_tail != i) {
+		victim = pt->lru_tail;
+		cache_unlink(pt, victim);
+		unload_entry(pt, &pt->folder_entries[victim]);
+	}
+	return 0;
 }
 
 /**
- * Draws the content title. Not much special here.
+ * Recompute what entry i is charged by the cache, after its size changed.
  */
-static void draw_content_title(struct personal_terminal *pt)
+static void cache_recharge(struct personal_terminal *pt, int i)
 {
-	wclear(pt->content_title);
-	box(pt->content_title, 0, 0);
-	mvwaddch(pt->content_title, 1, 0, ACS_RTEE);
-	mvwaddstr(pt->content_title, 1, 1,
-	          pt->folder_entries[pt->selected].title);
-	wnoutrefresh(pt->content_title);
+	struct folder_entry *entry = &pt->folder_entries[i];
+	pt->cache_used -= entry->cost;
+	entry->cost = content_cost(entry->content);
+	pt->cache_used += entry->cost;
 }
 
 /**
- * Draws the folder box. This never gets cleared, and as a result we can skip
- * the overhead of drawing the text each time, and simply do the outline. This
- * function will insert a connector for the elbow at the appropriate location.
- * It will also select the appropriate attributes for printing.
+ * Wrap the selected entry far enough to have the given number of lines (if it
+ * is that long). Since the line index grows, the cache is charged for it.
  */
-static void draw_folder_box_outline(struct personal_terminal *pt,
-                                    unsigned int i)
+static int wrap_selected(struct personal_terminal *pt, int lines)
 {
-	int attr = (i == pt->selected ? A_BOLD : A_DIM);
-	wattron(pt->folder_box[i], attr);
-	box(pt->folder_box[i], 0, 0);
-	if (pt->selected == i) {
-		mvwaddch(pt->folder_box[i], 1, W_FOLDER_BOX - 1, ACS_LTEE);
+	struct folder_entry *entry = &pt->folder_entries[pt->selected];
+	if (content_wrap_to(entry->content, lines) < 0) {
+		mark_error();
+		return -1;
 	}
-	wattroff(pt->folder_box[i], attr);
-	wnoutrefresh(pt->folder_box[i]);
+	cache_recharge(pt, pt->selected);
+	return 0;
 }
 
 /**
- * Select a new folder, index i. If the folder is out of range, don't bother.
- * This will call the appropriate redrawing code.
+ * Wrap the selected entry back far enough to have a line numbered line, or
+ * back to the top of the text (see content_wrap_back()), charging the cache.
  */
-static void select_folder(struct personal_terminal *pt, int i)
+static int wrap_selected_back(struct personal_terminal *pt, int line)
 {
-	if (i < 0 || i >= pt->folder_count)
-		return;
-
+	struct folder_entry *entry = &pt->folder_entries[pt->selected];
+	if (content_wrap_back(entry->content, line) < 0) {
+		mark_error();
+		return -1;
+	}
+	cache_recharge(pt, pt->selected);
+	return 0;
+}
 
-	unsigned int old = pt->selected;
-	pt->selected = (unsigned int) i;
-	pt->scroll = 0;
+/**
+ * Start the selected entry's line index over at the last hard newline before
+ * offset (see content_restart()), to jump far from the lines it has without
+ * wrapping everything in between. The terminal has to have the content to
+ * itself for that, so it may be swapped for a copy (see store_own()). When it
+ * can't be, nothing changes, and the index is just wrapped there as usual.
+ */
+static int restart_selected(struct personal_terminal *pt, size_t offset)
+{
+	struct folder_entry *entry = &pt->folder_entries[pt->selected];
+	int rv;
 
-	draw_elbow_box(pt);
-	draw_content_text(pt);
-	draw_content_title(pt);
-	draw_folder_box_outline(pt, old);
-	draw_folder_box_outline(pt, pt->selected);
+	rv = store_own(pt->store, pt->dirfd, entry->source, &entry->content);
+	if (rv < 0 || (rv > 0 && content_restart(entry->content, offset) < 0)) {
+		mark_error();
+		return -1;
+	}
+	if (rv > 0)
+		pt->restarts++;
+	cache_recharge(pt, pt->selected);
+	return 0;
 }
 
 /**
- * Do a scroll up operation (if possible) and then redraw.
+ * Make the selected entry's line index reach back to the top of the text. An
+ * index started further on is started over at the top, rather than wrapped
+ * back a paragraph at a time.
  */
-static void scroll_up(struct personal_terminal *pt)
+static int wrap_selected_top(struct personal_terminal *pt)
 {
-	if (pt->scroll <= 0)
-		return;
+	struct content *content = pt->folder_entries[pt->selected].content;
 
-	pt->scroll -= 1;
-	draw_content_text(pt);
+	if (content->line_offsets[content->first_line] > 0 &&
+	    restart_selected(pt, 0) < 0) {
+		mark_error();
+		return -1;
+	}
+	return wrap_selected_back(pt, INT_MIN);
 }
 
 /**
- * Do a scroll down operation (if possible) and then redraw.
+ * Make the selected entry's line index reach the end of the text. Unless it
+ * does already, it's started over at the last paragraph, so that only a screen
+ * or so is wrapped back from there (see scroll_to()), rather than all the text
+ * in between.
  */
-static void scroll_down(struct personal_terminal *pt)
+static int wrap_selected_end(struct personal_terminal *pt)
 {
-	int maxy, maxx, height;
-	getmaxyx(pt->content_text, maxy, maxx);
-	(void)maxx; /* unused */
-	height = maxy - 2;
-	if ((int)pt->scroll + height >= pt->folder_entries[pt->selected].lines) {
-		return;
+	struct content *content = pt->folder_entries[pt->selected].content;
+
+	if (!content_wrapped(content) &&
+	    restart_selected(pt, content->size) < 0) {
+		mark_error();
+		return -1;
 	}
-	pt->scroll += 1;
-	draw_content_text(pt);
+	return wrap_selected(pt, INT_MAX);
 }
 
 /**
- * Initialize the curses resources and do a first draw of the personal terminal.
+ * Draws the box around the content text. This only changes with the layout.
  */
-static int init_personal_terminal(struct personal_terminal *pt)
+static void draw_content_frame(struct personal_terminal *pt)
 {
-	unsigned int i;
+	box(pt->content_text, 0, 0);
+	wnoutrefresh(pt->content_text);
+}
 
-	clear();
-	getmaxyx(stdscr, pt->maxy, pt->maxx);
+/**
+ * Highlight the part of the search match (if any) on the given row, which shows
+ * len bytes of the given line.
+ */
+static void draw_match(struct personal_terminal *pt, int row, int line,
+                       int len)
+{
+	struct search *search = &pt->search;
+	struct content *content = pt->folder_entries[pt->selected].content;
+	size_t start = content->line_offsets[line], end = start + len;
+	size_t from = search->match, to = search->match + search->len;
 
-	if (pt->maxy < MIN_HEIGHT) {
-		set_error(ESHORT);
-		return -1;
-	} else if (pt->maxx < MIN_WIDTH) {
-		set_error(ENARROW);
-		return -1;
+	if (!search->found)
+		return;
+	if (from < start)
+		from = start;
+	if (to > end)
+		to = end;
+	if (from < to)
+		mvwchgat(pt->content_body, row, from - start, to - from,
+		         A_REVERSE, 0, NULL);
+}
+
+/**
+ * Draws count rows of the content text starting at row first, clearing
+ * whatever was there before. Hopefully, you've wrapped the text already!
+ */
+static void draw_content_rows(struct personal_terminal *pt, int first,
+                              int count)
+{
+	int i, line, len;
+	const char *str;
+	struct content *content = pt->folder_entries[pt->selected].content;
+
+	for (i = first; i < first + count; i++) {
+		wmove(pt->content_body, i, 0);
+		wclrtoeol(pt->content_body);
+		line = pt->scroll + i;
+		if (line >= content->lines)
+			continue; /* scrolled past content */
+		str = content_line(content, line, &len);
+		waddnstr(pt->content_body, str, len);
+		draw_match(pt, i, line, len);
 	}
-	pt->selected = 0;
-	pt->scroll = 0;
+}
 
-	/* The first stuff we draw never changes, and thus has no windows. */
-	move(Y_PERSONAL_TERMINAL, X_PERSONAL_TERMINAL);
-	attron(A_REVERSE);
-	addstr("PERSONAL TERMINAL");
-	attroff(A_REVERSE);
-	chgat(-1, A_REVERSE, 0, NULL);
+/**
+ * Draws all of the content text according to the state of the terminal. Only
+ * the visible lines are touched, thanks to the line index.
+ */
+static void draw_content_text(struct personal_terminal *pt)
+{
+	werase(pt->content_body);
+	draw_content_rows(pt, 0, content_height(pt));
+	wnoutrefresh(pt->content_body);
+}
 
-	mvaddstr(Y_FOLDERS, X_FOLDERS, "FOLDERS");
+/**
+ * Shift the content text by delta rows (positive is toward the top), after the
+ * scroll position has changed by delta. Only the rows which were exposed are
+ * drawn. The body window has idlok() set, so that ncurses may use the
+ * terminal's own scrolling (insert/delete line) when the layout allows it.
+ * Returns false when the shift is too large, and everything was redrawn.
+ */
+static bool scroll_content_text(struct personal_terminal *pt, int delta)
+{
+	int height = content_height(pt);
 
-	move(pt->maxy - 1, 0);
-	attron(A_DIM);
-	addstr("UP, DOWN: select folder | LEFT, RIGHT: scroll | q: exit");
-	attroff(A_DIM);
+	if (delta >= height || -delta >= height) {
+		draw_content_text(pt);
+		return false;
+	}
+	scrollok(pt->content_body, TRUE);
+	wscrl(pt->content_body, delta);
+	/* otherwise, writing the bottom right corner would scroll the window */
+	scrollok(pt->content_body, FALSE);
 
-	wnoutrefresh(stdscr);
+	if (delta > 0)
+		draw_content_rows(pt, height - delta, delta);
+	else
+		draw_content_rows(pt, 0, -delta);
+	wnoutrefresh(pt->content_body);
+	return true;
+}
 
-	/* the remaining stuff is redrawn regularly, and uses windows */
-	pt->elbow_box = newwin(H_ELBOW_WINDOW, W_ELBOW_WINDOW, Y_ELBOW_WINDOW,
-	                       X_ELBOW_WINDOW);
-	pt->content_title = newwin(H_CONTENT_TITLE, pt->maxx - X_CONTENT_TITLE,
-	                           Y_CONTENT_TITLE, X_CONTENT_TITLE);
-	pt->content_text = newwin(pt->maxy - Y_CONTENT_TEXT - 1, /* for bar */
-	                          pt->maxx - X_CONTENT_TEXT,
-	                          Y_CONTENT_TEXT, X_CONTENT_TEXT);
-
-	for (i = 0; i < (unsigned int)pt->folder_count; i++) {
-		pt->folder_box[i] = newwin(H_FOLDER_BOX, W_FOLDER_BOX,
-		                           Y_FOLDER_BOX + i * H_FOLDER_BOX,
-		                           X_FOLDER_BOX);
-		mvwaddstr(pt->folder_box[i], 1, 1, pt->folder_entries[i].folder);
-		draw_folder_box_outline(pt, i);
-
-		/* and wrap text (this should move somewhere else) */
-		if (wrap_folder_entry(pt, &pt->folder_entries[i]) < 0) {
-			mark_error();
-			return -1;
-		}
+/**
+ * Draws the elbow box, which contains the little elbow connector that joins
+ * the selected folder with the content title. It follows the slot where the
+ * selected folder is displayed.
+ */
+static void draw_elbow_box(struct personal_terminal *pt)
+{
+	int i, end = (pt->selected - pt->folder_top) * H_FOLDER_BOX + 1;
+	werase(pt->elbow_box);
+	wattron(pt->elbow_box, A_BOLD);
+	mvwaddch(pt->elbow_box, 1, 2, ACS_HLINE);
+	mvwaddch(pt->elbow_box, 1, 1, ACS_ULCORNER);
+	mvwaddch(pt->elbow_box, 2, 1, ACS_VLINE);
+	for (i = 0; i < end; i++) {
+		mvwaddch(pt->elbow_box, 3 + i, 1, ACS_VLINE);
 	}
-	draw_elbow_box(pt);
-	draw_content_title(pt);
-	draw_content_text(pt);
+	mvwaddch(pt->elbow_box, 3 + end, 1, ACS_LRCORNER);
+	mvwaddch(pt->elbow_box, 3 + end, 0, ACS_HLINE);
+	wattroff(pt->elbow_box, A_BOLD);
+	wnoutrefresh(pt->elbow_box);
+}
 
-	doupdate();
-	return 0;
+/**
+ * Draws the content title. Not much special here.
+ */
+static void draw_content_title(struct personal_terminal *pt)
+{
+	werase(pt->content_title);
+	box(pt->content_title, 0, 0);
+	mvwaddch(pt->content_title, 1, 0, ACS_RTEE);
+	mvwaddstr(pt->content_title, 1, 1,
+	          pt->folder_entries[pt->selected].title);
+	wnoutrefresh(pt->content_title);
 }
 
 /**
- * Handle key presses from the personal terminal.
+ * Draws the outline of a folder box slot. This function will insert a connector
+ * for the elbow at the appropriate location. It will also select the
+ * appropriate attributes for printing. The text is left alone, since it only
+ * changes when the column scrolls.
  */
-static void personal_terminal_loop(struct personal_terminal *pt)
+static void draw_folder_box_outline(struct personal_terminal *pt, int slot)
 {
-	int key;
-	while ((key = getch()) != 'q') {
-		switch (key) {
-		case KEY_UP:
-			select_folder(pt, pt->selected - 1);
-			break;
-		case KEY_DOWN:
-			select_folder(pt, pt->selected + 1);
-			break;
-		case KEY_LEFT:
-			scroll_up(pt);
-			break;
-		case KEY_RIGHT:
-			scroll_down(pt);
-			break;
-		}
-		doupdate();
+	bool selected = pt->folder_top + slot == (int)pt->selected;
+	int attr = (selected ? A_BOLD : A_DIM);
+	wattron(pt->folder_box[slot], attr);
+	box(pt->folder_box[slot], 0, 0);
+	if (selected) {
+		mvwaddch(pt->folder_box[slot], 1, W_FOLDER_BOX - 1, ACS_LTEE);
 	}
+	wattroff(pt->folder_box[slot], attr);
+	wnoutrefresh(pt->folder_box[slot]);
 }
 
-#define CONTENT_BUFFER 512
+/**
+ * Draws a folder box slot completely, text and all.
+ */
+static void draw_folder_box(struct personal_terminal *pt, int slot)
+{
+	werase(pt->folder_box[slot]);
+	mvwaddnstr(pt->folder_box[slot], 1, 1,
+	           pt->folder_entries[pt->folder_top + slot].folder,
+	           W_FOLDER_BOX - 2);
+	draw_folder_box_outline(pt, slot);
+}
 
 /**
- * Load a personal_terminal file.
+ * Draws the "FOLDERS" heading, along with the position in the list when it
+ * doesn't all fit.
  */
-static int pt_load_file(struct pt_params *params, struct personal_terminal *pt,
-                        int i)
+static void draw_folders_heading(struct personal_terminal *pt)
 {
-	size_t bufsize = CONTENT_BUFFER;
-	size_t contents = 0;
-	FILE *f = params->entries[i].content;
-	char *buf = malloc(bufsize), *newbuf;
+	/* "FOLDERS %u/%d", with the NUL */
+	char heading[sizeof("FOLDERS /") + 2 * INT_CHARS];
+	if (pt->folder_slots < pt->folder_count)
+		snprintf(heading, sizeof(heading), "FOLDERS %u/%d",
+		         pt->selected + 1, pt->folder_count);
+	else
+		snprintf(heading, sizeof(heading), "FOLDERS");
+	/* pad rather than clear to the end of line, the elbow is over there */
+	mvprintw(Y_FOLDERS, X_FOLDERS, "%-*.*s", W_FOLDER_BOX - X_FOLDERS - 1,
+	         W_FOLDER_BOX - X_FOLDERS - 1, heading);
+	wnoutrefresh(stdscr);
+}
 
-	if (!buf) {
-		set_error(EMEM);
+/**
+ * Select a new folder, index i. If the folder is out of range, don't bother.
+ * This will load the folder content if necessary, and scroll the folder column
+ * so that it is visible. Nothing is drawn, see draw_view().
+ */
+static int select_folder(struct personal_terminal *pt, int i)
+{
+	if (i < 0 || i >= pt->folder_count)
+		return 0;
+
+	if (cache_load(pt, i) < 0) {
+		mark_error();
 		return -1;
 	}
 
-	while (contents != bufsize) {
-		contents += fread(buf + contents, 1, bufsize - contents, f);
-		if (ferror(f)) {
-			set_error(EMEM);
-			free(buf);
-			return -1;
-		}
-		if (contents == bufsize) {
-			bufsize *= 2;
-			newbuf = realloc(buf, bufsize);
-			if (!newbuf) {
-				free(buf);
-				set_error(EMEM);
-				return -1;
-			}
-			buf = newbuf;
-		}
-		if (feof(f))
-			break;
+	pt->selected = (unsigned int) i;
+	/* the pattern is kept, so n searches the new entry from the top */
+	if (pt->search.state != SEARCH_TYPING)
+		pt->search.state = SEARCH_IDLE;
+	pt->search.found = false;
+	pt->search.failed = false;
+	/* an index resynced for an earlier width may not reach the top yet */
+	if (wrap_selected_top(pt) < 0) {
+		mark_error();
+		return -1;
+	}
+	pt->scroll = pt->folder_entries[i].content->first_line;
+	if (wrap_selected(pt, pt->scroll + content_height(pt)) < 0) {
+		mark_error();
+		return -1;
 	}
 
-	/* yeah this is kinda important */
-	buf[contents] = '\0';
-	pt->folder_entries[i].text = buf;
+	/* keep the selection on screen, scrolling the column if necessary */
+	if (i < pt->folder_top)
+		pt->folder_top = i;
+	else if (i >= pt->folder_top + pt->folder_slots)
+		pt->folder_top = i - pt->folder_slots + 1;
 	return 0;
 }
 
 /**
- * Load personal_terminal contents from config.
+ * Scroll so that line is at the top of the content box, or as near as the
+ * content allows. This is a matter of moving the viewport on the line index,
+ * which is only wrapped as far as will be shown. INT_MIN scrolls to the top,
+ * and INT_MAX to the bottom, which are jumped to rather than wrapped all the
+ * way to. Nothing is drawn, see draw_view().
  */
-int pt_load(struct pt_params *params, struct personal_terminal *pt)
+static int scroll_to(struct personal_terminal *pt, int line)
 {
-	int i;
-	pt->folder_count = params->num_entries;
-	for (i = 0; i < params->num_entries; i++) {
-		pt->folder_entries[i].folder = params->entries[i].folder;
-		pt->folder_entries[i].title = params->entries[i].title;
-		if (pt_load_file(params, pt, i) < 0) {
+	struct content *content;
+	int height = content_height(pt), bottom;
+
+	if ((line == INT_MIN && wrap_selected_top(pt) < 0) ||
+	    (line == INT_MAX && wrap_selected_end(pt) < 0)) {
+		mark_error();
+		return -1;
+	}
+	content = pt->folder_entries[pt->selected].content;
+
+	if (line < content->first_line) {
+		if (wrap_selected_back(pt, line) < 0) {
 			mark_error();
-			goto err_cleanup;
+			return -1;
 		}
+		if (line < content->first_line)
+			line = content->first_line;
 	}
-	return 0;
-
-err_cleanup:
-	while (--i >= 0) {
-		free(pt->folder_entries[i].text);
+	if (wrap_selected(pt, line > INT_MAX - height ? INT_MAX
+	                                              : line + height) < 0) {
+		mark_error();
+		return -1;
 	}
-	return -1;
+	/* the content may have ended before filling the box */
+	bottom = content->lines - height;
+	if (line > bottom) {
+		if (bottom < content->first_line &&
+		    wrap_selected_back(pt, bottom) < 0) {
+			mark_error();
+			return -1;
+		}
+		line = bottom > content->first_line ? bottom
+		                                    : content->first_line;
+	}
+	pt->scroll = line;
+	return 0;
 }
 
 /**
- * Run the whole personal terminal, start to finish. Right now this uses some
- * pre-coded folder entries. Later, I'm assuming that I will have some sort of
- * configuration so it doesn't have to be hand made.
+ * Scroll to line number line (counting from 1, at the top of the text), which
+ * means the index has to reach back to the top first.
  */
-int personal_terminal(struct pt_params *params)
+static int go_to_line(struct personal_terminal *pt, int line)
 {
-	int i;
-	int rv = -1;
-	struct personal_terminal pt;
+	struct content *content;
 
-	if (pt_load(params, &pt) < 0) {
+	if (wrap_selected_top(pt) < 0) {
 		mark_error();
-		return rv;
-	}
-
-	if (init_personal_terminal(&pt) < 0) {
-		mark_error();
-		goto exit;
+		return -1;
 	}
+	content = pt->folder_entries[pt->selected].content;
+	return scroll_to(pt, content->first_line + line - 1);
+}
 
-	personal_terminal_loop(&pt);
-	rv = 0;
+/**
+ * Draw the selection and scroll position, which were last drawn as *drawn. They
+ * may have been changed any number of times since, but only the differences
+ * between the two views are drawn.
+ */
+static void draw_view(struct personal_terminal *pt,
+                      const struct view *drawn)
+{
+	int slot;
 
-exit:
-	/* change me when dynamic folder entries are allowed */
-	i = pt.folder_count;
-	while (i-- > 0) {
-		free(pt.folder_entries[i].text);
+	if (pt->selected == drawn->selected) {
+		/* moving away and back may have scrolled the column */
+		if (pt->folder_top != drawn->folder_top) {
+			for (slot = 0; slot < pt->folder_slots; slot++)
+				draw_folder_box(pt, slot);
+			draw_elbow_box(pt);
+		}
+		/* lines are only comparable while they keep their numbers */
+		if (pt->search.found != drawn->found ||
+		    (pt->search.found && pt->search.match != drawn->match) ||
+		    pt->restarts != drawn->restarts)
+			draw_content_text(pt);
+		else if (pt->scroll != drawn->scroll)
+			scroll_content_text(pt, pt->scroll -
+			                        drawn->scroll);
+		return;
 	}
 
-	return rv;
+	draw_content_text(pt);
+	draw_content_title(pt);
+	draw_folders_heading(pt);
+	if (pt->folder_top == drawn->folder_top) {
+		draw_folder_box_outline(pt, drawn->selected - pt->folder_top);
+		draw_folder_box_outline(pt, pt->selected - pt->folder_top);
+	} else {
+		for (slot = 0; slot < pt->folder_slots; slot++)
+			draw_folder_box(pt, slot);
+	}
+	draw_elbow_box(pt);
+}
+
+/**
+ * Remember the view as drawn, for draw_view().
+ */
+static void save_view(struct personal_terminal *pt, struct view *view)
+{
+	view->selected = pt->selected;
+	view->scroll = pt->scroll;
+	view->restarts = pt->restarts;
+	view->folder_top = pt->folder_top;
+	view->found = pt->search.found;
+	view->match = pt->search.match;
+}
+
+/**
+ * Start looking for the next match of the search pattern (or the previous one,
+ * when backward). The first search in an entry starts at the top of the view.
+ * The search is done by search_step().
+ */
+static void search_start(struct personal_terminal *pt, bool backward)
+{
+	struct search *search = &pt->search;
+	struct content *content = pt->folder_entries[pt->selected].content;
+
+	if (search->len == 0)
+		return;
+	if (search->found)
+		search->pos = backward ? search->match : search->match + 1;
+	else if (pt->scroll < content->lines)
+		search->pos = content->line_offsets[pt->scroll];
+	else
+		search->pos = backward ? content->size : 0;
+	search->backward = backward;
+	search->failed = false;
+	search->state = SEARCH_SCANNING;
+}
+
+/**
+ * Scan one slice of the selected entry for the search pattern. A match may
+ * straddle the end of the slice, so the slices overlap by the pattern length.
+ */
+static void search_scan(struct personal_terminal *pt)
+{
+	struct search *search = &pt->search;
+	struct content *content = pt->folder_entries[pt->selected].content;
+	size_t len = search->len, lo, hi;
+	const char *match;
+
+	/* the matches starting in [lo, hi) are looked for */
+	if (search->backward) {
+		hi = search->pos;
+		lo = hi > SEARCH_SLICE ? hi - SEARCH_SLICE : 0;
+		if (hi > content->size)
+			hi = content->size;
+		match = search_find_last(content->text + lo,
+		                         hi + len - 1 < content->size ?
+		                         hi + len - 1 - lo : content->size - lo,
+		                         search->pattern, len);
+		search->pos = lo;
+	} else {
+		lo = search->pos;
+		if (lo > content->size)
+			lo = content->size;
+		hi = content->size - lo > SEARCH_SLICE ? lo + SEARCH_SLICE
+		                                       : content->size;
+		match = search_find(content->text + lo,
+		                    hi + len - 1 < content->size ?
+		                    hi + len - 1 - lo : content->size - lo,
+		                    search->pattern, len);
+		search->pos = hi;
+	}
+
+	if (match) {
+		search->match = match - content->text;
+		search->found = true;
+		search->state = SEARCH_WRAPPING;
+	} else if (search->backward ? lo == 0 : hi == content->size) {
+		search->failed = true;
+		search->state = SEARCH_IDLE;
+	}
+}
+
+/**
+ * Do one step of the search: scan a slice, or wrap some more of the text up to
+ * the match. Once it's wrapped, the view jumps to the match (unless it's
+ * already on screen). Nothing is drawn, see draw_view().
+ */
+static int search_step(struct personal_terminal *pt)
+{
+	struct search *search = &pt->search;
+	struct content *content = pt->folder_entries[pt->selected].content;
+	int line;
+
+	if (search->state == SEARCH_SCANNING) {
+		search_scan(pt);
+		return 0;
+	}
+
+	if (search->match < content->line_offsets[content->first_line]) {
+		if (wrap_selected_back(pt, content->first_line - WRAP_SLICE) < 0) {
+			mark_error();
+			return -1;
+		}
+		return 0;
+	}
+	if (content->wrap_pos <= search->match &&
+	    content->wrap_pos < content->size) {
+		if (wrap_selected(pt, content->lines + WRAP_SLICE) < 0) {
+			mark_error();
+			return -1;
+		}
+		return 0;
+	}
+	search->state = SEARCH_IDLE;
+	line = content_find_line(content, search->match);
+	if (line < pt->scroll ||
+	    line >= pt->scroll + content_height(pt))
+		return scroll_to(pt, line);
+	return 0;
+}
+
+/**
+ * Return true while a search is still going.
+ */
+static bool searching(struct personal_terminal *pt)
+{
+	return pt->search.state == SEARCH_SCANNING ||
+	       pt->search.state == SEARCH_WRAPPING;
+}
+
+/**
+ * Pick up text appended to followed entry i. When the entry is on screen and
+ * the view was pinned to the bottom, keep it pinned there. Only the rows from
+ * the old last line (which may have grown) onward are redrawn.
+ */
+static int follow_entry(struct personal_terminal *pt, int i)
+{
+	struct folder_entry *entry = &pt->folder_entries[i];
+	int height = content_height(pt), old_scroll = pt->scroll, first;
+	int old_lines = entry->content->lines;
+	size_t old_size = entry->content->size;
+	bool pinned = content_wrapped(entry->content) &&
+	              pt->scroll + height >= old_lines;
+
+	if (content_update(entry->content) < 0) {
+		mark_error();
+		return -1;
+	}
+	cache_recharge(pt, i);
+	if (entry->content->size < old_size)
+		pinned = true; /* truncated, so the view is gone anyway */
+
+	if ((unsigned int)i != pt->selected || !pinned)
+		return 0;
+
+	/* only the appended lines remain to be wrapped */
+	if (wrap_selected(pt, INT_MAX) < 0) {
+		mark_error();
+		return -1;
+	}
+	if (entry->content->lines - height > entry->content->first_line)
+		pt->scroll = entry->content->lines - height;
+	else
+		pt->scroll = entry->content->first_line;
+	if (pt->too_small)
+		return 0;
+
+	if (entry->content->size < old_size) {
+		draw_content_text(pt); /* truncated */
+		return 0;
+	}
+	if (!scroll_content_text(pt, pt->scroll - old_scroll))
+		return 0; /* shifted too far, so it was all redrawn */
+	first = old_lines - 1 - pt->scroll;
+	if (first < 0)
+		first = 0;
+	if (first < height)
+		draw_content_rows(pt, first, height - first);
+	wnoutrefresh(pt->content_body);
+	return 0;
+}
+
+/**
+ * Read pending inotify events, and update the followed entries they refer to.
+ */
+static int follow_events(struct personal_terminal *pt)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+	char *ptr;
+	int i;
+
+	while ((len = read(pt->inotify_fd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)ptr;
+			/* only loaded entries are watched */
+			for (i = pt->lru_head; i >= 0;
+			     i = pt->folder_entries[i].lru_next) {
+				if (pt->folder_entries[i].watch == event->wd)
+					break;
+			}
+			if (i >= 0 && follow_entry(pt, i) < 0) {
+				mark_error();
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Create a window in *win, or if it already exists, resize and move it into
+ * place. On failure, *win is left as it was, so it may still be freed.
+ */
+static int place_window(WINDOW **win, int lines, int cols, int y, int x)
+{
+	WINDOW *placed;
+
+	if (!*win)
+		placed = newwin(lines, cols, y, x);
+	else if (wresize(*win, lines, cols) == ERR ||
+	         mvwin(*win, y, x) == ERR)
+		placed = NULL;
+	else
+		placed = *win;
+	if (!placed) {
+		set_error(EMEM);
+		return -1;
+	}
+	*win = placed;
+	return 0;
+}
+
+/**
+ * Change the number of folder box slots, creating or deleting windows at the
+ * bottom of the column, and scroll it so the selection is still visible.
+ */
+static int resize_folder_slots(struct personal_terminal *pt, int slots)
+{
+	WINDOW **boxes;
+	int i;
+
+	for (i = slots; i < pt->folder_slots; i++)
+		delwin(pt->folder_box[i]);
+
+	boxes = realloc(pt->folder_box, slots * sizeof(WINDOW *));
+	if (!boxes && slots > 0) {
+		set_error(EMEM);
+		return -1;
+	}
+	pt->folder_box = boxes;
+
+	for (i = pt->folder_slots; i < slots; i++)
+		pt->folder_box[i] = NULL;
+	pt->folder_slots = slots;
+
+	/* ncurses may have squashed existing windows when the screen shrank */
+	for (i = 0; i < slots; i++) {
+		if (place_window(&pt->folder_box[i], H_FOLDER_BOX,
+		                 W_FOLDER_BOX, Y_FOLDER_BOX + i * H_FOLDER_BOX,
+		                 X_FOLDER_BOX) < 0) {
+			mark_error();
+			return -1;
+		}
+	}
+
+	if (pt->folder_top + slots > pt->folder_count)
+		pt->folder_top = pt->folder_count - slots;
+	if ((int)pt->selected >= pt->folder_top + slots)
+		pt->folder_top = pt->selected - slots + 1;
+	return 0;
+}
+
+/**
+ * Throw away line indices wrapped for a different width than the content box
+ * has now. They are rebuilt lazily, so this is cheap. The top of the viewport
+ * stays anchored on the same text, and the selected entry's index is started at
+ * the last newline before it (see content_resync()), so only the paragraph the
+ * anchor is in is wrapped up to it, however far into the text that is. The
+ * lines before are wrapped back if the view scrolls up there.
+ */
+static int rewrap_entries(struct personal_terminal *pt)
+{
+	struct folder_entry *selected = &pt->folder_entries[pt->selected];
+	int width = content_width(pt), i;
+	bool anchored = selected->loaded && selected->content->width != width;
+	size_t anchor = 0;
+
+	if (anchored && pt->scroll < selected->content->lines)
+		anchor = selected->content->line_offsets[pt->scroll];
+
+	for (i = pt->lru_head; i >= 0; i = pt->folder_entries[i].lru_next) {
+		if (pt->folder_entries[i].content->width == width)
+			continue;
+		if (wrap_folder_entry(pt, &pt->folder_entries[i]) < 0) {
+			mark_error();
+			return -1;
+		}
+	}
+	if (!anchored)
+		return 0;
+
+	content_resync(selected->content, anchor);
+	if (content_wrap_offset(selected->content, anchor) < 0) {
+		mark_error();
+		return -1;
+	}
+	pt->scroll = content_find_line(selected->content, anchor);
+	return 0;
+}
+
+/**
+ * Draw the key help at the bottom of the screen, along with the output
+ * accounting overlay (see stats.c) when it's turned on.
+ */
+static void draw_status_bar(struct personal_terminal *pt)
+{
+	const char *overlay = stats_overlay();
+	struct search *search = &pt->search;
+	struct content *content = pt->folder_entries[pt->selected].content;
+	size_t pos;
+	int x;
+
+	move(pt->maxy - 1, 0);
+	clrtoeol();
+	attron(A_DIM);
+	if (pt->goto_line) {
+		printw("GO TO LINE: %d (g: go)", pt->goto_line);
+	} else if (search->state == SEARCH_TYPING) {
+		printw("/%s", search->pattern);
+	} else if (searching(pt)) {
+		pos = search->state == SEARCH_SCANNING ? search->pos
+		                                       : content->wrap_pos;
+		printw("SEARCHING: %d%%", content->size ?
+		       (int)(100.0 * pos / content->size) : 100);
+	} else if (search->failed) {
+		printw("NOT FOUND: %s", search->pattern);
+	} else if (search->found) {
+		printw("FOUND: %s (n: next, N: previous)", search->pattern);
+	} else {
+		addstr("UP/DOWN: folder | LEFT/RIGHT: scroll | /, F: search | "
+		       "q: exit");
+	}
+	if (overlay) {
+		x = pt->maxx - strlen(overlay) - 1;
+		mvaddstr(pt->maxy - 1, x < 0 ? 0 : x, overlay);
+	}
+	attroff(A_DIM);
+	wnoutrefresh(stdscr);
+}
+
+/**
+ * Draw the stuff which has no windows: it only changes with the layout.
+ */
+static void draw_static(struct personal_terminal *pt)
+{
+	move(Y_PERSONAL_TERMINAL, X_PERSONAL_TERMINAL);
+	attron(A_REVERSE);
+	addstr("PERSONAL TERMINAL");
+	attroff(A_REVERSE);
+	chgat(-1, A_REVERSE, 0, NULL);
+
+	draw_status_bar(pt);
+	draw_folders_heading(pt);
+}
+
+/**
+ * Fit the personal terminal to the size of the screen, and draw all of it. On
+ * the first call, this creates the windows. Afterward, (e.g. for a resize) the
+ * windows are resized in place, and only entries wrapped to some other width
+ * than the content box has now are rewrapped. When the terminal is too small, a
+ * message is drawn instead, until it grows again. The screen isn't cleared, see
+ * layout_personal_terminal().
+ */
+static int place_personal_terminal(struct personal_terminal *pt)
+{
+	int slots, i;
+
+	getmaxyx(stdscr, pt->maxy, pt->maxx);
+
+	pt->too_small = pt->maxy < MIN_HEIGHT || pt->maxx < MIN_WIDTH;
+	if (pt->too_small) {
+		mvaddstr(0, 0, "TERMINAL TOO SMALL");
+		wnoutrefresh(stdscr);
+		return 0;
+	}
+
+	slots = (pt->maxy - Y_FOLDER_BOX - 1) / H_FOLDER_BOX;
+	if (slots > pt->folder_count)
+		slots = pt->folder_count;
+	if (resize_folder_slots(pt, slots) < 0) {
+		mark_error();
+		return -1;
+	}
+
+	if (place_window(&pt->elbow_box, H_ELBOW_WINDOW(pt->folder_slots),
+	                 W_ELBOW_WINDOW, Y_ELBOW_WINDOW, X_ELBOW_WINDOW) < 0 ||
+	    place_window(&pt->content_title, H_CONTENT_TITLE,
+	                 pt->maxx - X_CONTENT_TITLE, Y_CONTENT_TITLE,
+	                 X_CONTENT_TITLE) < 0 ||
+	    place_window(&pt->content_text,
+	                 pt->maxy - Y_CONTENT_TEXT - 1, /* status bar */
+	                 pt->maxx - X_CONTENT_TEXT, Y_CONTENT_TEXT,
+	                 X_CONTENT_TEXT) < 0) {
+		mark_error();
+		return -1;
+	}
+
+	/* a subwindow has no buffer of its own, so just make a new one */
+	if (pt->content_body)
+		delwin(pt->content_body);
+	pt->content_body = derwin(pt->content_text,
+	                          pt->maxy - Y_CONTENT_TEXT - 1 - 2,
+	                          pt->maxx - X_CONTENT_TEXT - 2, 1, 1);
+	if (!pt->content_body) {
+		set_error(EMEM);
+		return -1;
+	}
+	idlok(pt->content_body, TRUE);
+
+	if (rewrap_entries(pt) < 0) {
+		mark_error();
+		return -1;
+	}
+	if (wrap_selected(pt, pt->scroll + content_height(pt)) < 0) {
+		mark_error();
+		return -1;
+	}
+
+	draw_static(pt);
+	for (i = 0; i < pt->folder_slots; i++)
+		draw_folder_box(pt, i);
+	draw_elbow_box(pt);
+	draw_content_title(pt);
+	draw_content_frame(pt);
+	draw_content_text(pt);
+	return 0;
+}
+
+/**
+ * Lay out and draw the personal terminal on a cleared screen, so the terminal
+ * is repainted completely.
+ */
+static int layout_personal_terminal(struct personal_terminal *pt)
+{
+	clear();
+	return place_personal_terminal(pt);
+}
+
+/**
+ * Initialize the curses resources and do a first draw of the personal terminal.
+ */
+static int init_personal_terminal(struct personal_terminal *pt)
+{
+	pt->selected = 0;
+	pt->scroll = 0;
+	pt->restarts = 0;
+	pt->folder_top = 0;
+	pt->maxy = pt->maxx = 0;
+	pt->goto_line = 0;
+	memset(&pt->search, 0, sizeof(pt->search)); /* SEARCH_IDLE */
+	memset(&pt->finder, 0, sizeof(pt->finder));
+	pt->elbow_box = pt->content_title = pt->content_text = NULL;
+	pt->content_body = NULL;
+
+	/* input is waited for with epoll, see server.c */
+	nodelay(stdscr, TRUE);
+
+	getmaxyx(stdscr, pt->maxy, pt->maxx);
+	/* only the selected entry needs to be loaded to begin with */
+	if (cache_load(pt, pt->selected) < 0) {
+		mark_error();
+		return -1;
+	}
+	if (layout_personal_terminal(pt) < 0) {
+		mark_error();
+		return -1;
+	}
+
+	stats_doupdate();
+	return 0;
+}
+
+/**
+ * Run the global search query again, keeping the selected hit in range.
+ */
+static void finder_query(struct personal_terminal *pt)
+{
+	struct finder *finder = &pt->finder;
+
+	finder->total_hits = index_query(pt->index, finder->query,
+	                                 finder->hits, FIND_MAX_HITS);
+	finder->num_hits = finder->total_hits < FIND_MAX_HITS ?
+	                   finder->total_hits : FIND_MAX_HITS;
+	if (finder->selected >= finder->num_hits)
+		finder->selected = finder->num_hits - 1;
+	if (finder->selected < 0)
+		finder->selected = 0;
+}
+
+/**
+ * Draw the whole global search screen.
+ */
+static void draw_finder(struct personal_terminal *pt)
+{
+	struct finder *finder = &pt->finder;
+	WINDOW *win = finder->win;
+	int rows = pt->maxy - Y_FIND_HITS - 2, row, i, x;
+	/* the longest text on the right: "INDEXING %d/%d" or "FIRST %d OF %d" */
+	char count[sizeof("FIRST  OF ") + 2 * INT_CHARS];
+	struct folder_entry *entry;
+
+	/* keep the selected hit in view */
+	if (finder->selected < finder->top)
+		finder->top = finder->selected;
+	else if (finder->selected >= finder->top + rows)
+		finder->top = finder->selected - rows + 1;
+
+	werase(win);
+	wattron(win, A_REVERSE);
+	mvwaddstr(win, 0, 0, "GLOBAL SEARCH");
+	wattroff(win, A_REVERSE);
+	mvwchgat(win, 0, 0, -1, A_REVERSE, 0, NULL);
+
+	mvwprintw(win, 2, 1, "FIND: %s", finder->query);
+	if (finder->indexed < pt->folder_count)
+		snprintf(count, sizeof(count), "INDEXING %d/%d",
+		         finder->indexed, pt->folder_count);
+	else if (finder->total_hits > finder->num_hits)
+		snprintf(count, sizeof(count), "FIRST %d OF %d",
+		         finder->num_hits, finder->total_hits);
+	else
+		snprintf(count, sizeof(count), "%d FOUND", finder->total_hits);
+	x = pt->maxx - strlen(count) - 1;
+	mvwaddstr(win, 2, x < 0 ? 0 : x, count);
+
+	for (row = 0; row < rows; row++) {
+		i = finder->top + row;
+		if (i >= finder->num_hits)
+			break;
+		entry = &pt->folder_entries[finder->hits[i].entry];
+		if (i == finder->selected)
+			wattron(win, A_BOLD);
+		mvwprintw(win, Y_FIND_HITS + row, 1, "%c %-*.*s %.*s",
+		          i == finder->selected ? '>' : ' ',
+		          W_FOLDER_BOX, W_FOLDER_BOX, entry->folder,
+		          pt->maxx - W_FOLDER_BOX - 14 > 0 ?
+		          pt->maxx - W_FOLDER_BOX - 14 : 0, entry->title);
+		snprintf(count, sizeof(count), "%u", finder->hits[i].count);
+		mvwaddstr(win, Y_FIND_HITS + row, pt->maxx - strlen(count) - 1,
+		          count);
+		wattroff(win, A_BOLD);
+	}
+
+	wattron(win, A_DIM);
+	mvwaddstr(win, pt->maxy - 1, 0,
+	          "UP/DOWN: select | ENTER: go to entry | ESC: close");
+	wattroff(win, A_DIM);
+	wnoutrefresh(win);
+}
+
+/**
+ * Open the global search screen, with the last query.
+ */
+static int open_finder(struct personal_terminal *pt)
+{
+	struct finder *finder = &pt->finder;
+
+	finder->win = NULL;
+	if (place_window(&finder->win, pt->maxy, pt->maxx, 0, 0) < 0) {
+		mark_error();
+		return -1;
+	}
+	finder->indexed = index_progress(pt->index);
+	finder_query(pt);
+	draw_finder(pt);
+	return 0;
+}
+
+/**
+ * Close the global search screen, and draw the personal terminal again.
+ */
+static int close_finder(struct personal_terminal *pt, struct view *drawn)
+{
+	delwin(pt->finder.win);
+	pt->finder.win = NULL;
+	if (layout_personal_terminal(pt) < 0) {
+		mark_error();
+		return -1;
+	}
+	save_view(pt, drawn);
+	return 0;
+}
+
+/**
+ * Go to the selected hit: select its entry, and show the first occurrence of
+ * the word found, as if the in-entry search had found it. So, n continues
+ * from there.
+ */
+static int finder_go(struct personal_terminal *pt, struct view *drawn)
+{
+	struct finder *finder = &pt->finder;
+	struct search *search = &pt->search;
+	struct index_hit *hit = &finder->hits[finder->selected];
+	struct content *content;
+	int len = 0;
+
+	if (select_folder(pt, hit->entry) < 0) {
+		mark_error();
+		return -1;
+	}
+	content = pt->folder_entries[pt->selected].content;
+	/* the index may be stale, in which case there's just no highlight */
+	while (hit->offset + len < content->size && len < SEARCH_MAX &&
+	       (isalnum((unsigned char)content->text[hit->offset + len]) ||
+	        content->text[hit->offset + len] == '_'))
+		len++;
+	if (len > 0) {
+		memcpy(search->pattern, content->text + hit->offset, len);
+		search->pattern[len] = '\0';
+		search->len = len;
+		search->match = hit->offset;
+		search->found = true;
+		search->state = SEARCH_WRAPPING;
+	}
+	return close_finder(pt, drawn);
+}
+
+/**
+ * Handle a key press on the global search screen. Typing edits the query, and
+ * the hits are listed as it changes.
+ */
+static int finder_key(struct personal_terminal *pt, int key,
+                      struct view *drawn)
+{
+	struct finder *finder = &pt->finder;
+	int page = pt->maxy - Y_FIND_HITS - 2;
+
+	switch (key) {
+	case 27:
+		return close_finder(pt, drawn);
+	case '\n':
+	case KEY_ENTER:
+		if (finder->num_hits > 0)
+			return finder_go(pt, drawn);
+		return 0;
+	case KEY_UP:
+		finder->selected--;
+		break;
+	case KEY_DOWN:
+		finder->selected++;
+		break;
+	case KEY_PPAGE:
+		finder->selected -= page;
+		break;
+	case KEY_NPAGE:
+		finder->selected += page;
+		break;
+	case KEY_BACKSPACE:
+	case 127:
+	case '\b':
+		if (finder->len > 0)
+			finder->query[--finder->len] = '\0';
+		finder_query(pt);
+		break;
+	default:
+		if (key >= ' ' && key <= '~' && finder->len < SEARCH_MAX) {
+			finder->query[finder->len++] = key;
+			finder->query[finder->len] = '\0';
+			finder_query(pt);
+		}
+	}
+	if (finder->selected >= finder->num_hits)
+		finder->selected = finder->num_hits - 1;
+	if (finder->selected < 0)
+		finder->selected = 0;
+	draw_finder(pt);
+	return 0;
+}
+
+/**
+ * Handle a key press while the search pattern is being typed. Enter starts the
+ * search, and escape (or erasing the whole pattern) cancels it.
+ */
+static void search_key(struct personal_terminal *pt, int key)
+{
+	struct search *search = &pt->search;
+
+	if (key == '\n' || key == KEY_ENTER) {
+		search->state = SEARCH_IDLE;
+		search_start(pt, false);
+	} else if (key == KEY_BACKSPACE || key == 127 || key == '\b') {
+		if (search->len == 0)
+			search->state = SEARCH_IDLE;
+		else
+			search->pattern[--search->len] = '\0';
+	} else if (key == 27) {
+		search->state = SEARCH_IDLE;
+	} else if (key >= ' ' && key <= '~' && search->len < SEARCH_MAX) {
+		search->pattern[search->len++] = key;
+		search->pattern[search->len] = '\0';
+	}
+	draw_status_bar(pt);
+}
+
+/**
+ * Handle a key press by changing the state of the personal terminal. The
+ * content isn't drawn yet, since more keys may be waiting, see draw_view().
+ * However, a resize lays out and draws everything right away, so drawn is
+ * updated. Returns 1 to quit, 0 to carry on, or -1 on error.
+ */
+static int handle_key(struct personal_terminal *pt, int key,
+                      struct view *drawn)
+{
+	int height = content_height(pt), line = pt->goto_line;
+
+	if (key == KEY_RESIZE) {
+		if (layout_personal_terminal(pt) < 0) {
+			mark_error();
+			return -1;
+		}
+		save_view(pt, drawn);
+		if (!pt->finder.win)
+			return 0;
+		if (pt->too_small) {
+			delwin(pt->finder.win);
+			pt->finder.win = NULL;
+			return 0;
+		}
+		if (place_window(&pt->finder.win, pt->maxy, pt->maxx, 0,
+		                 0) < 0) {
+			mark_error();
+			return -1;
+		}
+		draw_finder(pt);
+		return 0;
+	}
+	if (pt->too_small)
+		return key == 'q';
+
+	if (pt->finder.win)
+		return finder_key(pt, key, drawn);
+	if (pt->search.state == SEARCH_TYPING) {
+		search_key(pt, key);
+		return 0;
+	}
+	if (key == 'q')
+		return 1;
+	/* a key press cuts a search short */
+	if (searching(pt)) {
+		pt->search.state = SEARCH_IDLE;
+		draw_status_bar(pt);
+	}
+
+	/* a line number is typed, and then 'g' (or enter) goes to it */
+	if (key >= '0' && key <= '9') {
+		if (line <= (INT_MAX - 9) / 10)
+			pt->goto_line = line * 10 + key - '0';
+		draw_status_bar(pt);
+		return 0;
+	}
+	if (line) {
+		pt->goto_line = 0;
+		draw_status_bar(pt);
+	}
+
+	switch (key) {
+	case KEY_UP:
+		return select_folder(pt, pt->selected - 1);
+	case KEY_DOWN:
+		return select_folder(pt, pt->selected + 1);
+	case KEY_LEFT:
+		return scroll_to(pt, pt->scroll - 1);
+	case KEY_RIGHT:
+		return scroll_to(pt, pt->scroll + 1);
+	case KEY_PPAGE:
+		return scroll_to(pt, pt->scroll - height);
+	case KEY_NPAGE:
+		return scroll_to(pt, pt->scroll + height);
+	case KEY_HOME:
+		return scroll_to(pt, INT_MIN);
+	case KEY_END:
+		return scroll_to(pt, INT_MAX);
+	case 'g':
+	case '\n':
+	case KEY_ENTER:
+		return line ? go_to_line(pt, line) : 0;
+	case '/':
+		pt->search.state = SEARCH_TYPING;
+		pt->search.len = 0;
+		pt->search.pattern[0] = '\0';
+		pt->search.found = false;
+		pt->search.failed = false;
+		draw_status_bar(pt);
+		break;
+	case 'n':
+	case 'N':
+		search_start(pt, key == 'N');
+		break;
+	case 'F':
+		return open_finder(pt);
+	case 'i':
+		stats_toggle_overlay();
+		draw_status_bar(pt);
+		break;
+	}
+	return 0;
+}
+
+/**
+ * Handle key presses from the personal terminal. With key repeat, keys arrive
+ * faster than the screen can be updated for each one. So, all the keys that
+ * are waiting are handled first, and then the screen is updated once. Returns 1
+ * to quit, 0 to carry on, or -1 on error.
+ */
+static int handle_input(struct personal_terminal *pt)
+{
+	struct view drawn;
+	int key, rv;
+
+	/* getch() doesn't block, see init_personal_terminal() */
+	key = getch();
+	if (key == ERR)
+		return 0;
+	TRACE_BEGIN(span, "input");
+	stats_begin_event();
+	save_view(pt, &drawn);
+	do {
+		rv = handle_key(pt, key, &drawn);
+	} while (rv == 0 && (key = getch()) != ERR);
+	if (rv != 0)
+		goto exit; /* quitting, or failed */
+
+	if (!pt->too_small && !pt->finder.win) {
+		draw_view(pt, &drawn);
+		if (stats_overlay())
+			draw_status_bar(pt);
+	}
+	stats_doupdate();
+exit:
+	stats_end_event();
+	TRACE_END(span);
+	return rv;
+}
+
+/*
+ * When the configuration or content files change, the reloader (see reload.c)
+ * hands over the new configuration. The new folder entries are matched up with
+ * the old ones by content file, and entries whose file didn't change keep their
+ * content and line index, and their place in the cache. The rest are loaded
+ * when they're next selected, like any other. The selected entry stays
+ * selected, at the same scroll position, unless it's gone.
+ */
+
+/**
+ * Return the first old entry which isn't matched up yet, with the same content
+ * file as the new entry, or -1. When exact, the folder and title must match
+ * too.
+ */
+static int match_entry(struct personal_terminal *pt, const int *moved,
+                       const struct pt_entry *entry, bool exact)
+{
+	struct folder_entry *old;
+	int i;
+
+	for (i = 0; i < pt->folder_count; i++) {
+		old = &pt->folder_entries[i];
+		if (moved[i] < 0 && old->follow == entry->follow &&
+		    strcmp(old->source->content_file, entry->content_file) == 0 &&
+		    (!exact || (strcmp(old->folder, entry->folder) == 0 &&
+		                strcmp(old->title, entry->title) == 0)))
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * Switch over to a reloaded configuration, with changed[] telling which
+ * entries' content files changed, and the index started for it. The params must
+ * outlive the personal terminal, or the next reload. Only the parts of the
+ * screen which changed are drawn, for the caller to output with
+ * stats_doupdate().
+ */
+int pt_reload(struct personal_terminal *pt, struct pt_params *params,
+              const bool *changed, struct index *index)
+{
+	struct folder_entry *entries, *old = pt->folder_entries;
+	int n = params->num_entries, *moved, *lru, num_lru = 0, i, j, pass;
+	int scroll = pt->scroll;
+	bool follow = false, kept, *matched;
+
+	entries = calloc(n, sizeof(struct folder_entry));
+	matched = malloc(n * sizeof(bool));
+	moved = malloc(pt->folder_count * sizeof(int));
+	lru = malloc(pt->folder_count * sizeof(int));
+	if (!entries || !matched || !moved || !lru) {
+		set_error(EMEM);
+		free(entries);
+		free(matched);
+		free(moved);
+		free(lru);
+		return -1;
+	}
+
+	for (i = 0; i < pt->folder_count; i++)
+		moved[i] = -1;
+	for (j = 0; j < n; j++) {
+		entries[j].folder = params->entries[j].folder;
+		entries[j].title = params->entries[j].title;
+		entries[j].source = &params->entries[j];
+		entries[j].follow = params->entries[j].follow;
+		entries[j].watch = -1;
+		entries[j].slot = -1;
+		matched[j] = false;
+		if (entries[j].follow)
+			follow = true;
+	}
+	/* entries which are just the same first, then any with the same file */
+	for (pass = 0; pass < 2; pass++) {
+		for (j = 0; j < n; j++) {
+			if (matched[j])
+				continue;
+			i = match_entry(pt, moved, &params->entries[j],
+			                pass == 0);
+			if (i < 0)
+				continue;
+			moved[i] = j;
+			matched[j] = true;
+			if (changed[j])
+				continue;
+			entries[j].slot = old[i].slot;
+			if (old[i].loaded && !entry_stale(&old[i])) {
+				entries[j].content = old[i].content;
+				entries[j].watch = old[i].watch;
+				entries[j].loaded = true;
+				old[i].loaded = false;
+			}
+		}
+	}
+
+	/* unload what wasn't kept, and note the order of what was */
+	for (i = pt->lru_head; i >= 0; i = old[i].lru_next) {
+		if (old[i].loaded)
+			unload_entry(pt, &old[i]);
+		else
+			lru[num_lru++] = moved[i];
+	}
+	kept = moved[pt->selected] >= 0 && entries[moved[pt->selected]].loaded;
+	if (moved[pt->selected] >= 0) {
+		pt->selected = moved[pt->selected];
+	} else {
+		pt->selected = pt->selected < (unsigned int)n ? pt->selected
+		                                              : (unsigned int)n - 1;
+		scroll = 0;
+	}
+	if (!kept) {
+		pt->search.state = SEARCH_IDLE;
+		pt->search.found = false;
+		pt->search.failed = false;
+	}
+
+	pt->folder_entries = entries;
+	pt->folder_count = n;
+	pt->dirfd = params->dirfd;
+	pt->cache_size = params->cache_size;
+	pt->lru_head = pt->lru_tail = -1;
+	pt->cache_used = 0;
+	while (num_lru > 0)
+		cache_push(pt, lru[--num_lru]);
+	free(old);
+	free(matched);
+	free(moved);
+	free(lru);
+
+	pt->index = index;
+	pt->finder.indexed = 0;
+
+	if (follow && pt->inotify_fd < 0) {
+		pt->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (pt->inotify_fd < 0) {
+			set_error(ESYS);
+			return -1;
+		}
+	}
+	if (cache_load(pt, pt->selected) < 0 || scroll_to(pt, scroll) < 0) {
+		mark_error();
+		return -1;
+	}
+
+	if ((int)pt->selected < pt->folder_top)
+		pt->folder_top = pt->selected;
+	erase();
+	if (place_personal_terminal(pt) < 0) {
+		mark_error();
+		return -1;
+	}
+	if (pt->finder.win) {
+		finder_query(pt);
+		draw_finder(pt);
+	}
+	return 0;
+}
+
+/**
+ * Handle the key presses waiting on the terminal. Returns 1 to quit, 0 to carry
+ * on, or -1 on error.
+ */
+int pt_input(struct personal_terminal *pt)
+{
+	int rv = handle_input(pt);
+	if (rv < 0)
+		mark_error();
+	return rv;
+}
+
+/**
+ * Return the file descriptor which becomes readable when followed entries
+ * change, or -1 when there are none. A reload may create it.
+ */
+int pt_follow_fd(struct personal_terminal *pt)
+{
+	return pt->inotify_fd;
+}
+
+/**
+ * Pick up the changes to followed entries, drawing them for the caller to
+ * output with stats_doupdate().
+ */
+int pt_follow(struct personal_terminal *pt)
+{
+	if (follow_events(pt) < 0) {
+		mark_error();
+		return -1;
+	}
+	/* the finder stays on top */
+	if (pt->finder.win)
+		draw_finder(pt);
+	return 0;
+}
+
+/**
+ * Note that more entries were indexed (see index_progress()), and show the new
+ * hits if the global search screen is open (for the caller to output with
+ * stats_doupdate()).
+ */
+void pt_indexed(struct personal_terminal *pt, int indexed)
+{
+	pt->finder.indexed = indexed;
+	if (pt->finder.win) {
+		finder_query(pt);
+		draw_finder(pt);
+	}
+}
+
+/**
+ * Return true while a search is going, and pt_search_step() should be called
+ * whenever there is nothing else to do.
+ */
+bool pt_searching(struct personal_terminal *pt)
+{
+	return searching(pt);
+}
+
+/**
+ * Do a step of the search, and draw where it got to, for the caller to output
+ * with stats_doupdate().
+ */
+int pt_search_step(struct personal_terminal *pt)
+{
+	struct view drawn;
+
+	save_view(pt, &drawn);
+	if (search_step(pt) < 0) {
+		mark_error();
+		return -1;
+	}
+	if (!pt->too_small) {
+		draw_view(pt, &drawn);
+		draw_status_bar(pt);
+	}
+	return 0;
+}
+
+/**
+ * Free the personal terminal, and whatever curses resources it has.
+ */
+static void free_personal_terminal(struct personal_terminal *pt)
+{
+	int i;
+
+	if (pt->finder.win)
+		delwin(pt->finder.win);
+	while (pt->lru_head >= 0) {
+		unload_entry(pt, &pt->folder_entries[pt->lru_head]);
+		pt->lru_head = pt->folder_entries[pt->lru_head].lru_next;
+	}
+	if (pt->inotify_fd >= 0)
+		close(pt->inotify_fd);
+	for (i = 0; i < pt->folder_slots; i++)
+		delwin(pt->folder_box[i]);
+	free(pt->folder_box);
+	if (pt->content_body)
+		delwin(pt->content_body);
+	if (pt->content_text)
+		delwin(pt->content_text);
+	if (pt->content_title)
+		delwin(pt->content_title);
+	if (pt->elbow_box)
+		delwin(pt->elbow_box);
+	free(pt->folder_entries);
+	free(pt);
+}
+
+/**
+ * Set up personal_terminal folder entries from config. Their contents are not
+ * loaded until they are selected, unless the loader already has.
+ */
+static int pt_load(struct pt_params *params, struct store *store,
+                   struct index *index, struct personal_terminal *pt)
+{
+	int i;
+	bool follow = false;
+	pt->folder_count = params->num_entries;
+	pt->folder_entries = calloc(pt->folder_count,
+	                            sizeof(struct folder_entry));
+	pt->folder_box = NULL;
+	pt->folder_slots = 0;
+	if (!pt->folder_entries) {
+		set_error(EMEM);
+		return -1;
+	}
+	for (i = 0; i < params->num_entries; i++) {
+		pt->folder_entries[i].folder = params->entries[i].folder;
+		pt->folder_entries[i].title = params->entries[i].title;
+		pt->folder_entries[i].source = &params->entries[i];
+		pt->folder_entries[i].follow = params->entries[i].follow;
+		pt->folder_entries[i].watch = -1;
+		pt->folder_entries[i].loaded = false;
+		pt->folder_entries[i].slot = i;
+		if (params->entries[i].follow)
+			follow = true;
+	}
+	pt->dirfd = params->dirfd;
+	pt->lru_head = pt->lru_tail = -1;
+	pt->cache_used = 0;
+	pt->cache_size = params->cache_size;
+
+	pt->inotify_fd = -1;
+	pt->store = store;
+	pt->index = index;
+	if (follow) {
+		pt->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (pt->inotify_fd < 0) {
+			set_error(ESYS);
+			free(pt->folder_entries);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Open the personal terminal on the current curses screen, and draw it. Content
+ * comes from the store, and the global search screen uses the index. The
+ * params must outlive the personal terminal (or its next reload). The caller
+ * waits for input on the screen, and for pt_follow_fd(), and calls the other
+ * pt_*() functions to handle them (see server.c).
+ */
+struct personal_terminal *pt_open(struct pt_params *params,
+                                  struct store *store, struct index *index)
+{
+	struct personal_terminal *pt;
+
+	pt = calloc(1, sizeof(struct personal_terminal));
+	if (!pt) {
+		set_error(EMEM);
+		return NULL;
+	}
+	if (pt_load(params, store, index, pt) < 0) {
+		mark_error();
+		free(pt);
+		return NULL;
+	}
+	if (init_personal_terminal(pt) < 0) {
+		mark_error();
+		free_personal_terminal(pt);
+		nodelay(stdscr, FALSE);
+		return NULL;
+	}
+	return pt;
+}
+
+/**
+ * Close the personal terminal. The screen is left as it was, for the caller to
+ * clear.
+ */
+void pt_close(struct personal_terminal *pt)
+{
+	free_personal_terminal(pt);
+	nodelay(stdscr, FALSE);
 }
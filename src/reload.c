@@ -0,0 +1,412 @@
+/**
+ * alien-console: hot reloading
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * While the personal terminal runs, a thread watches the configuration file and
+ * the content files it refers to. When any of them changes, the configuration
+ * is parsed again, on that thread, and handed to the interface along with which
+ * entries' content files changed (see struct reload). The interface then keeps
+ * whatever it has loaded for the other entries (see pt_reload()).
+ *
+ * Editors tend to save by writing a new file and renaming it over the old one,
+ * so the directories containing the files are watched rather than the files,
+ * and events are matched up with the files by name. Only the files in question
+ * count, so the index being saved next to the configuration doesn't trigger a
+ * reload. Since one save is usually a burst of events, the configuration is
+ * only parsed once they've settled for RELOAD_SETTLE_MS.
+ *
+ * Followed entries are appended to all the time, which the interface handles
+ * by itself, so they only count as changed when the file is replaced.
+ *
+ * A configuration which fails to parse (perhaps because it's still being
+ * written) is ignored, and the console carries on with the last good one.
+ * Bundles aren't watched, since they're meant to be packed once for a kiosk.
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "alien-console.h"
+
+#define RELOAD_SETTLE_MS 50
+#define RELOAD_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | \
+                       IN_MOVED_FROM)
+#define RELOAD_REPLACED (IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM)
+
+/* a file, as inotify names it: a watched directory and a name within it */
+struct watched {
+	int wd;
+	char *name;
+	uint32_t mask; /* events seen, for touched files */
+};
+
+struct reloader {
+	/* read-only after reload_start() */
+	const char *filename;
+	int dirfd;
+	int inotify_fd;
+	int stop_fd;
+	int ready_fd;
+	pthread_t thread;
+
+	/* only used by the thread */
+	struct watched *files; /* the configuration, then each entry */
+	int num_files;
+	struct watched *touched; /* since the configuration was last parsed */
+	int num_touched, alloc_touched;
+
+	pthread_mutex_t lock; /* protects pending */
+	struct reload *pending;
+};
+
+static void free_watched(struct watched *files, int num)
+{
+	int i;
+	for (i = 0; i < num; i++)
+		free(files[i].name);
+	free(files);
+}
+
+/**
+ * Watch the directory containing file (relative to the configuration's
+ * directory), and fill in w with how its events will name the file.
+ */
+static int watch_file(struct reloader *r, const char *file, struct watched *w)
+{
+	char path[PATH_MAX];
+	const char *slash = strrchr(file, '/');
+	int len;
+
+	if (!slash)
+		len = snprintf(path, sizeof(path), "/proc/self/fd/%d", r->dirfd);
+	else if (file[0] == '/')
+		len = snprintf(path, sizeof(path), "%.*s/", (int)(slash - file),
+		               file);
+	else
+		len = snprintf(path, sizeof(path), "/proc/self/fd/%d/%.*s",
+		               r->dirfd, (int)(slash - file), file);
+	if (len >= (int)sizeof(path)) {
+		set_error(EBADFILE);
+		return -1;
+	}
+
+	w->wd = inotify_add_watch(r->inotify_fd, path, RELOAD_EVENTS);
+	if (w->wd < 0) {
+		set_error(ESYS);
+		return -1;
+	}
+	w->name = strdup(slash ? slash + 1 : file);
+	w->mask = 0;
+	if (!w->name) {
+		set_error(EMEM);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Watch the configuration file and every content file of params, replacing the
+ * files watched until now. Directories which are no longer needed stay
+ * watched, but they're harmless.
+ */
+static int watch_files(struct reloader *r, const struct pt_params *params)
+{
+	struct watched *files;
+	int i;
+
+	files = calloc(params->num_entries + 1, sizeof(struct watched));
+	if (!files) {
+		set_error(EMEM);
+		return -1;
+	}
+	for (i = 0; i <= params->num_entries; i++) {
+		if (watch_file(r, i ? params->entries[i - 1].content_file :
+		                      r->filename, &files[i]) < 0) {
+			mark_error();
+			free_watched(files, i + 1);
+			return -1;
+		}
+	}
+	free_watched(r->files, r->num_files);
+	r->files = files;
+	r->num_files = params->num_entries + 1;
+	return 0;
+}
+
+static struct watched *find_watched(struct watched *files, int num, int wd,
+                                    const char *name)
+{
+	int i;
+	for (i = 0; i < num; i++) {
+		if (files[i].wd == wd && strcmp(files[i].name, name) == 0)
+			return &files[i];
+	}
+	return NULL;
+}
+
+/**
+ * Record an event, if it's about one of the files. Returns true if it was.
+ */
+static bool touch(struct reloader *r, const struct inotify_event *event)
+{
+	struct watched *w, *touched;
+
+	if (event->len == 0 ||
+	    !find_watched(r->files, r->num_files, event->wd, event->name))
+		return false;
+
+	w = find_watched(r->touched, r->num_touched, event->wd, event->name);
+	if (!w) {
+		if (r->num_touched == r->alloc_touched) {
+			touched = realloc(r->touched, (2 * r->alloc_touched + 1) *
+			                              sizeof(struct watched));
+			if (!touched)
+				return true; /* it still counts, just not which */
+			r->touched = touched;
+			r->alloc_touched = 2 * r->alloc_touched + 1;
+		}
+		w = &r->touched[r->num_touched];
+		w->name = strdup(event->name);
+		if (!w->name)
+			return true;
+		w->wd = event->wd;
+		w->mask = 0;
+		r->num_touched++;
+	}
+	w->mask |= event->mask;
+	return true;
+}
+
+/**
+ * Read the pending events. Returns true if any of them was about the files.
+ */
+static bool read_events(struct reloader *r)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	bool relevant = false;
+	ssize_t len;
+	char *ptr;
+
+	while ((len = read(r->inotify_fd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)ptr;
+			if (touch(r, event))
+				relevant = true;
+		}
+	}
+	return relevant;
+}
+
+/**
+ * Carry over which entries changed from a reload the interface never took, to
+ * the one replacing it, matching entries by content file.
+ */
+static void merge_changed(struct reload *reload, const struct reload *old)
+{
+	int i, j;
+
+	for (i = 0; i < reload->params.num_entries; i++) {
+		for (j = 0; j < old->params.num_entries; j++) {
+			if (old->changed[j] &&
+			    strcmp(reload->params.entries[i].content_file,
+			           old->params.entries[j].content_file) == 0)
+				reload->changed[i] = true;
+		}
+	}
+}
+
+/**
+ * Parse the configuration again, and make it the pending reload, replacing one
+ * the interface hasn't taken yet.
+ */
+static void reparse(struct reloader *r)
+{
+	struct reload *reload;
+	struct watched *w;
+	uint64_t one = 1;
+	int i;
+
+	reload = calloc(1, sizeof(struct reload));
+	if (!reload)
+		return;
+	if (reparse_config(r->filename, &reload->params) < 0) {
+		clear_error(); /* keep the last good configuration */
+		free(reload);
+		return;
+	}
+	reload->changed = calloc(reload->params.num_entries, sizeof(bool));
+	if (!reload->changed || watch_files(r, &reload->params) < 0) {
+		clear_error();
+		reload_free(reload);
+		return;
+	}
+	for (i = 0; i < reload->params.num_entries; i++) {
+		w = find_watched(r->touched, r->num_touched, r->files[i + 1].wd,
+		                 r->files[i + 1].name);
+		reload->changed[i] = w && (!reload->params.entries[i].follow ||
+		                           (w->mask & RELOAD_REPLACED));
+	}
+	free_watched(r->touched, r->num_touched);
+	r->touched = NULL;
+	r->num_touched = r->alloc_touched = 0;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->pending) {
+		merge_changed(reload, r->pending);
+		reload_free(r->pending);
+	}
+	r->pending = reload;
+	pthread_mutex_unlock(&r->lock);
+	if (write(r->ready_fd, &one, sizeof(one)) < 0) {
+		/* the counter can't overflow in practice, nothing to do */
+	}
+}
+
+static void *reload_thread(void *arg)
+{
+	struct reloader *r = arg;
+	struct pollfd fds[2] = {
+		{ .fd = r->inotify_fd, .events = POLLIN },
+		{ .fd = r->stop_fd, .events = POLLIN },
+	};
+	bool dirty = false;
+	int n;
+
+	for (;;) {
+		/* once something changed, wait for it to settle */
+		n = poll(fds, nelem(fds), dirty ? RELOAD_SETTLE_MS : -1);
+		if (n < 0)
+			continue; /* EINTR */
+		if (fds[1].revents & POLLIN)
+			break;
+		if (n == 0) {
+			reparse(r);
+			dirty = false;
+		} else if (read_events(r)) {
+			dirty = true;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Start watching the configuration file params was parsed from, and the content
+ * files it refers to. Returns NULL without an error when there's nothing to
+ * watch, since params came from a bundle (or elsewhere). The params must
+ * outlive the reloader.
+ */
+struct reloader *reload_start(const struct pt_params *params)
+{
+	struct reloader *r;
+
+	if (!params->filename || params->bundle)
+		return NULL;
+	r = calloc(1, sizeof(struct reloader));
+	if (!r) {
+		set_error(EMEM);
+		return NULL;
+	}
+	r->filename = params->filename;
+	r->dirfd = params->dirfd;
+	r->stop_fd = r->ready_fd = -1;
+	r->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (r->inotify_fd < 0) {
+		set_error(ESYS);
+		goto cleanup;
+	}
+	r->stop_fd = eventfd(0, EFD_CLOEXEC);
+	r->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->stop_fd < 0 || r->ready_fd < 0) {
+		set_error(ESYS);
+		goto cleanup;
+	}
+	if (watch_files(r, params) < 0) {
+		mark_error();
+		goto cleanup;
+	}
+
+	pthread_mutex_init(&r->lock, NULL);
+	if (pthread_create(&r->thread, NULL, reload_thread, r) != 0) {
+		set_error(ESYS);
+		pthread_mutex_destroy(&r->lock);
+		goto cleanup;
+	}
+	return r;
+
+cleanup:
+	free_watched(r->files, r->num_files);
+	if (r->inotify_fd >= 0)
+		close(r->inotify_fd);
+	if (r->stop_fd >= 0)
+		close(r->stop_fd);
+	if (r->ready_fd >= 0)
+		close(r->ready_fd);
+	free(r);
+	return NULL;
+}
+
+/**
+ * Return a file descriptor which becomes readable when a reload is ready.
+ */
+int reload_fd(struct reloader *r)
+{
+	return r->ready_fd;
+}
+
+/**
+ * Take the reload which is ready, if any. The caller owns it, and frees it with
+ * reload_free().
+ */
+struct reload *reload_take(struct reloader *r)
+{
+	struct reload *reload;
+	uint64_t count;
+
+	if (read(r->ready_fd, &count, sizeof(count)) < 0) {
+		/* nothing was ready, which pending tells us anyway */
+	}
+	pthread_mutex_lock(&r->lock);
+	reload = r->pending;
+	r->pending = NULL;
+	pthread_mutex_unlock(&r->lock);
+	return reload;
+}
+
+void reload_free(struct reload *reload)
+{
+	cleanup_config(&reload->params);
+	free(reload->changed);
+	free(reload);
+}
+
+/**
+ * Stop watching, and free a reload which was never taken.
+ */
+void reload_stop(struct reloader *r)
+{
+	uint64_t one = 1;
+
+	if (write(r->stop_fd, &one, sizeof(one)) < 0) {
+		/* can't happen with a fresh eventfd */
+	}
+	pthread_join(r->thread, NULL);
+	if (r->pending)
+		reload_free(r->pending);
+	free_watched(r->files, r->num_files);
+	free_watched(r->touched, r->num_touched);
+	pthread_mutex_destroy(&r->lock);
+	close(r->inotify_fd);
+	close(r->stop_fd);
+	close(r->ready_fd);
+	free(r);
+}
@@ -0,0 +1,171 @@
+/**
+ * alien-console: substring search
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * Content may be several gigabytes of mapped text, so finding a pattern in it
+ * should go as fast as memory allows. The kernel compares the first and last
+ * bytes of the pattern against a whole vector of positions at once, and only
+ * positions where both match are compared in full. That filters out nearly
+ * everything, even for patterns whose first byte is common (like "the").
+ *
+ * On x86, there are SSE2 (always present on x86-64) and AVX2 versions, picked
+ * when the processor supports them. Elsewhere, memchr() finds candidates for
+ * the first byte instead.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SEARCH_X86
+#include <immintrin.h>
+#endif
+
+#include "alien-console.h"
+
+/* backward searches go forward through chunks of this size, from the end */
+#define SEARCH_CHUNK (1024 * 1024)
+
+typedef const char *(*search_fn)(const char *text, size_t size,
+                                 const char *pattern, size_t len);
+
+/**
+ * Compare the candidates in mask (bit i for text + i) with the whole pattern,
+ * returning the first match.
+ */
+static inline const char *check_mask(const char *text, unsigned int mask,
+                                     const char *pattern, size_t len)
+{
+	int i;
+	while (mask) {
+		i = __builtin_ctz(mask);
+		if (memcmp(text + i, pattern, len) == 0)
+			return text + i;
+		mask &= mask - 1;
+	}
+	return NULL;
+}
+
+/**
+ * The portable kernel. It's also used for the tail of the text which is too
+ * short for a whole vector.
+ */
+static const char *search_scalar(const char *text, size_t size,
+                                 const char *pattern, size_t len)
+{
+	const char *end = text + size - len + 1;
+	while ((text = memchr(text, pattern[0], end - text))) {
+		if (memcmp(text, pattern, len) == 0)
+			return text;
+		text++;
+	}
+	return NULL;
+}
+
+#ifdef SEARCH_X86
+static const char *search_sse2(const char *text, size_t size,
+                               const char *pattern, size_t len)
+{
+	const __m128i first = _mm_set1_epi8(pattern[0]);
+	const __m128i last = _mm_set1_epi8(pattern[len - 1]);
+	const char *match;
+	__m128i a, b;
+	size_t i;
+
+	for (i = 0; i + len - 1 + 16 <= size; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(text + i));
+		b = _mm_loadu_si128((const __m128i *)(text + i + len - 1));
+		match = check_mask(text + i, _mm_movemask_epi8(_mm_and_si128(
+		                   _mm_cmpeq_epi8(a, first),
+		                   _mm_cmpeq_epi8(b, last))), pattern, len);
+		if (match)
+			return match;
+	}
+	return search_scalar(text + i, size - i, pattern, len);
+}
+
+__attribute__((target("avx2")))
+static const char *search_avx2(const char *text, size_t size,
+                               const char *pattern, size_t len)
+{
+	const __m256i first = _mm256_set1_epi8(pattern[0]);
+	const __m256i last = _mm256_set1_epi8(pattern[len - 1]);
+	const char *match;
+	__m256i a, b;
+	size_t i;
+
+	for (i = 0; i + len - 1 + 32 <= size; i += 32) {
+		a = _mm256_loadu_si256((const __m256i *)(text + i));
+		b = _mm256_loadu_si256((const __m256i *)(text + i + len - 1));
+		match = check_mask(text + i, _mm256_movemask_epi8(
+		                   _mm256_and_si256(
+		                   _mm256_cmpeq_epi8(a, first),
+		                   _mm256_cmpeq_epi8(b, last))), pattern, len);
+		if (match)
+			return match;
+	}
+	return search_scalar(text + i, size - i, pattern, len);
+}
+#endif
+
+/**
+ * Pick the fastest kernel the processor supports. This is only done once, but
+ * it doesn't matter if threads race to do it, they pick the same thing.
+ */
+static search_fn search_kernel(void)
+{
+	static search_fn kernel;
+	search_fn k = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+	if (k)
+		return k;
+#ifdef SEARCH_X86
+	__builtin_cpu_init();
+	k = __builtin_cpu_supports("avx2") ? search_avx2 : search_sse2;
+#else
+	k = search_scalar;
+#endif
+	__atomic_store_n(&kernel, k, __ATOMIC_RELAXED);
+	return k;
+}
+
+/**
+ * Find the first occurrence of pattern (which has len > 0 bytes) in the size
+ * bytes of text, like memmem(). Returns NULL when there is none.
+ */
+const char *search_find(const char *text, size_t size, const char *pattern,
+                        size_t len)
+{
+	if (len == 0 || size < len)
+		return NULL;
+	return search_kernel()(text, size, pattern, len);
+}
+
+/**
+ * Find the last occurrence of pattern which lies entirely within the size bytes
+ * of text. Returns NULL when there is none.
+ */
+const char *search_find_last(const char *text, size_t size,
+                             const char *pattern, size_t len)
+{
+	const char *match, *last;
+	size_t start, end = size;
+
+	if (len == 0 || size < len)
+		return NULL;
+	/* each chunk holds the matches starting in [start, end - len] */
+	while (end >= len) {
+		start = end - len > SEARCH_CHUNK ? end - len - SEARCH_CHUNK : 0;
+		last = NULL;
+		while ((match = search_find(text + start, end - start, pattern,
+		                            len))) {
+			last = match;
+			start = match - text + 1;
+		}
+		if (last)
+			return last;
+		if (end - len < SEARCH_CHUNK)
+			break;
+		end -= SEARCH_CHUNK;
+	}
+	return NULL;
+}
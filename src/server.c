@@ -0,0 +1,573 @@
+/**
+ * alien-console: seats and server mode
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * A seat is a terminal showing the personal terminal. Normally there's just the
+ * one, on the terminal alien-console was started on. In server mode, a single
+ * process drives a seat on each of the ttys it's given instead. Each seat has
+ * its own curses screen (from newterm()) and its own personal terminal state.
+ * They all share the loader, the index, the reloader and the content store
+ * (see store.c). So each content file is loaded once, and wrapped once for each
+ * width in use, however many seats show it.
+ *
+ * Everything runs on one thread, on the event loop (see loop.c). Curses draws
+ * on the current screen, so set_term() switches to a seat's screen before
+ * anything is done for it. Input and followed files are watched for each seat,
+ * while progress of the index and reloads are handled once and passed on to
+ * every seat. Whatever those change is drawn right away, but each seat's
+ * terminal is updated once, after the events at hand are handled. Input is the
+ * exception: it's output as soon as it's handled, so it's counted per event
+ * (see stats.c).
+ *
+ * A seat quits with 'q' as usual, and its terminal is left blank. The server
+ * exits once every seat has quit, or when it's asked to by SIGTERM, SIGINT or
+ * SIGHUP. When something goes wrong on one seat, the error is reported on
+ * stderr and just that seat is closed. On SIGWINCH, every seat checks the size
+ * of its terminal, and is resized if it changed. That signal only comes from
+ * the terminal the server was started on, though, since the ttys are opened
+ * without becoming its controlling terminal. So the ttys are checked every
+ * SIZE_CHECK_MS as well.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ncurses.h>
+
+#include "alien-console.h"
+
+#define SIZE_CHECK_MS 500 /* between checks of the size of the ttys */
+
+struct seat {
+	const char *tty; /* or NULL, for the terminal curses was started on */
+	FILE *file; /* the tty, or NULL likewise */
+	SCREEN *screen; /* likewise */
+	int lines, cols; /* the size of its screen */
+	struct personal_terminal *pt; /* NULL until opened, and once closed */
+	struct server *server;
+	struct loop_source input, follow;
+	struct loop_task update, search;
+};
+
+struct server {
+	struct pt_params *params;
+	struct loader *loader;
+	struct store *store;
+	struct index *index;
+	struct reloader *reloader; /* or NULL, when there's nothing to watch */
+	struct loop *loop;
+	struct loop_source indexed, reloaded, resized, size_check, quit;
+	struct seat *seats;
+	int num_seats, open_seats;
+};
+
+/**
+ * Make the seat's screen the one curses draws on.
+ */
+static void switch_to(struct seat *seat)
+{
+	if (seat->screen)
+		set_term(seat->screen);
+}
+
+/**
+ * Open the seat's tty (unless it's the terminal curses was started on), set up
+ * curses on it, and open the personal terminal there.
+ */
+static int open_seat(struct server *server, struct seat *seat)
+{
+	int fd;
+
+	if (seat->tty) {
+		fd = open(seat->tty, O_RDWR | O_NOCTTY | O_CLOEXEC);
+		if (fd < 0) {
+			set_error(ESYS);
+			return -1;
+		}
+		seat->file = fdopen(fd, "r+");
+		if (!seat->file) {
+			set_error(ESYS);
+			close(fd);
+			return -1;
+		}
+		/* the same setup as main() does for its terminal */
+		seat->screen = newterm(NULL, seat->file, seat->file);
+		if (!seat->screen) {
+			set_error(ETERM);
+			return -1;
+		}
+		set_term(seat->screen);
+		cbreak();
+		noecho();
+		keypad(stdscr, TRUE);
+		curs_set(0);
+	}
+	getmaxyx(stdscr, seat->lines, seat->cols);
+
+	seat->pt = pt_open(server->params, server->store, server->index);
+	if (!seat->pt) {
+		mark_error();
+		return -1;
+	}
+	server->open_seats++;
+	if (loop_watch(server->loop, &seat->input,
+	               seat->file ? fileno(seat->file) : STDIN_FILENO) < 0 ||
+	    loop_watch(server->loop, &seat->follow,
+	               pt_follow_fd(seat->pt)) < 0) {
+		mark_error();
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Close the seat's personal terminal, and leave its tty blank. The terminal
+ * curses was started on is left for main() to clean up. Once every seat is
+ * closed, the loop stops.
+ */
+static void close_seat(struct server *server, struct seat *seat)
+{
+	switch_to(seat);
+	loop_watch(server->loop, &seat->input, -1);
+	loop_watch(server->loop, &seat->follow, -1);
+	if (seat->pt) {
+		pt_close(seat->pt);
+		seat->pt = NULL;
+		if (--server->open_seats == 0)
+			loop_stop(server->loop);
+	}
+	if (seat->screen && !isendwin()) {
+		clear();
+		refresh();
+		endwin();
+	}
+}
+
+/**
+ * Free the seat's screen and close its tty, once every seat is closed. Freeing
+ * a screen any sooner isn't safe: delscreen() may free the windows of the
+ * other screens too.
+ */
+static void free_seat(struct seat *seat)
+{
+	if (seat->screen)
+		delscreen(seat->screen);
+	if (seat->file)
+		fclose(seat->file);
+}
+
+/**
+ * Deal with an error on a seat. A tty is closed, and the others carry on, but
+ * when it's the terminal curses was started on (the only seat), this fails.
+ */
+static int seat_failed(struct server *server, struct seat *seat)
+{
+	if (!seat->tty)
+		return -1;
+	fprintf(stderr, "alien-console: closing %s\n", seat->tty);
+	report_error(stderr);
+	clear_error();
+	close_seat(server, seat);
+	return 0;
+}
+
+/**
+ * Carry on after the personal terminal on a seat returned rv: 1 to quit, -1 on
+ * error, or 0 when it drew something. Then the seat's terminal is updated, and
+ * a search which is going carries on, once the events at hand are handled.
+ */
+static int seat_done(struct server *server, struct seat *seat, int rv)
+{
+	if (rv > 0) {
+		close_seat(server, seat);
+	} else if (rv < 0) {
+		if (seat_failed(server, seat) < 0) {
+			mark_error();
+			return -1;
+		}
+	} else {
+		loop_defer(server->loop, &seat->update);
+		if (pt_searching(seat->pt))
+			loop_defer(server->loop, &seat->search);
+	}
+	return 0;
+}
+
+/**
+ * Update the seat's terminal with what was drawn since, a deferred task.
+ */
+static int update_seat(struct loop *loop, struct loop_task *task)
+{
+	struct seat *seat = task->data;
+
+	(void)loop;
+	if (seat->pt) {
+		switch_to(seat);
+		stats_doupdate();
+	}
+	return 0;
+}
+
+/**
+ * Do a step of the seat's search, a deferred task which carries on until the
+ * search is done.
+ */
+static int search_seat(struct loop *loop, struct loop_task *task)
+{
+	struct seat *seat = task->data;
+
+	(void)loop;
+	if (!seat->pt || !pt_searching(seat->pt))
+		return 0;
+	switch_to(seat);
+	return seat_done(seat->server, seat, pt_search_step(seat->pt));
+}
+
+/**
+ * Handle key presses on the seat's terminal.
+ */
+static int handle_input(struct loop *loop, struct loop_source *source)
+{
+	struct seat *seat = source->data;
+
+	(void)loop;
+	switch_to(seat);
+	return seat_done(seat->server, seat, pt_input(seat->pt));
+}
+
+/**
+ * Pick up changes to the seat's followed entries.
+ */
+static int handle_follow(struct loop *loop, struct loop_source *source)
+{
+	struct seat *seat = source->data;
+
+	(void)loop;
+	switch_to(seat);
+	return seat_done(seat->server, seat, pt_follow(seat->pt));
+}
+
+/**
+ * Put the seat's screen back to its own size after another seat was resized.
+ * Curses keeps one list of windows for all its screens, so resizeterm() on one
+ * resizes the windows of the others as well, curscr and newscr included. The
+ * personal terminal is then laid out again, as if it had been resized.
+ */
+static int restore_seat(struct server *server, struct seat *seat)
+{
+	switch_to(seat);
+	if (wresize(curscr, seat->lines, seat->cols) == ERR ||
+	    wresize(newscr, seat->lines, seat->cols) == ERR ||
+	    wresize(stdscr, seat->lines, seat->cols) == ERR) {
+		set_error(EMEM);
+		return seat_done(server, seat, -1);
+	}
+	ungetch(KEY_RESIZE);
+	return seat_done(server, seat, pt_input(seat->pt));
+}
+
+/**
+ * Resize each seat whose terminal changed size. The personal terminal then lays
+ * itself out again, when it gets KEY_RESIZE as input.
+ */
+static int resize_seats(struct server *server)
+{
+	struct seat *seat;
+	int i, j;
+
+	for (i = 0; i < server->num_seats; i++) {
+		seat = &server->seats[i];
+		if (!seat->pt)
+			continue;
+		switch_to(seat);
+		if (!loop_term_resized(seat->file ? fileno(seat->file) :
+		                                    STDOUT_FILENO))
+			continue;
+		getmaxyx(stdscr, seat->lines, seat->cols);
+		for (j = 0; j < server->num_seats; j++) {
+			if (j != i && server->seats[j].pt &&
+			    restore_seat(server, &server->seats[j]) < 0) {
+				mark_error();
+				return -1;
+			}
+		}
+		switch_to(seat);
+		if (seat_done(server, seat, pt_input(seat->pt)) < 0) {
+			mark_error();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Resize the seats on SIGWINCH.
+ */
+static int handle_resize(struct loop *loop, struct loop_source *source)
+{
+	(void)loop;
+	return resize_seats(source->data);
+}
+
+/**
+ * Set the timer for the next check of the size of the ttys.
+ */
+static int check_size_later(struct server *server)
+{
+	struct timespec when;
+
+	clock_gettime(CLOCK_MONOTONIC, &when);
+	when.tv_nsec += SIZE_CHECK_MS * 1000000L;
+	when.tv_sec += when.tv_nsec / 1000000000;
+	when.tv_nsec %= 1000000000;
+	return loop_timer_at(&server->size_check, &when);
+}
+
+/**
+ * Resize the seats whenever the timer is due, since the ttys send no SIGWINCH.
+ */
+static int handle_size_check(struct loop *loop, struct loop_source *source)
+{
+	struct server *server = source->data;
+
+	(void)loop;
+	if (check_size_later(server) < 0 || resize_seats(server) < 0) {
+		mark_error();
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Close every seat, when asked to quit by a signal.
+ */
+static int handle_quit(struct loop *loop, struct loop_source *source)
+{
+	struct server *server = source->data;
+	int i;
+
+	(void)loop;
+	for (i = 0; i < server->num_seats; i++)
+		close_seat(server, &server->seats[i]);
+	return 0;
+}
+
+/**
+ * Pass progress of the index on to every seat.
+ */
+static int handle_index(struct loop *loop, struct loop_source *source)
+{
+	struct server *server = source->data;
+	int indexed = index_progress(server->index), i;
+
+	(void)loop;
+	for (i = 0; i < server->num_seats; i++) {
+		if (!server->seats[i].pt)
+			continue;
+		switch_to(&server->seats[i]);
+		pt_indexed(server->seats[i].pt, indexed);
+		loop_defer(server->loop, &server->seats[i].update);
+	}
+	return 0;
+}
+
+/**
+ * Switch every seat over to a reloaded configuration, if there is one. The
+ * store stops handing out files which changed, and the loader takes the reload
+ * once no seat needs the configuration it replaces.
+ */
+static int handle_reload(struct loop *loop, struct loop_source *source)
+{
+	struct server *server = source->data;
+	struct reload *reload = reload_take(server->reloader);
+	struct pt_params *params;
+	struct seat *seat;
+	struct index *index;
+	int rv = 0, i;
+
+	(void)loop;
+	if (!reload)
+		return 0;
+	params = &reload->params;
+	index = index_start(params);
+	if (!index) {
+		mark_error();
+		reload_free(reload);
+		return -1;
+	}
+	for (i = 0; i < params->num_entries; i++) {
+		if (reload->changed[i])
+			store_forget(server->store,
+			             params->entries[i].content_file);
+	}
+
+	for (i = 0; i < server->num_seats && rv == 0; i++) {
+		seat = &server->seats[i];
+		if (!seat->pt)
+			continue;
+		switch_to(seat);
+		if (pt_reload(seat->pt, params, reload->changed, index) < 0 ||
+		    loop_watch(server->loop, &seat->follow,
+		               pt_follow_fd(seat->pt)) < 0) {
+			mark_error();
+			rv = seat_failed(server, seat);
+		} else {
+			rv = seat_done(server, seat, 0);
+		}
+	}
+
+	if (loop_watch(server->loop, &server->indexed, index_fd(index)) < 0) {
+		mark_error();
+		rv = -1;
+	}
+	loader_reload(server->loader, reload, index);
+	server->index = index;
+	return rv;
+}
+
+/**
+ * Open every seat, and serve them until they've all quit.
+ */
+static int run(struct server *server)
+{
+	struct seat *seat;
+	int i, rv = -1;
+
+	server->index = loader_index(server->loader);
+	server->indexed = (struct loop_source){
+		.fd = -1, .handle = handle_index, .data = server };
+	server->reloaded = (struct loop_source){
+		.fd = -1, .handle = handle_reload, .data = server };
+	server->resized = (struct loop_source){
+		.fd = -1, .handle = handle_resize, .data = server };
+	server->size_check = (struct loop_source){
+		.fd = -1, .handle = handle_size_check, .data = server };
+	server->quit = (struct loop_source){
+		.fd = -1, .handle = handle_quit, .data = server };
+	for (i = 0; i < server->num_seats; i++) {
+		seat = &server->seats[i];
+		seat->server = server;
+		seat->input = (struct loop_source){
+			.fd = -1, .handle = handle_input, .data = seat };
+		seat->follow = (struct loop_source){
+			.fd = -1, .handle = handle_follow, .data = seat };
+		seat->update = (struct loop_task){
+			.run = update_seat, .data = seat };
+		seat->search = (struct loop_task){
+			.run = search_seat, .data = seat };
+	}
+
+	server->loop = loop_new();
+	if (!server->loop) {
+		mark_error();
+		return -1;
+	}
+	loop_signal(server->loop, SIGWINCH, &server->resized);
+	loop_signal(server->loop, SIGTERM, &server->quit);
+	loop_signal(server->loop, SIGINT, &server->quit);
+	loop_signal(server->loop, SIGHUP, &server->quit);
+	if (server->seats[0].tty &&
+	    (loop_timer(server->loop, &server->size_check) < 0 ||
+	     check_size_later(server) < 0)) {
+		mark_error();
+		goto exit;
+	}
+	if (sound_watch(server->loop) < 0) { /* still playing after the splash */
+		mark_error();
+		goto exit;
+	}
+	server->store = store_new(server->loader);
+	if (!server->store) {
+		mark_error();
+		goto exit;
+	}
+	server->reloader = reload_start(server->params);
+	if (!server->reloader && error_is_set()) {
+		mark_error();
+		goto exit;
+	}
+	if (loop_watch(server->loop, &server->indexed,
+	               index_fd(server->index)) < 0 ||
+	    (server->reloader &&
+	     loop_watch(server->loop, &server->reloaded,
+	                reload_fd(server->reloader)) < 0)) {
+		mark_error();
+		goto exit;
+	}
+
+	for (i = 0; i < server->num_seats; i++) {
+		if (open_seat(server, &server->seats[i]) < 0) {
+			mark_error();
+			goto exit;
+		}
+	}
+	rv = loop_run(server->loop);
+	if (rv < 0)
+		mark_error();
+
+exit:
+	for (i = 0; i < server->num_seats; i++)
+		close_seat(server, &server->seats[i]);
+	for (i = 0; i < server->num_seats; i++)
+		free_seat(&server->seats[i]);
+	if (server->reloader)
+		reload_stop(server->reloader);
+	if (server->store)
+		store_free(server->store);
+	sound_unwatch(server->loop);
+	loop_close(server->loop, &server->size_check);
+	loop_free(server->loop);
+	return rv;
+}
+
+/**
+ * Run the personal terminal on the current curses screen, start to finish.
+ */
+int personal_terminal(struct pt_params *params, struct loader *loader)
+{
+	struct seat seat = { .tty = NULL };
+	struct server server = {
+		.params = params,
+		.loader = loader,
+		.seats = &seat,
+		.num_seats = 1,
+	};
+
+	if (run(&server) < 0) {
+		mark_error();
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Run the personal terminal on each of the ttys, sharing their content, until
+ * every one of them has quit. Curses must not be running on the terminal the
+ * server was started on.
+ */
+int server(struct pt_params *params, struct loader *loader,
+           char *const ttys[], int num_ttys)
+{
+	struct server server = {
+		.params = params,
+		.loader = loader,
+		.num_seats = num_ttys,
+	};
+	int i, rv;
+
+	server.seats = calloc(num_ttys, sizeof(struct seat));
+	if (!server.seats) {
+		set_error(EMEM);
+		return -1;
+	}
+	for (i = 0; i < num_ttys; i++)
+		server.seats[i].tty = ttys[i];
+	rv = run(&server);
+	if (rv < 0)
+		mark_error();
+	free(server.seats);
+	return rv;
+}
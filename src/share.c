@@ -0,0 +1,348 @@
+/**
+ * alien-console: line indices shared between processes
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * A host running a console on each of its terminals, as separate processes,
+ * would otherwise have every one of them wrap the same files to the same width.
+ * The text is already shared, since content files are mapped from the page
+ * cache (see content.c), so with share_line_index set, the line indices are
+ * shared too: a process publishes the index it built in a POSIX shared memory
+ * segment, and the others map it read-only in place of wrapping the text
+ * themselves, just as they would use an index packed in a bundle.
+ *
+ * There's no daemon. The first process to publish an index for a file and
+ * width wins, and the segment is never written again once it's ready. Another
+ * process which wrapped further may replace it, by unlinking it and publishing
+ * its own, while whoever mapped the old one keeps it. A segment is named after
+ * the file's device, inode and the width, and its header records the file's
+ * size and modification time, so an index of a file which changed since is
+ * replaced rather than used.
+ *
+ * An index is published when it's complete, and when it's dropped (because the
+ * content is unloaded or rewrapped), so a partial index is shared too. A
+ * process which needs more of it than was published copies it and carries on
+ * wrapping (see content_wrap_to()).
+ *
+ * Segments are shared between the processes of one user. Anyone may create a
+ * segment by the name another user's process would look for, so only those
+ * owned by our effective user, and which nobody else may write, are used (see
+ * trusted()). Even then, a segment's offsets are checked before they are used
+ * to index into the text, in case of a bug in some other version.
+ *
+ * A segment for a file which has since changed is removed by the first process
+ * to find it. Segments for files nobody shows any more are left behind, so each
+ * process marks the ones it uses by setting their modification time, and at
+ * startup removes ours which went unused for SHARE_UNUSED (see share_enable()).
+ *
+ * Everything here is best-effort: when a segment can't be created or doesn't
+ * check out, the text is simply wrapped as usual.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alien-console.h"
+
+#define SHARE_MAGIC "ACLINES"
+#define SHARE_VERSION 1
+#define SHARE_NAME_MAX 64
+#define SHARE_ABANDONED 10 /* seconds before an empty segment is given up on */
+#define SHARE_UNUSED (7 * 24 * 60 * 60) /* seconds before a segment is removed */
+#define SHARE_DIR "/dev/shm" /* where shm_open() puts segments, on Linux */
+#define SHARE_PREFIX "alien-console."
+
+struct shared_index {
+	char magic[8];
+	uint32_t version;
+	uint32_t ready; /* set last, once everything else is written */
+	int32_t pid; /* of the writer */
+	int32_t width;
+	uint64_t dev, ino;
+	int64_t mtime;
+	uint64_t size; /* of the file */
+	uint64_t length; /* of the segment */
+	uint64_t wrap_pos;
+	int64_t lines;
+	size_t offsets[]; /* lines + 1 of them, see struct content */
+};
+
+static bool share_enabled;
+
+/**
+ * Return true if we may trust the segment: it's ours, and nobody else can have
+ * written to it.
+ */
+static bool trusted(const struct stat *st)
+{
+	return st->st_uid == geteuid() && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/**
+ * Remove our segments which no process has used for SHARE_UNUSED. Any process
+ * still using one keeps its mapping, and the next to need it publishes it
+ * again.
+ */
+static void share_reap(void)
+{
+	time_t now = time(NULL);
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir(SHARE_DIR);
+	if (!dir)
+		return;
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, SHARE_PREFIX, strlen(SHARE_PREFIX)) != 0 ||
+		    fstatat(dirfd(dir), de->d_name, &st,
+		            AT_SYMLINK_NOFOLLOW) < 0 ||
+		    !S_ISREG(st.st_mode) || st.st_uid != geteuid())
+			continue;
+		if (now - st.st_mtime >= SHARE_UNUSED)
+			unlinkat(dirfd(dir), de->d_name, 0);
+	}
+	closedir(dir);
+}
+
+/**
+ * Share line indices with other processes from now on, removing segments which
+ * went unused. Called once, before anything is wrapped.
+ */
+void share_enable(void)
+{
+	share_enabled = true;
+	share_reap();
+}
+
+/**
+ * Return true if the content's line index may be shared: it's the whole of a
+ * file, which isn't followed (and so expected to change).
+ */
+static bool shareable(const struct content *c)
+{
+	return share_enabled && !c->packed && !c->failed && c->fd < 0 &&
+	       c->size > 0;
+}
+
+static void segment_name(const struct content *c, int width, char *name)
+{
+	snprintf(name, SHARE_NAME_MAX, "/" SHARE_PREFIX "%llx.%llx.%d",
+	         (unsigned long long)c->dev, (unsigned long long)c->ino, width);
+}
+
+/**
+ * Return true if the segment is a ready index of the content's file, as it is
+ * now, and wrapped to width. Only the header is checked.
+ */
+static bool matches(const struct shared_index *s, size_t length,
+                    const struct content *c, int width)
+{
+	return memcmp(s->magic, SHARE_MAGIC, sizeof(s->magic)) == 0 &&
+	       s->version == SHARE_VERSION &&
+	       __atomic_load_n(&s->ready, __ATOMIC_ACQUIRE) &&
+	       s->width == width && s->dev == c->dev && s->ino == c->ino &&
+	       s->mtime == c->mtime && s->size == c->size &&
+	       s->length == length && s->lines > 0 && s->lines < INT_MAX &&
+	       s->length >= sizeof(struct shared_index) &&
+	       (s->length - sizeof(struct shared_index)) / sizeof(size_t) >
+	       (uint64_t)s->lines;
+}
+
+/**
+ * Return true if the offsets are ones content_line() can use: each line starts
+ * after the one before, and the last ends at wrap_pos, within the text.
+ */
+static bool offsets_valid(const struct shared_index *s)
+{
+	int64_t i;
+
+	if (s->offsets[0] != 0 || s->offsets[s->lines] != s->wrap_pos ||
+	    s->wrap_pos > s->size)
+		return false;
+	for (i = 0; i < s->lines; i++) {
+		if (s->offsets[i] >= s->offsets[i + 1])
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Map the published index of the content's file at width, if there's one which
+ * checks out, and mark it used. Returns it, or NULL. A segment for an older
+ * version of the file is removed.
+ */
+static const struct shared_index *share_map(const struct content *c, int width)
+{
+	char name[SHARE_NAME_MAX];
+	struct shared_index *s;
+	struct stat st;
+	int fd;
+
+	segment_name(c, width, name);
+	fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || !trusted(&st) ||
+	    (size_t)st.st_size < sizeof(struct shared_index)) {
+		close(fd);
+		return NULL;
+	}
+	s = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (s == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	if (!matches(s, st.st_size, c, width) || !offsets_valid(s)) {
+		/* one for an older version of the file is of no use to anyone */
+		if (__atomic_load_n(&s->ready, __ATOMIC_ACQUIRE) &&
+		    s->dev == c->dev && s->ino == c->ino && s->mtime < c->mtime)
+			shm_unlink(name);
+		munmap(s, st.st_size);
+		close(fd);
+		return NULL;
+	}
+	futimens(fd, NULL); /* see share_reap() */
+	close(fd);
+	return s;
+}
+
+/**
+ * Use a line index published by another process for the content at width, if
+ * there is one. Returns true if so, with the index in place as if the content
+ * had been wrapped that far, but line_alloc 0 since it isn't ours.
+ */
+bool share_find(struct content *c, int width)
+{
+	const struct shared_index *s;
+
+	if (!shareable(c))
+		return false;
+	s = share_map(c, width);
+	if (!s)
+		return false;
+	if (c->line_alloc)
+		free(c->line_offsets - c->head_alloc);
+	c->head_alloc = 0;
+	c->first_line = 0;
+	c->shared = s;
+	c->line_offsets = (size_t *)s->offsets;
+	c->line_alloc = 0;
+	c->lines = s->lines;
+	c->wrap_pos = s->wrap_pos;
+	return true;
+}
+
+/**
+ * Unmap the shared index the content was using. Its line offsets must be
+ * replaced before they're used again.
+ */
+void share_release(struct content *c)
+{
+	if (!c->shared)
+		return;
+	munmap((void *)c->shared, c->shared->length);
+	c->shared = NULL;
+}
+
+/**
+ * Return true if there's no point publishing the content's index as the segment
+ * named name, since that's at least as long already, or is still being
+ * written, or it's someone else's (which we can't replace). A stale segment,
+ * one left unfinished by a writer which died, or one we can't trust, is
+ * unlinked.
+ */
+static bool published(const struct content *c, const char *name, int lines)
+{
+	struct shared_index s;
+	struct stat st;
+	ssize_t len;
+	bool keep;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) < 0 || st.st_uid != geteuid()) {
+		close(fd);
+		return true;
+	}
+	len = pread(fd, &s, sizeof(s), 0);
+	close(fd);
+
+	if (!trusted(&st))
+		keep = false;
+	else if (len != sizeof(s))
+		/* just created, unless it's been that way for a while */
+		keep = time(NULL) - st.st_mtime < SHARE_ABANDONED;
+	else if (!s.ready)
+		keep = kill(s.pid, 0) == 0 || errno != ESRCH;
+	else
+		keep = s.dev == c->dev && s.ino == c->ino &&
+		       s.mtime == c->mtime && s.size == c->size &&
+		       s.lines >= lines;
+	if (!keep)
+		shm_unlink(name);
+	return keep;
+}
+
+/**
+ * Publish the content's line index for other processes, unless one at least as
+ * long has been already. Only an index we built ourselves is published, once
+ * it reaches back to the top of the text (see content_resync()).
+ */
+void share_publish(const struct content *c)
+{
+	const size_t *offsets = c->line_offsets + c->first_line;
+	int lines = c->lines - c->first_line;
+	char name[SHARE_NAME_MAX];
+	struct shared_index *s;
+	size_t length;
+	int fd;
+
+	if (!shareable(c) || !c->line_alloc || lines == 0 || offsets[0] != 0)
+		return;
+	segment_name(c, c->width, name);
+	if (published(c, name, lines))
+		return;
+
+	/* whoever creates it first writes it */
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+	length = sizeof(struct shared_index) + (lines + 1) * sizeof(size_t);
+	if (ftruncate(fd, length) < 0) {
+		close(fd);
+		shm_unlink(name);
+		return;
+	}
+	s = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) {
+		shm_unlink(name);
+		return;
+	}
+
+	memcpy(s->magic, SHARE_MAGIC, sizeof(s->magic));
+	s->version = SHARE_VERSION;
+	s->pid = getpid();
+	s->width = c->width;
+	s->dev = c->dev;
+	s->ino = c->ino;
+	s->mtime = c->mtime;
+	s->size = c->size;
+	s->length = length;
+	s->wrap_pos = c->wrap_pos;
+	s->lines = lines;
+	memcpy(s->offsets, offsets, (lines + 1) * sizeof(size_t));
+	__atomic_store_n(&s->ready, 1, __ATOMIC_RELEASE);
+	munmap(s, length);
+}
@@ -0,0 +1,166 @@
+/**
+ * alien-console: startup sound
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * The startup sound is played by an external audio player, started along with
+ * the splash screen. Nothing waits for it: it keeps playing into the personal
+ * terminal if it's longer than the splash, and whichever event loop is running
+ * reaps it once it's done (see sound_watch()). A player which is still going
+ * after SOUND_TIMEOUT, like one stuck on a busy audio device, is killed, and so
+ * is one still playing when the program exits.
+ *
+ * The player is started with posix_spawn(), which doesn't copy the process,
+ * and tracked through a pidfd, which becomes readable once it exits. On kernels
+ * without pidfds (before Linux 5.3), SIGCHLD does instead.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alien-console.h"
+
+#define SOUND_FILE "/var/local/console.wav"
+#define SOUND_TIMEOUT 30 /* seconds the player may run before it's killed */
+
+static struct {
+	pid_t pid; /* of the player, or 0 when none is running */
+	int pidfd; /* or -1 */
+	struct timespec deadline; /* when to kill the player */
+	struct loop_source exited, timeout;
+} sound = {
+	.pidfd = -1,
+	.exited = { .fd = -1 },
+	.timeout = { .fd = -1 },
+};
+
+/**
+ * Play the startup sound, located at "/var/local/console.wav", with the given
+ * audio player. I was able to find the console startup noise from the Alien:
+ * Isolation game resources. However I'm not going to distribute it because
+ * copyright. This returns regardless of error. An empty audio_player plays
+ * nothing.
+ */
+void sound_play(const char *audio_player)
+{
+	char *argv[] = { (char *)audio_player, SOUND_FILE, NULL };
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t none;
+	pid_t pid;
+	int err;
+
+	if (audio_player[0] == '\0' || sound.pid > 0)
+		return;
+	/* rather than trying to shut up the audio player with some magic flag,
+	 * just redirect stderr and stdout to /dev/null */
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+	                                 O_WRONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO,
+	                                 STDERR_FILENO);
+	posix_spawnattr_init(&attr);
+	sigemptyset(&none); /* see loop_block_signals() */
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if (err != 0)
+		return;
+
+	sound.pid = pid;
+	sound.pidfd = syscall(SYS_pidfd_open, pid, 0);
+	clock_gettime(CLOCK_MONOTONIC, &sound.deadline);
+	sound.deadline.tv_sec += SOUND_TIMEOUT;
+}
+
+/**
+ * Reap the player if it has exited, and stop watching it. Returns true if it
+ * has (or there's none).
+ */
+static bool sound_reap(struct loop *loop)
+{
+	if (sound.pid <= 0)
+		return true;
+	if (waitpid(sound.pid, NULL, WNOHANG) == 0)
+		return false;
+	sound_unwatch(loop);
+	if (sound.pidfd >= 0)
+		close(sound.pidfd);
+	sound.pidfd = -1;
+	sound.pid = 0;
+	return true;
+}
+
+static int sound_exited(struct loop *loop, struct loop_source *source)
+{
+	(void)source;
+	sound_reap(loop);
+	return 0;
+}
+
+static int sound_timeout(struct loop *loop, struct loop_source *source)
+{
+	(void)loop;
+	(void)source;
+	kill(sound.pid, SIGKILL); /* and it's reaped once it exits */
+	return 0;
+}
+
+/**
+ * Watch the player (if it's running) on the loop, reaping it when it exits and
+ * killing it if it outlasts its timeout. Stop with sound_unwatch() before the
+ * loop is freed, and another loop may pick up where it left off.
+ */
+int sound_watch(struct loop *loop)
+{
+	if (sound_reap(loop))
+		return 0;
+	sound.exited.handle = sound_exited;
+	sound.timeout.handle = sound_timeout;
+	if (sound.pidfd >= 0) {
+		if (loop_watch(loop, &sound.exited, sound.pidfd) < 0)
+			goto error;
+	} else {
+		loop_signal(loop, SIGCHLD, &sound.exited);
+	}
+	if (loop_timer(loop, &sound.timeout) < 0 ||
+	    loop_timer_at(&sound.timeout, &sound.deadline) < 0)
+		goto error;
+	return 0;
+
+error:
+	mark_error();
+	sound_unwatch(loop);
+	return -1;
+}
+
+/**
+ * Stop watching the player on the loop. It keeps playing.
+ */
+void sound_unwatch(struct loop *loop)
+{
+	loop_watch(loop, &sound.exited, -1);
+	loop_signal(loop, SIGCHLD, NULL);
+	loop_close(loop, &sound.timeout);
+}
+
+/**
+ * Stop the player if it's still playing, when the program exits.
+ */
+void sound_stop(void)
+{
+	if (sound.pid <= 0)
+		return;
+	kill(sound.pid, SIGKILL);
+	waitpid(sound.pid, NULL, 0);
+	if (sound.pidfd >= 0)
+		close(sound.pidfd);
+	sound.pidfd = -1;
+	sound.pid = 0;
+}
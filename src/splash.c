@@ -2,15 +2,14 @@
  * alien-console: splash screen
  * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
  *
- * This is intended to display ASCII art along with a progress bar. Expecting
- * me to handle tabs or anything more complex than spaces and printable
- * characters is just nonsense.
+ * This is intended to display ASCII art (see art.c) along with a progress bar.
  */
-#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
@@ -37,90 +36,136 @@ struct splash_layout {
 	int splash_start_x; /* where to start printing splash */
 	int tagline_start_x; /* where to start printing tagline */
 	int copyright_start_x; /* where to start printing copyright */
+	int bar_y; /* the line of the progress bar */
 };
 
-/* presumably a splash should have <= 12 lines with <= 80 characters / line */
-char splash_contents[1024];
+static struct splash_art art;
 
 /**
- * Returns the number of characters in the longest line of splash. Does not
- * handle things like tabs or other nonsense. splash must be NUL-terminated.
+ * Return the seconds elapsed since start.
  */
-static int max_line_width(char *splash)
+static double splash_elapsed(const struct timespec *start)
 {
-	int max_line_width = 0;
-	int line_width = 0;
-	for (; *splash != '\0'; splash++) {
-		if (*splash == '\n') {
-			if (line_width > max_line_width)
-				max_line_width = line_width;
-			line_width = 0;
-		} else {
-			line_width++;
-		}
-	}
-	return max_line_width;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_nsec - start->tv_nsec) / 1e9;
 }
 
 /**
- * Returns the number of lines in splash.
+ * Return the time the given number of seconds after start.
  */
-int count_lines(char *splash)
+static struct timespec splash_deadline(const struct timespec *start,
+                                       double seconds)
 {
-	int lines = 1;
-	for (; *splash != '\0'; splash++) {
-		if (*splash == '\n')
-			lines++;
-	}
-	return lines;
+	struct timespec deadline = *start;
+	long long nsec = deadline.tv_nsec + (long long)(seconds * 1e9);
+
+	deadline.tv_sec += nsec / 1000000000;
+	deadline.tv_nsec = nsec % 1000000000;
+	return deadline;
 }
 
 /**
- * Sleep for a short time between printing progress bar.
+ * Return when the next column of a timed progress bar is due, in seconds from
+ * the start. Columns are due on a fixed schedule, which takes params->duration
+ * seconds in all, give or take a bit of jitter so the bar doesn't look
+ * mechanical.
  */
-static void splash_sleep(int maxx)
+static double timed_due(const struct splash_params *params, int x, int maxx)
 {
-	/* sleep for ~7 seconds total during load */
-	double nsec_per_tick = (7.0 / maxx) * 1000000000;
-	struct timespec slp;
-	int millis_fuzz = rand() % 20 - 10;
-	slp.tv_sec = 0;
-	slp.tv_nsec = (unsigned long) nsec_per_tick;
-	slp.tv_nsec += 1000000 * millis_fuzz;
-	nanosleep(&slp, NULL);
+	int millis_fuzz = rand() % 10;
+	if (params->duration <= 0)
+		return 0;
+	return (x + 1) * params->duration / maxx + millis_fuzz / 1000.0;
 }
 
 /**
- * Loads the splash file into the statically allocated splash buffer.
+ * Return the column a timed progress bar should be filled up to by now. When
+ * output falls behind, the columns which came due meanwhile are all drawn at
+ * once, so the bar still finishes on time. A duration of zero is done at once.
  */
-static int splash_load(FILE *splash_file)
+static int timed_goal(const struct splash_params *params,
+                      const struct timespec *start, int maxx)
 {
-	size_t bytes;
+	int goal;
+	if (params->duration <= 0)
+		return maxx;
+	goal = splash_elapsed(start) / params->duration * maxx;
+	return goal < maxx ? goal : maxx;
+}
 
-	bytes = fread(splash_contents, 1, sizeof(splash_contents), splash_file);
-	if (bytes >= sizeof(splash_contents) - 1) {
-		set_error(EBIGFILE);
-		return -1;
-	}
-	if (ferror(splash_file)) {
-		set_error(ESYS);
-		return -1;
-	}
+/**
+ * Return the column a progress bar showing real progress should be filled up
+ * to by now. The bar never gets ahead of the work actually done, nor of the
+ * minimum display time, so it's full once both are.
+ */
+static int progress_goal(const struct splash_params *params,
+                         struct loader *loader, const struct timespec *start,
+                         int maxx)
+{
+	double progress, time;
 
-	/* ensure we have a trailing newline and null terminator */
-	if (splash_contents[bytes-1] != '\n') {
-		splash_contents[bytes++] = '\n';
+	progress = loader_progress(loader);
+	if (params->min_time > 0) {
+		time = splash_elapsed(start) / params->min_time;
+		if (time < progress)
+			progress = time;
 	}
-	splash_contents[bytes] = '\0';
+	if (progress >= 1)
+		return maxx;
+	return progress * maxx;
+}
 
-	return 0;
+#ifdef DEBUG
+/*
+ * In debug builds, each frame of the progress bar is timed, and reported by
+ * splash_report() once curses has ended.
+ */
+#define SPLASH_FRAMES_MAX 1024
+static struct {
+	double start_ms; /* since the splash began */
+	double output_ms; /* spent drawing and updating the terminal */
+	int columns; /* drawn this frame */
+	int art_frame; /* of the animation, shown this frame */
+} splash_frames[SPLASH_FRAMES_MAX];
+static int splash_num_frames;
+static double splash_total_ms;
+#endif
+
+/**
+ * Report the timing of each frame of the splash screen, in debug builds.
+ * Otherwise, this does nothing.
+ */
+void splash_report(FILE *f)
+{
+#ifdef DEBUG
+	int i;
+	double worst = 0;
+
+	if (splash_num_frames == 0)
+		return;
+	fprintf(f, "Splash frames\n");
+	for (i = 0; i < splash_num_frames; i++) {
+		fprintf(f, "  %4d: at %8.2f ms, %3d columns, art frame %3d, "
+		        "output %6.2f ms\n", i, splash_frames[i].start_ms,
+		        splash_frames[i].columns, splash_frames[i].art_frame,
+		        splash_frames[i].output_ms);
+		if (splash_frames[i].output_ms > worst)
+			worst = splash_frames[i].output_ms;
+	}
+	fprintf(f, "  %d frames in %.2f ms, slowest output %.2f ms\n",
+	        splash_num_frames, splash_total_ms, worst);
+#else
+	(void)f;
+#endif
 }
 
 static int splash_compute_layout(const struct splash_params *params,
                                  struct splash_layout *layout)
 {
-	layout->splash_lines = count_lines(splash_contents);
-	layout->splash_width = max_line_width(splash_contents);
+	layout->splash_lines = art.lines;
+	layout->splash_width = art.width;
 	getmaxyx(stdscr, layout->maxy, layout->maxx);
 
 	if (layout->splash_lines + 5 > layout->maxy) {
@@ -133,6 +178,7 @@ static int splash_compute_layout(const struct splash_params *params,
 	}
 	if ((int)strlen(params->copyright) > layout->maxx) {
 		set_error(EBIGTEXT);
+		return -1;
 	}
 
 	layout->top = layout->maxy - (layout->splash_lines + 3);
@@ -148,87 +194,282 @@ static int splash_compute_layout(const struct splash_params *params,
 	}
 
 	layout->copyright_start_x = (layout->maxx - strlen(params->copyright))/2;
+	layout->bar_y = layout->top + layout->splash_lines + 1 + layout->bottom;
 	return 0;
 }
 
-void splash_display(const struct splash_params *params,
-                    const struct splash_layout *layout)
+/**
+ * Draw the whole splash screen, showing the given frame of the art, with the
+ * progress bar filled up to column x.
+ */
+static void splash_draw(const struct splash_params *params,
+                        const struct splash_layout *layout, int frame, int x)
 {
-	int line_length, y, x;
-	char *splash_ptr = splash_contents;
-	y = layout->top;
-	while (*splash_ptr != '\0') {
-		line_length = strchr(splash_ptr, '\n') - splash_ptr;
-		mvaddnstr(y, layout->splash_start_x, splash_ptr, line_length);
-		y++;
-		splash_ptr += line_length + 1;
-	}
-	y = layout->top + layout->splash_lines; /* just in case */
+	int y;
+	clear();
+	art_draw(&art, frame, layout->top, layout->splash_start_x);
+	y = layout->top + layout->splash_lines;
 	mvaddstr(y, layout->tagline_start_x, params->tagline);
 	y += 2 + layout->bottom;
 	mvaddstr(y, layout->copyright_start_x, params->copyright);
-	move(y - 1, 0);
-	x = 0;
-	refresh();
-	while (x < layout->maxx) {
-		splash_sleep(layout->maxx);
-		addch(' ' | A_REVERSE);
-		x++;
-		refresh();
-	}
-	splash_sleep(layout->maxx); /* for good measure */
+	if (x > 0)
+		mvhline(layout->bar_y, 0, ' ' | A_REVERSE, x);
+}
+
+/*
+ * The progress bar, and the art if it has several frames, are animated on the
+ * event loop (see loop.c). Normally, the bar fills on a timer (see
+ * timed_due()). With a minimum time configured, it shows how far along loading
+ * is instead, and ends as soon as loading is done (see progress_goal()). The
+ * splash ends when the bar is full, and an animation which is still going is
+ * cut short.
+ *
+ * The timer is set to deadlines on the monotonic clock: the next column or tick
+ * of the bar, or the next frame of the art, whichever is first. Each update
+ * draws the columns which are due and the changes to the art since the frame
+ * last shown, so falling behind just means some frames are skipped.
+ *
+ * If the terminal is resized meanwhile (SIGWINCH), the layout is recomputed and
+ * the screen redrawn, keeping the same amount of progress. When the terminal
+ * gets too small to fit the splash, the bar keeps going but nothing is drawn
+ * until it grows again. Key presses are read and ignored, and SIGTERM, SIGINT
+ * or SIGHUP end the splash early, asking the program to quit.
+ */
+struct splash_state {
+	const struct splash_params *params;
+	struct splash_layout *layout;
+	struct loader *loader;
+	struct timespec start;
+	int x, tick, shown;
+	bool fits, timed, quit;
+	struct loop_source input, timer, resized, quitting;
+};
+
+/**
+ * Set the timer for the next update: the next column or tick of the bar, or
+ * the next frame of the art.
+ */
+static int splash_schedule(struct splash_state *s)
+{
+	struct timespec deadline;
+	double due;
+
+	if (s->timed)
+		due = timed_due(s->params, s->x, s->layout->maxx);
+	else
+		due = (double)++s->tick / SPLASH_FPS;
+	if (s->shown + 1 < art.frames && art.times[s->shown + 1] < due)
+		due = art.times[s->shown + 1];
+	deadline = splash_deadline(&s->start, due);
+	return loop_timer_at(&s->timer, &deadline);
+}
+
+/**
+ * Draw whatever came due, when the timer goes off.
+ */
+static int splash_tick(struct loop *loop, struct loop_source *source)
+{
+	struct splash_state *s = source->data;
+	struct splash_layout *layout = s->layout;
+	struct timespec deadline;
+	int goal, due_frame;
+#ifdef DEBUG
+	double frame_ms;
+#endif
+
+	if (s->x >= layout->maxx) {
+		/* the full bar has been shown for long enough */
+		loop_stop(loop);
+		return 0;
+	}
+	if (s->timed)
+		goal = timed_goal(s->params, &s->start, layout->maxx);
+	else
+		goal = progress_goal(s->params, s->loader, &s->start,
+		                     layout->maxx);
+	due_frame = art_frame_at(&art, splash_elapsed(&s->start));
+	if (goal <= s->x && due_frame == s->shown)
+		return splash_schedule(s);
+#ifdef DEBUG
+	frame_ms = splash_elapsed(&s->start) * 1000;
+	if (splash_num_frames < SPLASH_FRAMES_MAX) {
+		splash_frames[splash_num_frames].start_ms = frame_ms;
+		splash_frames[splash_num_frames].columns =
+			goal > s->x ? goal - s->x : 0;
+		splash_frames[splash_num_frames].art_frame = due_frame;
+	}
+#endif
+	/* curses sends only the net change of skipped frames */
+	while (s->shown < due_frame) {
+		s->shown++;
+		if (s->fits)
+			art_draw_diff(&art, s->shown, layout->top,
+			              layout->splash_start_x);
+	}
+	if (goal > s->x) {
+		if (s->fits)
+			mvhline(layout->bar_y, s->x, ' ' | A_REVERSE,
+			        goal - s->x);
+		s->x = goal;
+	}
+	wnoutrefresh(stdscr);
+	stats_doupdate();
+#ifdef DEBUG
+	if (splash_num_frames < SPLASH_FRAMES_MAX)
+		splash_frames[splash_num_frames++].output_ms =
+			splash_elapsed(&s->start) * 1000 - frame_ms;
+#endif
+
+	if (s->x < layout->maxx)
+		return splash_schedule(s);
+	if (!s->timed || s->params->duration <= 0) {
+		loop_stop(loop);
+		return 0;
+	}
+	/* for good measure, show the full bar for a column's time */
+	deadline = splash_deadline(&s->start, s->params->duration *
+	                           (layout->maxx + 1) / layout->maxx);
+	return loop_timer_at(&s->timer, &deadline);
+}
+
+/**
+ * Read and ignore key presses.
+ */
+static int splash_input(struct loop *loop, struct loop_source *source)
+{
+	(void)loop;
+	(void)source;
+	while (getch() != ERR)
+		;
+	return 0;
+}
+
+/**
+ * Lay the splash out again for the new size of the terminal, on SIGWINCH.
+ */
+static int splash_resize(struct loop *loop, struct loop_source *source)
+{
+	struct splash_state *s = source->data;
+	int old_maxx = s->layout->maxx;
+
+	if (!loop_term_resized(STDOUT_FILENO))
+		return 0;
+	splash_input(loop, source); /* the KEY_RESIZE */
+	s->fits = splash_compute_layout(s->params, s->layout) == 0;
+	clear_error(); /* the error was handled by not drawing */
+	s->x = s->x * s->layout->maxx / old_maxx;
+	s->shown = art_frame_at(&art, splash_elapsed(&s->start));
+	if (s->fits)
+		splash_draw(s->params, s->layout, s->shown, s->x);
+	else
+		clear();
+	wnoutrefresh(stdscr);
+	stats_doupdate();
+	return 0;
+}
+
+/**
+ * End the splash early, when asked to quit by a signal.
+ */
+static int splash_quit(struct loop *loop, struct loop_source *source)
+{
+	struct splash_state *s = source->data;
+
+	s->quit = true;
+	loop_stop(loop);
+	return 0;
 }
 
 /**
- * Play a startup sound located at "/var/local/console.wav".
- * I was able to find the console startup noise from the Alien: Isolation game
- * resources. However I'm not going to distribute it because copyright.
- * This function returns regardless of error. You should be a good parent and
- * wait on the pid if it is positive.
+ * Show the splash screen until the bar is full. Returns 1 if asked to quit
+ * meanwhile, 0 otherwise, or -1 on error.
  */
-static pid_t play_startup_sound(const struct splash_params *params)
+static int splash_display(const struct splash_params *params,
+                          struct splash_layout *layout, struct loader *loader)
 {
-	pid_t pid = fork();
-	if (pid == 0) {
-		/* child */
-		char *cmd[] = {
-			params->audio_player,
-			"/var/local/console.wav",
-			NULL
-		};
-		/* rather than trying to shut up the audio player with some
-		 * magic flag, just redirect stderr and stdout to /dev/null */
-		int nul = open("/dev/null", O_WRONLY);
-		dup2(nul, STDERR_FILENO);
-		dup2(nul, STDOUT_FILENO);
-		if (execvp(cmd[0], cmd) == -1) {
-			exit(5);
-		}
-		exit(0);
-	}
-	return pid;
+	struct splash_state s = {
+		.params = params,
+		.layout = layout,
+		.loader = loader,
+		.fits = true,
+		.timed = params->min_time < 0,
+		.input = { .fd = -1, .handle = splash_input },
+		.timer = { .fd = -1, .handle = splash_tick, .data = &s },
+		.resized = { .fd = -1, .handle = splash_resize, .data = &s },
+		.quitting = { .fd = -1, .handle = splash_quit, .data = &s },
+	};
+	struct loop *loop;
+	int rv = -1;
+
+	loop = loop_new();
+	if (!loop) {
+		mark_error();
+		return -1;
+	}
+	loop_signal(loop, SIGWINCH, &s.resized);
+	loop_signal(loop, SIGTERM, &s.quitting);
+	loop_signal(loop, SIGINT, &s.quitting);
+	loop_signal(loop, SIGHUP, &s.quitting);
+	if (loop_watch(loop, &s.input, STDIN_FILENO) < 0 ||
+	    loop_timer(loop, &s.timer) < 0 || sound_watch(loop) < 0) {
+		mark_error();
+		goto cleanup;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &s.start);
+	nodelay(stdscr, TRUE);
+	splash_draw(params, layout, s.shown, s.x);
+	wnoutrefresh(stdscr);
+	stats_doupdate();
+	if (splash_schedule(&s) < 0 || loop_run(loop) < 0) {
+		mark_error();
+		goto cleanup;
+	}
+#ifdef DEBUG
+	splash_total_ms = splash_elapsed(&s.start) * 1000;
+#endif
+	rv = s.quit ? 1 : 0;
+
+cleanup:
+	nodelay(stdscr, FALSE);
+	sound_unwatch(loop);
+	loop_close(loop, &s.timer);
+	loop_watch(loop, &s.input, -1);
+	loop_free(loop);
+	return rv;
 }
 
-int splash(const struct splash_params *params)
+/**
+ * Show the splash screen, while the loader loads content in the background.
+ * Returns 1 if asked to quit meanwhile (by a signal), 0 otherwise, or -1 on
+ * error.
+ */
+int splash(const struct splash_params *params, struct loader *loader)
 {
 	struct splash_layout layout;
-	pid_t sound;
+	int rv;
 
-	if (splash_load(params->file) < 0) {
+	TRACE_BEGIN(load, "splash_load");
+	if (params->file)
+		rv = art_load(params->file, &art);
+	else
+		rv = art_load_text(params->art, params->art_size, &art);
+	TRACE_END(load);
+	if (rv < 0) {
 		mark_error();
 		return -1;
 	}
 
 	if (splash_compute_layout(params, &layout) < 0) {
 		mark_error();
+		art_free(&art);
 		return -1;
 	}
 
-	sound = play_startup_sound(params);
-	splash_display(params, &layout);
-	if (sound > 0) {
-		int stuff;
-		waitpid(sound, &stuff, 0);
-	}
-	return 0;
+	sound_play(params->audio_player);
+	rv = splash_display(params, &layout, loader);
+	if (rv < 0)
+		mark_error();
+	art_free(&art);
+	return rv;
 }
@@ -0,0 +1,240 @@
+/**
+ * alien-console: terminal output accounting
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * This measures what the interface costs on the wire: bytes and write() calls
+ * sent to the terminal by each doupdate(), and by each input event. It's
+ * enabled by setting ALIEN_CONSOLE_STATS in the environment, otherwise
+ * stats_doupdate() is just doupdate().
+ *
+ * It would be nice to simply hand newterm() a FILE which counts what passes
+ * through it, but ncurses writes straight to the file descriptor behind the
+ * FILE, and uses it for terminal modes too. Instead, the kernel's per-thread
+ * I/O counters are read around each doupdate(). The UI thread writes nothing
+ * else while curses is running, so the difference is exactly the output.
+ */
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ncurses.h>
+
+#include "alien-console.h"
+
+struct output_count {
+	unsigned long long bytes;
+	unsigned long long writes;
+	unsigned long frames;
+};
+
+static struct {
+	bool enabled;
+	bool overlay;
+	int io_fd; /* /proc/thread-self/io of the UI thread */
+
+	bool in_event;
+	struct output_count total;
+	struct output_count startup; /* before the first input event */
+	struct output_count event; /* the input event being handled */
+	struct output_count last; /* the last input event handled */
+	struct output_count events; /* sum over all input events */
+	unsigned long num_events;
+	unsigned long long max_event_bytes;
+	char line[80];
+} stats;
+
+/**
+ * Read the bytes written and write() calls made by this thread so far.
+ */
+static bool read_io(unsigned long long *bytes, unsigned long long *writes)
+{
+	char buf[512], *p;
+	ssize_t len = pread(stats.io_fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
+	p = strstr(buf, "wchar:");
+	if (!p || sscanf(p, "wchar: %llu", bytes) != 1)
+		return false;
+	p = strstr(buf, "syscw:");
+	if (!p || sscanf(p, "syscw: %llu", writes) != 1)
+		return false;
+	return true;
+}
+
+static void add_count(struct output_count *to, const struct output_count *c)
+{
+	to->bytes += c->bytes;
+	to->writes += c->writes;
+	to->frames += c->frames;
+}
+
+/**
+ * Enable accounting if requested in the environment. This must be called from
+ * the thread which will drive ncurses.
+ */
+void stats_init(void)
+{
+	memset(&stats, 0, sizeof(stats));
+	if (!getenv("ALIEN_CONSOLE_STATS"))
+		return;
+	stats.io_fd = open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC);
+	stats.enabled = stats.io_fd >= 0;
+}
+
+/**
+ * Return true when accounting is enabled.
+ */
+bool stats_enabled(void)
+{
+	return stats.enabled;
+}
+
+/**
+ * Update the terminal with doupdate(), counting what it wrote.
+ */
+static void count_doupdate(void)
+{
+	unsigned long long bytes0, writes0, bytes1, writes1;
+	struct output_count frame;
+
+	if (!stats.enabled || !read_io(&bytes0, &writes0)) {
+		doupdate();
+		return;
+	}
+	doupdate();
+	if (!read_io(&bytes1, &writes1))
+		return;
+
+	frame.bytes = bytes1 - bytes0;
+	frame.writes = writes1 - writes0;
+	frame.frames = 1;
+	if (stats.in_event)
+		add_count(&stats.event, &frame);
+	else if (stats.num_events == 0)
+		add_count(&stats.startup, &frame);
+	stats.total.bytes += frame.bytes;
+	stats.total.writes += frame.writes;
+	/* published last, see stats_frame_count() */
+	__atomic_store_n(&stats.total.frames, stats.total.frames + 1,
+	                 __ATOMIC_RELEASE);
+}
+
+/**
+ * Update the terminal, timing it when tracing, since the first few updates are
+ * what startup ends with.
+ */
+void stats_doupdate(void)
+{
+	TRACE_BEGIN(span, "doupdate");
+	count_doupdate();
+	TRACE_END(span);
+}
+
+/**
+ * Mark the start of handling an input event. Whatever is output until
+ * stats_end_event() is charged to it.
+ */
+void stats_begin_event(void)
+{
+	memset(&stats.event, 0, sizeof(stats.event));
+	stats.in_event = true;
+}
+
+/**
+ * Mark the end of handling an input event.
+ */
+void stats_end_event(void)
+{
+	if (!stats.in_event)
+		return;
+	stats.in_event = false;
+	stats.last = stats.event;
+	add_count(&stats.events, &stats.event);
+	if (stats.event.bytes > stats.max_event_bytes)
+		stats.max_event_bytes = stats.event.bytes;
+	/* published last, see stats_event_count() */
+	__atomic_store_n(&stats.num_events, stats.num_events + 1,
+	                 __ATOMIC_RELEASE);
+}
+
+/**
+ * Return the number of frames output so far. This may be called from another
+ * thread (like the benchmark's), which may then read the totals with
+ * stats_totals() as of that frame.
+ */
+unsigned long stats_frame_count(void)
+{
+	return __atomic_load_n(&stats.total.frames, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Return the number of input events handled so far. Like stats_frame_count(),
+ * this may be called from another thread.
+ */
+unsigned long stats_event_count(void)
+{
+	return __atomic_load_n(&stats.num_events, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Read the total output so far. From another thread, this is only consistent
+ * while the interface is idle, waiting for input.
+ */
+void stats_totals(unsigned long long *bytes, unsigned long long *writes)
+{
+	*bytes = stats.total.bytes;
+	*writes = stats.total.writes;
+}
+
+/**
+ * Toggle whether the interface should display the overlay.
+ */
+void stats_toggle_overlay(void)
+{
+	stats.overlay = stats.enabled && !stats.overlay;
+}
+
+/**
+ * Return a short line describing the last input event, for display in the
+ * interface, or NULL if the overlay is off. Drawing it costs some output of its
+ * own, which is charged to the event being handled.
+ */
+const char *stats_overlay(void)
+{
+	if (!stats.overlay)
+		return NULL;
+	snprintf(stats.line, sizeof(stats.line),
+	         "last: %lluB %lluw %luf | total: %lluB",
+	         stats.last.bytes, stats.last.writes, stats.last.frames,
+	         stats.total.bytes);
+	return stats.line;
+}
+
+/**
+ * Report a summary of the terminal output. Like report_error(), this is meant
+ * to be called once curses has ended.
+ */
+void stats_report(FILE *f)
+{
+	if (!stats.enabled)
+		return;
+
+	fprintf(f, "Terminal output\n");
+	fprintf(f, "  total:   %llu bytes, %llu writes, %lu frames\n",
+	        stats.total.bytes, stats.total.writes, stats.total.frames);
+	fprintf(f, "  startup: %llu bytes, %llu writes, %lu frames\n",
+	        stats.startup.bytes, stats.startup.writes,
+	        stats.startup.frames);
+	if (stats.num_events == 0)
+		return;
+	fprintf(f, "  events:  %lu, per event %.1f bytes, %.1f writes, "
+	        "%.2f frames (max %llu bytes)\n", stats.num_events,
+	        (double)stats.events.bytes / stats.num_events,
+	        (double)stats.events.writes / stats.num_events,
+	        (double)stats.events.frames / stats.num_events,
+	        stats.max_event_bytes);
+}
@@ -0,0 +1,275 @@
+/**
+ * alien-console: shared content
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * The personal terminal gets the content of its entries from the store, rather
+ * than loading it itself. When one process drives several terminals (see
+ * server.c), they share whatever they have loaded: each content file is mapped
+ * once, and given one line index for each width in use, however many terminals
+ * show it. So memory grows with the number of distinct files, not with the
+ * number of terminals.
+ *
+ * Contents are reference counted, and freed when the last terminal lets go of
+ * them (each terminal's cache decides when, see cache_load() in pt.c). Since
+ * the terminals all run on the interface thread, nothing is locked. A shared
+ * line index still grows lazily, as any of the terminals scrolls further, but
+ * lines are only ever appended to it, so the others' scroll positions stay
+ * valid.
+ *
+ * Followed entries are appended to underneath whoever shows them, and each
+ * terminal keeps its own view pinned to the bottom, so they're private: each
+ * terminal gets content of its own, which it may rewrap in place. So are
+ * entries whose file couldn't be loaded, so that each terminal tries it again
+ * (see cache_load() in pt.c) rather than being handed the old failure. A
+ * terminal jumping to the far end of a long entry gets content of its own too
+ * (see store_own()), so that its line index may be started over there.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "alien-console.h"
+
+struct store_item {
+	struct content content; /* first, so the content leads to its item */
+	bool shared;
+	char *file; /* while other terminals may look it up, otherwise NULL */
+	int refs;
+	struct store_item *prev, *next; /* in the lookup list */
+};
+
+struct store {
+	struct loader *loader;
+	struct store_item *items; /* shared items which may be looked up */
+};
+
+/**
+ * Create a store, which takes content from the loader where it can.
+ */
+struct store *store_new(struct loader *loader)
+{
+	struct store *store = calloc(1, sizeof(struct store));
+	if (!store) {
+		set_error(EMEM);
+		return NULL;
+	}
+	store->loader = loader;
+	return store;
+}
+
+static struct store_item *find_item(struct store *store, const char *file,
+                                    int width)
+{
+	struct store_item *item;
+	for (item = store->items; item; item = item->next) {
+		if (item->content.width == width &&
+		    strcmp(item->file, file) == 0)
+			return item;
+	}
+	return NULL;
+}
+
+static void unlink_item(struct store *store, struct store_item *item)
+{
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		store->items = item->next;
+	if (item->next)
+		item->next->prev = item->prev;
+	free(item->file);
+	item->file = NULL;
+}
+
+/**
+ * Load an item's content and wrap it, taking it from the loader if it was
+ * loaded in the background (with the given slot, or -1). A file which can't be
+ * loaded gets a message in its place (see content_fail()), so only running out
+ * of memory is an error.
+ */
+static int load_item(struct store *store, int dirfd,
+                     const struct pt_entry *entry, int slot, int width,
+                     struct store_item *item)
+{
+	int rv = 0;
+
+	if (slot >= 0)
+		rv = loader_take(store->loader, slot, &item->content);
+	if (rv == 0) {
+		rv = content_load_entry(dirfd, entry, &item->content);
+	} else if (rv > 0 && entry->follow &&
+	           content_update(&item->content) < 0) {
+		/* appended since */
+		content_free(&item->content);
+		rv = -1;
+	}
+	if (rv < 0 && (get_error() == EMEM ||
+	               content_fail(entry->content_file, &item->content) < 0)) {
+		mark_error();
+		return -1;
+	}
+
+	if (content_wrap(&item->content, width) < 0) {
+		mark_error();
+		content_free(&item->content);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Return the content of an entry, wrapped to width, loading it unless some
+ * other terminal has it already. The slot is the entry's number in the loader,
+ * or -1 if it isn't the loader's to take. Hand it back with store_put().
+ */
+struct content *store_get(struct store *store, int dirfd,
+                          const struct pt_entry *entry, int slot, int width)
+{
+	struct store_item *item;
+
+	if (!entry->follow) {
+		item = find_item(store, entry->content_file, width);
+		if (item) {
+			item->refs++;
+			return &item->content;
+		}
+	}
+
+	item = calloc(1, sizeof(struct store_item));
+	if (!item) {
+		set_error(EMEM);
+		return NULL;
+	}
+	if (load_item(store, dirfd, entry, slot, width, item) < 0) {
+		mark_error();
+		free(item);
+		return NULL;
+	}
+	item->refs = 1;
+	if (entry->follow || item->content.failed)
+		return &item->content; /* failed ones are tried again, by whoever */
+
+	item->shared = true;
+	item->file = strdup(entry->content_file);
+	if (!item->file) {
+		set_error(EMEM);
+		content_free(&item->content);
+		free(item);
+		return NULL;
+	}
+	item->next = store->items;
+	if (store->items)
+		store->items->prev = item;
+	store->items = item;
+	return &item->content;
+}
+
+/**
+ * Return the entry's content wrapped to a new width, in place of c. Private
+ * content is simply wrapped again, while shared content is swapped for the
+ * content at the new width. On failure, NULL is returned and c is left as it
+ * was.
+ */
+struct content *store_rewrap(struct store *store, int dirfd,
+                             const struct pt_entry *entry, struct content *c,
+                             int width)
+{
+	struct store_item *item = (struct store_item *)c;
+	struct content *rewrapped;
+
+	if (!item->shared) {
+		if (content_wrap(c, width) < 0) {
+			mark_error();
+			return NULL;
+		}
+		return c;
+	}
+	rewrapped = store_get(store, dirfd, entry, -1, width);
+	if (!rewrapped) {
+		mark_error();
+		return NULL;
+	}
+	store_put(store, c);
+	return rewrapped;
+}
+
+/**
+ * Make the content in *c the caller's alone, so that its line index may be
+ * started over (see content_restart()) without renumbering anyone else's lines.
+ * Shared content nobody else has is simply no longer handed out, while content
+ * other terminals have too is swapped for a copy of the entry's own. Returns 1
+ * when *c is the caller's, 0 if the file can't be loaded again to copy it (*c
+ * is left as it was), or -1 on error.
+ */
+int store_own(struct store *store, int dirfd, const struct pt_entry *entry,
+              struct content **c)
+{
+	struct store_item *item = (struct store_item *)*c, *own;
+
+	if (!item->shared)
+		return 1;
+	if (item->refs == 1) {
+		if (item->file)
+			unlink_item(store, item);
+		item->shared = false;
+		return 1;
+	}
+
+	own = calloc(1, sizeof(struct store_item));
+	if (!own) {
+		set_error(EMEM);
+		return -1;
+	}
+	if (load_item(store, dirfd, entry, -1, (*c)->width, own) < 0) {
+		mark_error();
+		free(own);
+		return -1;
+	}
+	if (own->content.failed) {
+		/* gone since, but the text we have is still mapped */
+		content_free(&own->content);
+		free(own);
+		return 0;
+	}
+	own->refs = 1;
+	store_put(store, *c);
+	*c = &own->content;
+	return 1;
+}
+
+/**
+ * Let go of content from store_get(), freeing it if nobody else has it.
+ */
+void store_put(struct store *store, struct content *c)
+{
+	struct store_item *item = (struct store_item *)c;
+
+	if (--item->refs > 0)
+		return;
+	if (item->file)
+		unlink_item(store, item);
+	content_free(c);
+	free(item);
+}
+
+/**
+ * Stop handing out the content of a file which changed. Terminals which have it
+ * keep it until they let go, and the file is loaded again for the next one.
+ */
+void store_forget(struct store *store, const char *content_file)
+{
+	struct store_item *item, *next;
+
+	for (item = store->items; item; item = next) {
+		next = item->next;
+		if (strcmp(item->file, content_file) == 0)
+			unlink_item(store, item);
+	}
+}
+
+/**
+ * Free the store. Every content must have been handed back by now.
+ */
+void store_free(struct store *store)
+{
+	free(store);
+}
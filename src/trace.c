@@ -0,0 +1,183 @@
+/**
+ * alien-console: startup tracing
+ * Copyright (c) 2017 Stephen Brennan. Released under the Revised BSD License.
+ *
+ * Times the phases of startup (finding and parsing the configuration, loading
+ * the splash art and content, wrapping, the first screen updates), and each
+ * input event after that, as spans. They're written out when the program exits
+ * in the Chrome trace event format, which chrome://tracing and Perfetto load,
+ * showing each thread's spans on a timeline.
+ *
+ * Tracing is only built with `make trace` (which defines TRACE). Otherwise the
+ * TRACE_* macros in alien-console.h expand to nothing, and nothing here is
+ * built. When built, it's enabled by setting ALIEN_CONSOLE_TRACE to the file to
+ * write, and a span costs two clock reads and a locked append. Spans may end on
+ * any thread, since content is loaded and indexed in the background.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alien-console.h"
+
+#ifdef TRACE
+#define TRACE_EVENTS_MAX (1 << 18) /* later spans are dropped */
+#define TRACE_DETAIL 64
+
+struct trace_event {
+	const char *name;
+	char detail[TRACE_DETAIL]; /* or empty */
+	uint64_t start, end; /* nanoseconds since trace_init() */
+	pid_t tid;
+};
+
+static struct {
+	const char *filename; /* NULL when tracing is off */
+	uint64_t epoch;
+
+	pthread_mutex_t lock; /* protects the rest */
+	struct trace_event *events;
+	int num_events, alloc_events;
+	int dropped;
+} tracer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t trace_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Start tracing, if ALIEN_CONSOLE_TRACE names a file to write the trace to.
+ * Called first thing, before any other thread starts.
+ */
+void trace_init(void)
+{
+	const char *filename = getenv("ALIEN_CONSOLE_TRACE");
+
+	if (!filename || !*filename)
+		return;
+	tracer.filename = filename;
+	tracer.epoch = trace_clock();
+}
+
+/**
+ * Start timing a span. The name must be a string literal (or live as long).
+ */
+void trace_begin(struct trace_span *span, const char *name)
+{
+	span->name = name;
+	span->start = tracer.filename ? trace_clock() - tracer.epoch : 0;
+}
+
+/**
+ * Finish timing a span, recording it with an optional detail, like a filename,
+ * which is copied (and cut short if need be).
+ */
+void trace_end(const struct trace_span *span, const char *detail)
+{
+	struct trace_event *event, *events;
+	uint64_t end;
+
+	if (!tracer.filename)
+		return;
+	end = trace_clock() - tracer.epoch;
+
+	pthread_mutex_lock(&tracer.lock);
+	if (tracer.num_events == tracer.alloc_events) {
+		events = NULL;
+		if (tracer.alloc_events < TRACE_EVENTS_MAX)
+			events = realloc(tracer.events,
+			                 (2 * tracer.alloc_events + 64) *
+			                 sizeof(struct trace_event));
+		if (!events) {
+			tracer.dropped++;
+			pthread_mutex_unlock(&tracer.lock);
+			return;
+		}
+		tracer.events = events;
+		tracer.alloc_events = 2 * tracer.alloc_events + 64;
+	}
+	event = &tracer.events[tracer.num_events++];
+	event->name = span->name;
+	snprintf(event->detail, sizeof(event->detail), "%s",
+	         detail ? detail : "");
+	event->start = span->start;
+	event->end = end;
+	event->tid = gettid();
+	pthread_mutex_unlock(&tracer.lock);
+}
+
+/**
+ * Write a string as a JSON string literal.
+ */
+static void write_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/**
+ * Write the trace, if tracing, and stop. Called last thing, once the other
+ * threads are done. Failing to write it is reported on stderr, since the error
+ * being reported (if any) is the program's.
+ */
+void trace_finish(void)
+{
+	struct trace_event *event;
+	pid_t pid = getpid();
+	FILE *f;
+	int i;
+
+	if (!tracer.filename)
+		return;
+	f = fopen(tracer.filename, "w");
+	if (!f) {
+		perror(tracer.filename);
+		goto cleanup;
+	}
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (i = 0; i < tracer.num_events; i++) {
+		event = &tracer.events[i];
+		fprintf(f, "{\"name\":");
+		write_string(f, event->name);
+		fprintf(f, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+		        "\"pid\":%d,\"tid\":%d", event->start / 1e3,
+		        (event->end - event->start) / 1e3, (int)pid,
+		        (int)event->tid);
+		if (event->detail[0]) {
+			fprintf(f, ",\"args\":{\"detail\":");
+			write_string(f, event->detail);
+			fputc('}', f);
+		}
+		fprintf(f, "},\n");
+	}
+	/* name the process, which also spares the trailing comma */
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	        "\"args\":{\"name\":\"alien-console\"}}\n]}\n", (int)pid);
+	if (fclose(f) != 0)
+		perror(tracer.filename);
+	if (tracer.dropped)
+		fprintf(stderr, "alien-console: %d spans weren't traced\n",
+		        tracer.dropped);
+cleanup:
+	free(tracer.events);
+	tracer.events = NULL;
+	tracer.num_events = tracer.alloc_events = 0;
+	tracer.filename = NULL;
+}
+#endif